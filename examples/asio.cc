@@ -39,6 +39,7 @@ public:
         : boost::asio::io_service::service(io_service)
         , srv_()
         , handler_()
+        , timer_(io_service)
     {
         http_server_init(&srv_);
         // srv_.sock_listen_data = NULL; // should be null by default
@@ -92,6 +93,7 @@ public:
     }
     void shutdown_service()
     {
+        timer_.cancel();
     }
     void start()
     {
@@ -100,8 +102,36 @@ public:
         {
             throw boost::system::system_error(result, get_http_error_category(), "http_server_start");   
         }
+        schedule_timers();
     }
 private:
+    /**
+     * Wake up for the nearest server timer. Timeouts of clients and
+     * timers of handlers do not fire otherwise.
+     */
+    void schedule_timers()
+    {
+        long timeout = http_server_timer_timeout(&srv_);
+        if (timeout < 0)
+        {
+            timer_.cancel();
+            return;
+        }
+        timer_.expires_from_now(boost::posix_time::milliseconds(timeout));
+        timer_.async_wait(
+            boost::bind(&http_server_service::handle_timer, this,
+                boost::asio::placeholders::error));
+    }
+    void handle_timer(const boost::system::error_code & error)
+    {
+        if (error == boost::asio::error::operation_aborted)
+        {
+            // Rescheduled or cancelled
+            return;
+        }
+        http_server_timer_run(&srv_);
+        schedule_timers();
+    }
     static http_server_socket_t opensocket_function(void * clientp)
     {
         http_server_service * svc = static_cast<http_server_service *>(clientp);
@@ -203,6 +233,7 @@ private:
             socket));
 
         int result = http_server_socket_action(&srv_, socket->native_handle(), 0);
+        schedule_timers();
         if (result != HTTP_SERVER_OK)
         {
             sockets_.erase(socket->native_handle());
@@ -220,6 +251,7 @@ private:
         }
         fprintf(stderr, "handle read %d\n", socket->native_handle());
         int result = http_server_socket_action(&srv_, socket->native_handle(), HTTP_SERVER_POLL_IN);
+        schedule_timers();
         if (result != HTTP_SERVER_OK)
         {
             if (result != HTTP_SERVER_CLIENT_EOF)
@@ -239,6 +271,7 @@ private:
         }
         fprintf(stderr, "handle write %d\n", socket->native_handle());
         int result = http_server_socket_action(&srv_, socket->native_handle(), HTTP_SERVER_POLL_OUT);
+        schedule_timers();
         if (result != HTTP_SERVER_OK)
         {
             throw boost::system::system_error(result, get_http_error_category(), "http_server_socket_action");
@@ -347,6 +380,8 @@ private:
     }
     http_server srv_;
     http_server_handler handler_;
+    // Fires when the nearest server timer expires
+    boost::asio::deadline_timer timer_;
     // Map of open sockets
     typedef std::map<http_server_socket_t, boost::asio::ip::tcp::acceptor *> acceptors_t;
     acceptors_t acceptors_;
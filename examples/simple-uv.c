@@ -5,6 +5,7 @@
 #include "http-server/http-server.h"
 
 uv_loop_t * loop;
+uv_timer_t timer_handle;
 http_server srv;
 http_server_handler handler;
 
@@ -35,6 +36,27 @@ void destroy_http_context(client_context * context)
     uv_close((uv_handle_t*) &context->poll_handle, &close_cb);
 }
 
+void schedule_timers(void);
+
+void timer_cb(uv_timer_t * handle)
+{
+    http_server_timer_run(&srv);
+    schedule_timers();
+}
+
+// Wake up for the nearest server timer. Timeouts of clients and
+// timers of handlers do not fire otherwise.
+void schedule_timers(void)
+{
+    long timeout = http_server_timer_timeout(&srv);
+    if (timeout < 0)
+    {
+        uv_timer_stop(&timer_handle);
+        return;
+    }
+    uv_timer_start(&timer_handle, timer_cb, (uint64_t)timeout, 0);
+}
+
 void http_perform(uv_poll_t *req, int status, int events)
 {
     fprintf(stderr, "perform (status=%d)\n", status);
@@ -52,6 +74,7 @@ void http_perform(uv_poll_t *req, int status, int events)
     fprintf(stderr, "execute socket action %d\n", ctx->sockfd);
     uv_poll_stop(req);
     http_server_socket_action(&srv, ctx->sockfd, flags);
+    schedule_timers();
 }
 
 int _socket_function(void * clientp, http_server_socket_t sock, int flags, void * socketp)
@@ -124,7 +147,9 @@ int main(int argc, char * argv[])
     result = http_server_setopt(&srv, HTTP_SERVER_OPT_SOCKET_DATA, NULL);
     result = http_server_setopt(&srv, HTTP_SERVER_OPT_SOCKET_FUNCTION, &_socket_function);
 
+    uv_timer_init(loop, &timer_handle);
     http_server_start(&srv);
+    schedule_timers();
     result = uv_run(loop, UV_RUN_DEFAULT);
     http_server_free(&srv);
     return result;
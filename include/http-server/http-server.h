@@ -32,6 +32,7 @@
 typedef int http_server_socket_t;
 #define HTTP_SERVER_INVALID_SOCKET -1
 
+#define HTTP_SERVER_LONG_POINT 0
 #define HTTP_SERVER_POINTER_POINT 100000
 #define HTTP_SERVER_FUNCTION_POINT 200000
 
@@ -52,7 +53,40 @@ typedef enum {
     HTTP_SERVER_CINIT(HANDLER, POINTER, 7),
     HTTP_SERVER_CINIT(HANDLER_DATA, POINTER, 8),
     HTTP_SERVER_CINIT(DEBUG_FUNCTION, FUNCTION, 9),
-    HTTP_SERVER_CINIT(DEBUG_DATA, POINTER, 10)
+    HTTP_SERVER_CINIT(DEBUG_DATA, POINTER, 10),
+    HTTP_SERVER_CINIT(BODY_HIGH_WATERMARK, LONG, 11),
+    HTTP_SERVER_CINIT(BODY_LOW_WATERMARK, LONG, 12),
+    HTTP_SERVER_CINIT(OUTPUT_HIGH_WATERMARK, LONG, 13),
+    HTTP_SERVER_CINIT(OUTPUT_LOW_WATERMARK, LONG, 14),
+    HTTP_SERVER_CINIT(HEADER_TIMEOUT, LONG, 15),
+    HTTP_SERVER_CINIT(BODY_TIMEOUT, LONG, 16),
+    HTTP_SERVER_CINIT(KEEPALIVE_TIMEOUT, LONG, 17),
+    HTTP_SERVER_CINIT(WRITE_TIMEOUT, LONG, 18),
+    HTTP_SERVER_CINIT(MAX_PIPELINE, LONG, 19),
+    HTTP_SERVER_CINIT(MAX_KEEPALIVE_REQUESTS, LONG, 20),
+    HTTP_SERVER_CINIT(RESPONSE_BUFFER_SIZE, LONG, 21),
+    HTTP_SERVER_CINIT(DATE_HEADER, LONG, 22),
+    HTTP_SERVER_CINIT(SERVER_NAME, POINTER, 23),
+    HTTP_SERVER_CINIT(RESPONSE_POOL_SIZE, LONG, 24),
+    HTTP_SERVER_CINIT(CORK, LONG, 25),
+    HTTP_SERVER_CINIT(BIND_ADDRESS, POINTER, 26),
+    HTTP_SERVER_CINIT(PORT, LONG, 27),
+    HTTP_SERVER_CINIT(BACKLOG, LONG, 28),
+    HTTP_SERVER_CINIT(REUSEPORT, LONG, 29),
+    HTTP_SERVER_CINIT(DEFER_ACCEPT, LONG, 30),
+    HTTP_SERVER_CINIT(FASTOPEN, LONG, 31),
+    HTTP_SERVER_CINIT(NODELAY, LONG, 32),
+    HTTP_SERVER_CINIT(SNDBUF, LONG, 33),
+    HTTP_SERVER_CINIT(RCVBUF, LONG, 34),
+    HTTP_SERVER_CINIT(ACCEPT_BUDGET, LONG, 35),
+    HTTP_SERVER_CINIT(MAX_CONNECTIONS, LONG, 36),
+    HTTP_SERVER_CINIT(MAX_INFLIGHT, LONG, 37),
+    HTTP_SERVER_CINIT(RETRY_AFTER, LONG, 38),
+    HTTP_SERVER_CINIT(RATE_LIMIT, LONG, 39),
+    HTTP_SERVER_CINIT(RATE_BURST, LONG, 40),
+    HTTP_SERVER_CINIT(LOG_LEVEL, LONG, 41),
+    HTTP_SERVER_CINIT(LOG_CATEGORIES, LONG, 42),
+    HTTP_SERVER_CINIT(LOG_RING, POINTER, 43)
 } http_server_option;
 
 /**
@@ -118,8 +152,35 @@ typedef int (*http_server_closesocket_callback)(http_server_socket_t sock, void
  */
 typedef int (*http_server_socket_callback)(void * clientp, http_server_socket_t sock, int flags, void * socketp);
 
+/**
+ * Severity of log messages. Messages less severe than the `log_level`
+ * option are dropped before they are formatted. Trace messages are
+ * compiled in only with HTTP_SERVER_ENABLE_TRACE build option.
+ */
+typedef enum {
+    HTTP_SERVER_LOG_ERROR = 1,
+    HTTP_SERVER_LOG_WARNING = 2,
+    HTTP_SERVER_LOG_INFO = 3,
+    HTTP_SERVER_LOG_DEBUG = 4,
+    HTTP_SERVER_LOG_TRACE = 5
+} http_server_log_level;
+
+/**
+ * Subsystems that log messages. Mask of them is the `log_categories`
+ * option.
+ */
+typedef enum {
+    HTTP_SERVER_LOG_SERVER = 1 << 0, // listeners, limits and drain
+    HTTP_SERVER_LOG_CLIENT = 1 << 1, // request parsing and responses
+    HTTP_SERVER_LOG_EVENT = 1 << 2, // event loop polling
+    HTTP_SERVER_LOG_SOCKET = 1 << 3, // socket setup, reads and writes
+    HTTP_SERVER_LOG_TIMER = 1 << 4,
+    HTTP_SERVER_LOG_ALL = 0xff
+} http_server_log_category;
+
 /**
  * Called with some debug message
+ * @param kind Level of the message (http_server_log_level)
  */
 typedef int (*http_server_debug_callback)(int kind, char * ptr, int length, void * clientp);
 
@@ -136,6 +197,25 @@ typedef int (*http_server_handler_cb)(struct http_server_client * client, void *
 /** Received new header callback */
 typedef int (*http_server_header_cb)(struct http_server_client * client, void * data, const char * field, const char * value);
 
+/**
+ * Monotonic timestamps in microseconds of the phases of a request and
+ * its response. Phase that was not reached is 0. Writes are timed when
+ * writev(2) returns so responses sent together share the timestamps.
+ */
+typedef struct http_server_request_trace
+{
+    unsigned long long accepted; // connection the request came on was accepted
+    unsigned long long first_byte_read; // parser saw the start of the request
+    unsigned long long headers_complete;
+    unsigned long long message_complete;
+    unsigned long long response_begin;
+    unsigned long long first_byte_written;
+    unsigned long long last_byte_written;
+} http_server_request_trace;
+
+/** Response was fully sent */
+typedef int (*http_server_request_trace_cb)(struct http_server_client * client, void * data, const http_server_request_trace * trace);
+
 typedef struct http_server_handler
 {
     // Custom user specified data
@@ -149,16 +229,53 @@ typedef struct http_server_handler
     // Called whenever new header is received
     http_server_header_cb on_header;
     void * on_header_data;
+    // Called when output queue drained below low watermark after a write
+    // was refused with HTTP_SERVER_WOULD_BLOCK
+    http_server_handler_cb on_writable;
+    void * on_writable_data;
+    // Called with timestamps of every response that was fully sent.
+    // Request phases are timed only when it is set.
+    http_server_request_trace_cb on_request_trace;
+    void * on_request_trace_data;
 } http_server_handler;
 
+/**
+ * Immutable response serialized once. It is shared by all clients that
+ * send it and queued buffers reference its memory without a copy.
+ */
+typedef struct http_server_prepared_response
+{
+    char * data; // Status line, headers and body
+    int size;
+    int head_len; // Offset of the empty line that ends headers
+    int refcount_;
+} http_server_prepared_response;
+
+/**
+ * Size of blocks small writes are coalesced into
+ */
+#define HTTP_SERVER_BUF_BLOCK_SIZE 4096
+
+/**
+ * Number of free blocks kept for reuse by a server
+ */
+#define HTTP_SERVER_BUF_POOL_SIZE 64
+
 typedef struct http_server_buf
 {
     char * mem; // Memory
     char * data; // Actual data (mem > data is possible)
     int size;
+    int capacity_; // Bytes allocated at `mem`
+    http_server_prepared_response * prepared_; // Owner of `data` if `mem` is NULL
     TAILQ_ENTRY(http_server_buf) bufs;
 } http_server_buf;
 
+/**
+ * Queue of outgoing data
+ */
+TAILQ_HEAD(http_server_bufs, http_server_buf);
+
 struct http_server_header
 {
     TAILQ_ENTRY(http_server_header) headers;
@@ -176,6 +293,41 @@ struct http_server_header * http_server_header_new();
  */
 void http_server_header_free(struct http_server_header * header);
 
+#define HTTP_SERVER_ENUM_KNOWN_HEADERS(XX) \
+    XX(CONTENT_LENGTH, "Content-Length") \
+    XX(TRANSFER_ENCODING, "Transfer-Encoding") \
+    XX(CONNECTION, "Connection") \
+    XX(CONTENT_TYPE, "Content-Type") \
+    XX(DATE, "Date") \
+    XX(SERVER, "Server") \
+    XX(CACHE_CONTROL, "Cache-Control") \
+    XX(LOCATION, "Location")
+
+/**
+ * Response headers with special meaning or commonly used ones
+ */
+typedef enum
+{
+    HTTP_SERVER_HEADER_OTHER = 0,
+#define XX(id, name) HTTP_SERVER_HEADER_ ## id,
+    HTTP_SERVER_ENUM_KNOWN_HEADERS(XX)
+#undef XX
+    HTTP_SERVER_HEADER_COUNT
+} http_server_header_id;
+
+/**
+ * Response header. Whole "Name: value\r\n" line is kept in response's
+ * header storage so it is sent without any formatting.
+ */
+typedef struct http_server_response_header
+{
+    unsigned int hash; // case-insensitive hash of the name
+    int id; // http_server_header_id
+    int off; // offset of the line in header storage
+    int name_len; // 0 if header was removed
+    int value_len;
+} http_server_response_header;
+
 /**
  * HTTP rresponse object
  */
@@ -185,12 +337,172 @@ typedef struct http_server_response
     // a particular client.
     struct http_server_client * client;
     int headers_sent; // are headers sent yet?
-    TAILQ_HEAD(http_server_headers, http_server_header) headers;
+    // Headers in the order they were set
+    http_server_response_header * headers;
+    int headers_len;
+    int headers_size_;
+    http_server_string header_data_; // header lines
+    int known_headers_[HTTP_SERVER_HEADER_COUNT]; // index in headers + 1 or 0
     int is_chunked;
     int is_done; // is response done?
+    // private:
+    int status_code_; // sent together with headers
+    // Body held back until the response ends so it can be sent with
+    // Content-Length instead of chunked encoding
+    int is_buffering_;
+    http_server_string body_;
+    TAILQ_ENTRY(http_server_response) responses_; // client's response queue or server's pool
+    long request_no_; // number of the request on the connection it answers
+    // Output of a pipelined response written before all previous
+    // responses are finished. Moved to client's buffer when this response
+    // becomes the first unfinished one.
+    struct http_server_bufs pending_;
+    long pending_size_;
+    unsigned long long start_time_; // request read time in microseconds
+    http_server_request_trace trace_;
 } http_server_response;
 
 struct http_server;
+struct http_server_timer;
+
+/**
+ * Called when timer expires
+ * @param srv Server that owns the timer
+ * @param timer Expired timer
+ * @param data User data assigned to the timer
+ */
+typedef int (*http_server_timer_callback)(struct http_server * srv, struct http_server_timer * timer, void * data);
+
+/**
+ * Timer driven by the server's event loop
+ */
+typedef struct http_server_timer
+{
+    http_server_timer_callback callback;
+    void * data;
+    // private:
+    LIST_ENTRY(http_server_timer) entries_;
+    unsigned long long expires_; // absolute deadline in milliseconds
+    long repeat_; // interval of repeating timer or 0
+    int is_active_;
+} http_server_timer;
+
+#define HTTP_SERVER_TIMER_WHEEL_BITS 6
+#define HTTP_SERVER_TIMER_WHEEL_SLOTS (1 << HTTP_SERVER_TIMER_WHEEL_BITS)
+#define HTTP_SERVER_TIMER_WHEEL_LEVELS 4
+
+/**
+ * Hierarchical timer wheel with millisecond ticks
+ */
+typedef struct http_server_timer_wheel
+{
+    LIST_HEAD(http_server__timer_slot, http_server_timer) slots[HTTP_SERVER_TIMER_WHEEL_LEVELS][HTTP_SERVER_TIMER_WHEEL_SLOTS];
+    unsigned long long now; // cached loop time
+    unsigned long long current; // next tick to process
+    int count; // armed timers
+} http_server_timer_wheel;
+
+#define HTTP_SERVER_HISTOGRAM_BUCKETS 124
+
+/**
+ * Latency histogram in microseconds. Every power of two range is split
+ * into 4 linear buckets so a recorded value is off by at most 25%. Last
+ * bucket holds everything above 2^32 microseconds.
+ */
+typedef struct http_server_histogram
+{
+    unsigned long long counts[HTTP_SERVER_HISTOGRAM_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+} http_server_histogram;
+
+/**
+ * Server counters, gauges and latencies
+ */
+typedef struct http_server_stats
+{
+    unsigned long long connections_accepted;
+    unsigned long long connections_closed;
+    unsigned long long connections_rejected; // over connection or rate limits
+    unsigned long long requests;
+    unsigned long long requests_rejected; // over in-flight or rate limits
+    unsigned long long responses; // fully sent
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long parser_errors;
+    unsigned long long timeouts;
+    // Gauges filled in by `http_server_get_stats`
+    long connections;
+    long inflight; // requests read and not yet responded to
+    long output_queued; // bytes waiting to be sent to all clients
+    // From the end of a request until response headers are queued
+    http_server_histogram first_byte;
+    // From the end of a request until whole response is sent
+    http_server_histogram response;
+} http_server_stats;
+
+/**
+ * Token bucket of a single peer address
+ */
+typedef struct http_server_rate_bucket
+{
+    unsigned char addr[16]; // IPv6 or IPv4-mapped address
+    unsigned long long updated; // last refill in milliseconds
+    long tokens; // thousandths of a token
+    int is_used;
+} http_server_rate_bucket;
+
+/**
+ * Open addressing table of token buckets
+ */
+typedef struct http_server_rate_table
+{
+    http_server_rate_bucket * buckets;
+    int capacity; // power of two
+    int len;
+    unsigned long long swept; // time of the last eviction
+} http_server_rate_table;
+
+/**
+ * Header of a message in the log ring. Message text follows it and the
+ * next record starts at the next multiple of 8 bytes.
+ */
+typedef struct http_server_log_record
+{
+    unsigned long long time; // monotonic microseconds
+    unsigned short length; // message bytes
+    unsigned char level;
+    unsigned char category;
+} http_server_log_record;
+
+/**
+ * Single producer, single consumer ring of log records. Event loop
+ * writes to it and other thread may read it with
+ * `http_server_log_ring_read` without locking. Records that do not fit
+ * are dropped.
+ */
+typedef struct http_server_log_ring
+{
+    char * data;
+    unsigned long size; // power of two
+    unsigned long head; // advanced by the writer
+    unsigned long tail; // advanced by the reader
+    unsigned long dropped;
+} http_server_log_ring;
+
+/**
+ * Single query string parameter. Name and value are slices of the
+ * client's URL buffer and are percent-decoded on first lookup.
+ */
+typedef struct http_server_query_param
+{
+    int name_off;
+    int name_len;
+    int value_off;
+    int value_len;
+    int is_decoded;
+} http_server_query_param;
 
 /**
  * Represents single HTTP client connection.
@@ -204,14 +516,38 @@ typedef struct http_server_client
     http_parser_settings parser_settings_;
     http_parser parser_; // private
     http_server_handler * handler;
-    http_server_response * current_response_;
+    // Responses in the order they were begun. Finished responses stay on
+    // the queue until all of their data is sent.
+    TAILQ_HEAD(http_server_client__responses, http_server_response) responses_;
+    long pipeline_len_; // requests read but not answered yet
+    // Keep-alive state: number of requests read and responses started on
+    // this connection, and the request after which it is closed (or 0)
+    long requests_;
+    long responses_started_;
+    long close_after_;
+    int is_http10_; // last request is HTTP/1.0
+    int keep_alive_http10_; // HTTP/1.0 client asked for keep-alive
     struct http_server * server_;
     int current_flags; // current I/O poll flags
     int is_complete; // request is complete
     // All outgoing data
-    TAILQ_HEAD(http_server_client__buffer, http_server_buf) buffer;
+    struct http_server_bufs buffer;
+    long buffer_size_; // total bytes queued in `buffer`
+    int wants_writable_; // call `on_writable` when buffer drains
     // URL of the request
     http_server_string url;
+    // Components of the URL split by `http_parser_parse_url`. Path, query,
+    // fragment and a scratch copy of the query (decoded in place) are
+    // stored back to back with NULL separators.
+    http_server_string url_parts_;
+    int url_parsed_; // 0 - not yet, 1 - parsed, -1 - invalid URL
+    int path_off_; // offsets inside `url_parts_` or -1 if missing
+    int query_off_;
+    int fragment_off_;
+    // Index of query string parameters
+    http_server_query_param * query_params_;
+    int query_params_len_;
+    int query_params_size_;
     // all incomming http headers
     TAILQ_HEAD(http_server__request_headers, http_server_header) headers;
     char header_state_; // (S)tart,(F)ield,(V)alue
@@ -219,8 +555,52 @@ typedef struct http_server_client
     http_server_string header_value_;
     // all reading is paused
     int is_paused_;
+    // body bytes passed to `on_body` and not yet acknowledged by the handler
+    long body_pending_;
+    // reading is stopped until the handler consumes body below low watermark
+    int is_throttled_;
+    // close connection once all queued responses are sent
+    int is_closing_;
+    // (H)eaders, (B)ody, (C)omplete or (I)dle between requests
+    char request_state_;
+    // Header-read, body-read, write-stall or keep-alive timeout
+    http_server_timer timeout_timer_;
+    char timeout_phase_; // request_state_ or (W)rite the timer is armed for
+    // listener that accepted this client or NULL
+    struct http_server_listener * listener_;
+    // peer address as IPv6 or IPv4-mapped address
+    unsigned char addr_[16];
+    int has_addr_; // peer is not a Unix socket
+    int is_charged_; // rate limit token taken at accept covers the next request
+    int is_limited_; // status the current request is shed with or 0
+    int in_request_; // part of a request was read and it is not complete
+    unsigned long long request_time_; // microseconds the last request was read at
+    http_server_request_trace trace_; // request being read, when traced
 } http_server_client;
 
+/**
+ * Address family of a listener added by `http_server_add_listener`
+ */
+typedef enum
+{
+    HTTP_SERVER_LISTENER_INET,
+    HTTP_SERVER_LISTENER_INET6,
+    HTTP_SERVER_LISTENER_UNIX
+} http_server_listener_family;
+
+typedef struct http_server_listener
+{
+    http_server_listener_family family;
+    char * address; // IP address, Unix socket path or NULL for any
+    long port;
+    long accept_budget; // -1 - server's `accept_budget`
+    long max_connections; // 0 - unlimited
+    long connections_; // clients accepted on this listener
+    http_server_socket_t sock; // HTTP_SERVER_INVALID_SOCKET until started
+    void * data; // what user assigns
+    SLIST_ENTRY(http_server_listener) next;
+} http_server_listener;
+
 typedef struct http_server
 {
     /**
@@ -265,6 +645,169 @@ typedef struct http_server
      * User passed pointer to the `debug_func` callback
      */
     void * debug_data;
+    /**
+     * Least severe level and mask of categories of messages passed to
+     * `debug_func` and `log_ring`
+     */
+    long log_level; // http_server_log_level (0 - nothing)
+    long log_categories; // mask of http_server_log_category
+    /**
+     * Log ring written with messages. It is owned by the user.
+     */
+    http_server_log_ring * log_ring;
+    long log_threshold_; // `log_level` or 0 without `debug_func` and `log_ring`
+    /**
+     * Stop reading from a client when this many bytes of request body
+     * were passed to the handler and not consumed. Zero disables it.
+     */
+    long body_high_watermark;
+    /**
+     * Resume reading when unconsumed request body drops to this size.
+     */
+    long body_low_watermark;
+    /**
+     * Refuse response writes with HTTP_SERVER_WOULD_BLOCK when this
+     * many bytes are queued for a client. Zero disables it.
+     */
+    long output_high_watermark;
+    /**
+     * Call handler's `on_writable` when queued output drops to this size.
+     */
+    long output_low_watermark;
+    /**
+     * Close a client that did not send full request headers within
+     * this many milliseconds. Zero disables the timeout.
+     */
+    long header_timeout;
+    /**
+     * Close a client that did not send request body within this many
+     * milliseconds after headers.
+     */
+    long body_timeout;
+    /**
+     * Close idle keep-alive connection after this many milliseconds.
+     */
+    long keepalive_timeout;
+    /**
+     * Close a client that did not receive any data within this many
+     * milliseconds while there is output queued.
+     */
+    long write_timeout;
+    /**
+     * Stop reading from a client that has this many responses queued
+     * (0 - unlimited).
+     */
+    long max_pipeline;
+    /**
+     * Close connection after this many requests (0 - unlimited).
+     */
+    long max_keepalive_requests;
+    /**
+     * Hold up to this many bytes of a chunked response body until the
+     * response ends and send it with Content-Length (0 - disabled).
+     */
+    long response_buffer_size;
+    /**
+     * Add Date header to every response (default: 1)
+     */
+    long date_header;
+    /**
+     * Value of Server header added to every response or NULL
+     */
+    const char * server_name;
+    /**
+     * Keep up to this many sent responses for reuse (0 - disabled)
+     */
+    long response_pool_size;
+    /**
+     * Ask the kernel to hold a partial segment when the output queue
+     * does not fit in a single write (MSG_MORE where available,
+     * default: 1)
+     */
+    long cork;
+    /**
+     * Listening socket options used by the default `opensocket_func`
+     */
+    const char * bind_address; // IPv4 address or NULL for any
+    long port; // default: 5000
+    long backlog; // default: SOMAXCONN
+    long reuseport; // SO_REUSEPORT
+    long defer_accept; // TCP_DEFER_ACCEPT seconds (0 - disabled)
+    long fastopen; // TCP_FASTOPEN queue length (0 - disabled)
+    /**
+     * Accepted socket options
+     */
+    long nodelay; // TCP_NODELAY
+    long sndbuf; // SO_SNDBUF (0 - system default)
+    long rcvbuf; // SO_RCVBUF set on the listener (0 - system default)
+    /**
+     * Accept at most this many connections per listener wakeup
+     * (0 - until backlog is empty, default: 64)
+     */
+    long accept_budget;
+    /**
+     * Load shedding. Connections over `max_connections` and requests
+     * over `max_inflight` get 503 Service Unavailable with Retry-After
+     * without reaching the handler (0 - unlimited).
+     */
+    long max_connections;
+    long max_inflight; // requests read and not yet responded to
+    long retry_after; // seconds (default: 1)
+    long connections_;
+    long inflight_;
+    http_server_prepared_response * overload_response_; // made on first use
+    /**
+     * Every new connection and every request after the first one on it
+     * takes a token from the bucket of the peer address. Connections and
+     * requests with an empty bucket get 429 Too Many Requests
+     * (0 - disabled).
+     */
+    long rate_limit; // tokens per second
+    long rate_burst; // bucket size (0 - same as `rate_limit`)
+    http_server_rate_table rate_table_;
+    http_server_prepared_response * rate_limited_response_; // made on first use
+    /**
+     * Sent responses ready to be reused by `http_server_response_acquire`
+     */
+    TAILQ_HEAD(http_server__response_pool, http_server_response) response_pool_;
+    long response_pool_len_;
+    /**
+     * Free output blocks ready to be reused
+     */
+    http_server_buf * buf_pool_[HTTP_SERVER_BUF_POOL_SIZE];
+    int buf_pool_len_;
+    /**
+     * Preformatted Date and Server headers and the loop second they
+     * were formatted at
+     */
+    char common_headers_[256];
+    int common_headers_len_;
+    int common_date_len_; // Date line is first in `common_headers_`
+    long long common_headers_time_; // time(2) the headers were formatted at
+    /**
+     * Timers serviced by the event loop
+     */
+    http_server_timer_wheel timers_;
+    /**
+     * Set by `http_server_drain`. Connections are closed after the
+     * request being read. Remaining ones are closed by the timer.
+     */
+    int is_draining_;
+    http_server_timer drain_timer_;
+    /**
+     * Resumes accepting after listeners were paused by running out of
+     * descriptors or memory
+     */
+    http_server_timer accept_timer_;
+    /**
+     * Counters maintained by the event loop
+     */
+    http_server_stats stats_;
+    /**
+     * Listeners added by `http_server_add_listener` in order. When empty
+     * the server listens on a single socket made by `opensocket_func`.
+     */
+    SLIST_HEAD(http_server__listeners, http_server_listener) listeners;
     /**
      * All connected clients
      */
@@ -295,7 +838,8 @@ typedef struct http_server
     XX(INVALID_PARAM, 4, "Invalid parameter") \
     XX(CLIENT_EOF, 5, "End of file") \
     XX(PARSER_ERROR, 6, "Unable to parse HTTP request") \
-    XX(NO_MEMORY, 7, "Cannot allocate memory")
+    XX(NO_MEMORY, 7, "Cannot allocate memory") \
+    XX(WOULD_BLOCK, 8, "Output queue is full")
 
 #define HTTP_SERVER_ENUM_ERRNO(name, val, descr) \
     HTTP_SERVER_ ## name = val,
@@ -342,12 +886,101 @@ int http_server_setopt(http_server * srv, http_server_option opt, ...);
  */
 int http_server_start(http_server * srv);
 
+/**
+ * Adds a listener to the server. Every listener is dispatched by the same
+ * event loop and the first one becomes `sock_listen`. Once any listener
+ * is added `opensocket_func` is not used anymore.
+ * IPv6 listener accepts IPv4 clients too unless there is an IPv4 listener
+ * on the same port. Stale Unix socket file is replaced on start and
+ * removed on cancel.
+ * @param srv Server
+ * @param family Address family
+ * @param address IP address or NULL for any, Unix socket path
+ * @param port TCP port (ignored for Unix sockets)
+ * @param accept_budget Connections accepted per wakeup or -1 for server's
+ * @param max_connections Connections on this listener over the limit get
+ *                        503 response (0 - unlimited)
+ */
+int http_server_add_listener(http_server * srv, http_server_listener_family family, const char * address, long port, long accept_budget, long max_connections);
+
 /**
  * Cancels the http server and no new connections will be accepted.
  * @param srv Server
  */
 int http_server_cancel(http_server * srv);
 
+/**
+ * Stops accepting connections and closes idle keep-alive connections.
+ * Requests that were already read or are being read are answered and
+ * their connections are closed after the response. Connections still
+ * open after the timeout are closed. Event loop returns when all
+ * connections are closed.
+ * @param srv Server
+ * @param timeout Milliseconds to wait for active connections (0 - wait
+ *                until they finish)
+ */
+int http_server_drain(http_server * srv, long timeout);
+
+/**
+ * Allocate log ring
+ * @param ring Ring
+ * @param size Bytes of records (rounded up to power of two)
+ */
+int http_server_log_ring_init(http_server_log_ring * ring, unsigned long size);
+
+void http_server_log_ring_free(http_server_log_ring * ring);
+
+/**
+ * Take the oldest record from the ring. May be called from other thread
+ * than the event loop.
+ * @param ring Ring
+ * @param record Filled in with the record header
+ * @param buffer Message text truncated and NUL terminated
+ * @param size Size of the buffer
+ * @return 1 if record was read, 0 if the ring is empty
+ */
+int http_server_log_ring_read(http_server_log_ring * ring, http_server_log_record * record, char * buffer, int size);
+
+/**
+ * Get snapshot of server counters, gauges and latency histograms
+ * @param srv Server
+ * @param stats Filled in with current values
+ */
+int http_server_get_stats(http_server * srv, http_server_stats * stats);
+
+/**
+ * Get approximate latency at the given quantile
+ * @param histogram Histogram
+ * @param quantile Between 0 and 1
+ * @return Microseconds
+ */
+unsigned long long http_server_histogram_quantile(const http_server_histogram * histogram, double quantile);
+
+/**
+ * Sends server stats in Prometheus text format and ends the response
+ * @param res Response that has not sent headers yet
+ */
+int http_server_response_send_stats(http_server_response * res);
+
+/**
+ * Sends all listening sockets to a successor process over a connected
+ * Unix socket using SCM_RIGHTS. Sockets stay open in this process until
+ * it is cancelled or drained, so there is no moment when connections are
+ * refused. Unix socket files are not removed anymore.
+ * @param srv Server
+ * @param channel Connected Unix socket
+ */
+int http_server_send_listeners(http_server * srv, http_server_socket_t channel);
+
+/**
+ * Receives listening sockets sent by `http_server_send_listeners` and
+ * adds them as listeners. Call `http_server_start` afterwards to accept
+ * on them.
+ * @param srv Server
+ * @param channel Connected Unix socket
+ */
+int http_server_receive_listeners(http_server * srv, http_server_socket_t channel);
+
 /**
  * Blocks and serves connections
  */
@@ -383,10 +1016,60 @@ int http_server_pop_client(http_server * srv, http_server_socket_t sock);
 int http_server_socket_action(http_server * srv, http_server_socket_t socket, int flags);
 
 /**
- * Send debug message through user callback
+ * Initialize timer before it is started
+ * @param timer Timer
+ * @param callback Called from the event loop when timer expires
+ * @param data User data passed to the callback
+ */
+int http_server_timer_init(http_server_timer * timer, http_server_timer_callback callback, void * data);
+
+/**
+ * Schedule timer on the server's event loop. Starting a timer that is
+ * already running reschedules it.
+ * @param srv Server instance
+ * @param timer Initialized timer
+ * @param timeout Milliseconds until first expiration
+ * @param repeat Interval in milliseconds for repeating timer or 0 for
+ *  a one-shot timer
+ */
+int http_server_timer_start(http_server * srv, http_server_timer * timer, long timeout, long repeat);
+
+/**
+ * Stop timer. It is safe to stop a timer from its own callback.
+ */
+int http_server_timer_stop(http_server * srv, http_server_timer * timer);
+
+/**
+ * Milliseconds until the nearest timer deadline or -1 if no timer is
+ * running. Event loop uses it as its poll timeout.
+ */
+long http_server_timer_timeout(http_server * srv);
+
+/**
+ * Run callbacks of expired timers. Event loop driven through
+ * `HTTP_SERVER_OPT_SOCKET_FUNCTION` calls it once the timeout returned by
+ * `http_server_timer_timeout` passes, and asks for a new timeout after
+ * every socket action.
+ */
+int http_server_timer_run(http_server * srv);
+
+/**
+ * Format message and pass it to `debug_func` and `log_ring`. Use
+ * HTTP_SERVER_LOG macros that check the level first.
+ * @private
+ */
+void http_server__log(http_server * srv, int level, int category, const char * format, ...)
+#if defined(__GNUC__)
+    __attribute__((format(printf, 4, 5)))
+#endif
+    ;
+
+/**
+ * Get 503 or 429 response sent to connections and requests over the
+ * limits
  * @private
  */
-int http_server__debug(http_server * srv, int kind, char * format, ...);
+http_server_prepared_response * http_server__limit_response(http_server * srv, int status_code);
 
 /**
  * Create new HTTP client instance
@@ -400,11 +1083,14 @@ void http_server_client_free(http_server_client * client);
 
 // List of info codes that returns details about client
 #define HTTP_SERVER_ENUM_CLIENT_INFO_CODES(XX) \
-    XX(URL, 0)
+    XX(URL, 0) \
+    XX(PATH, 1) \
+    XX(QUERY, 2) \
+    XX(FRAGMENT, 3)
 
 typedef enum
 {
-#define XX(name, value) HTTP_SERVER_CLIENTINFO ## _ ## name = value
+#define XX(name, value) HTTP_SERVER_CLIENTINFO ## _ ## name = value,
     HTTP_SERVER_ENUM_CLIENT_INFO_CODES(XX)
 #undef XX
 } http_server_clientinfo;
@@ -414,11 +1100,53 @@ typedef enum
  */
 int http_server_client_getinfo(http_server_client * client, http_server_clientinfo, ...);
 
+/**
+ * Look up query string parameter of current request. Value is
+ * percent-decoded. If there is no such parameter then value is NULL.
+ * @param client Client
+ * @param name Parameter name (decoded)
+ * @param value Pointer to parameter value
+ */
+int http_server_client_query_param(http_server_client * client, const char * name, char ** value);
+
 /**
  * Queue raw data to client socket
  */
 int http_server_client_write(http_server_client * client, char * data, int size);
 
+/**
+ * Append copy of the data to the queue of outgoing data
+ * @private
+ */
+int http_server__buf_append(struct http_server * srv, struct http_server_bufs * bufs, const char * data, int size);
+
+/**
+ * Append reference to a part of prepared response to the queue
+ * @private
+ */
+int http_server__buf_append_ref(struct http_server_bufs * bufs, http_server_prepared_response * prepared, int offset, int size);
+
+/**
+ * Get buffer with at least `size` bytes of spare capacity after its data.
+ * Tail of the queue is used if it has room, otherwise a block from
+ * server's pool or a buffer of exact size for large data is queued.
+ * @private
+ */
+http_server_buf * http_server__buf_reserve(struct http_server * srv, struct http_server_bufs * bufs, int size);
+
+/**
+ * Make sure there are at least `size` bytes of spare capacity after
+ * buffer's data
+ * @private
+ */
+int http_server__buf_grow(http_server_buf * buf, int size);
+
+/**
+ * Free queued buffer
+ * @private
+ */
+void http_server__buf_free(struct http_server * srv, http_server_buf * buf);
+
 /**
  * Flush outgoing data queued on client
  */
@@ -430,6 +1158,15 @@ int http_server_client_flush(http_server_client * client);
  */
 int http_server_client_pause(http_server_client * client, int pause);
 
+/**
+ * Acknowledge that handler consumed part of request body delivered
+ * through `on_body`. Used together with body watermarks to resume
+ * reading from the client.
+ * @param client Client
+ * @param size Number of bytes consumed
+ */
+int http_server_client_consume(http_server_client * client, size_t size);
+
 /**
  * Feeds client using chunk of datad    
  */
@@ -477,6 +1214,7 @@ int http_server_poll_client(http_server_client * client, int flags);
     XX(415, UNSUPPORTED_MEDIA_TYPE, "Unsupported Media Type") \
     XX(416, REQUESTED_RANGE_NOT_SATISFIABLE, "Requested Range Not Satisfiable") \
     XX(417, EXPECTATION_FAILED, "Expectation Failed") \
+    XX(429, TOO_MANY_REQUESTS, "Too Many Requests") \
     XX(500, INTERNAL_SERVER_ERROR, "Internal Server Error") \
     XX(501, NOT_IMPLEMENTED, "Not Implemented") \
     XX(502, BAD_GATEWAY, "Bad Gateway") \
@@ -507,7 +1245,23 @@ http_server_response * http_server_response_new();
 void http_server_response_free(http_server_response * res);
 
 /**
- * Queues response to the client.
+ * Take a response from the server's pool or create a new one and begin
+ * it. Response is returned to the pool after it is sent.
+ * @return Response or NULL
+ */
+http_server_response * http_server_response_acquire(http_server_client * client);
+
+/**
+ * Return sent response to the server's pool or free it
+ * @private
+ */
+void http_server__response_recycle(struct http_server * srv, http_server_response * res);
+
+/**
+ * Queues response to the client. Responses are sent in the order they
+ * are begun, so responses to pipelined requests have to be begun in the
+ * order of requests. A response might be buffered until all previously
+ * begun responses are finished.
  */
 int http_server_response_begin(http_server_client * client, http_server_response * res);
 
@@ -523,20 +1277,41 @@ int http_server_response_end(http_server_response * client);
 int http_server_response__flush(http_server_response * res);
 
 /**
- * Write response header
+ * Set response status. Status line is sent together with headers.
  */
 int http_server_response_write_head(http_server_response * res, int status_code);
 
 /**
- * Sets header in response
+ * Sets header in response. Value of a header that is already set is
+ * replaced. Header names are case-insensitive.
  */
 int http_server_response_set_header(http_server_response * res, char * name, int namelen, char * value, int valuelen);
 
+/**
+ * Add header to response even if there is a header with the same name
+ * (i.e. Set-Cookie).
+ */
+int http_server_response_add_header(http_server_response * res, char * name, int namelen, char * value, int valuelen);
+
+/**
+ * Remove all headers with given name from response
+ */
+int http_server_response_remove_header(http_server_response * res, char * name, int namelen);
+
+/**
+ * Find header value
+ * @param value_len Length of the value. Value is not NULL terminated.
+ * @return Value or NULL if header is not set
+ */
+const char * http_server_response_get_header(http_server_response * res, const char * name, int * value_len);
+
 /**
  * Write some data to the responses
  * @param res Response
  * @param data Data
  * @param size Size
+ * @return HTTP_SERVER_WOULD_BLOCK if output queue is above high watermark.
+ *  Data is not queued and handler's `on_writable` will be called later.
  */
 int http_server_response_write(http_server_response * res, char * data, int size);
 
@@ -545,4 +1320,27 @@ int http_server_response_write(http_server_response * res, char * data, int size
  */
 int http_server_response_printf(http_server_response * res, const char * format, ...);
 
+/**
+ * Serialize a constant response once
+ * @param status_code Status code
+ * @param headers Header lines each terminated with "\r\n" or NULL.
+ *  Content-Length is added.
+ * @param body Response body
+ * @return New prepared response or NULL
+ */
+http_server_prepared_response * http_server_prepared_response_new(int status_code, const char * headers, int headers_len, const char * body, int body_len);
+
+/**
+ * Release prepared response. Memory is freed after all clients
+ * finished sending it.
+ */
+void http_server_prepared_response_free(http_server_prepared_response * prepared);
+
+/**
+ * Send prepared response and end the response. Date, Server and
+ * Connection headers are added if needed, the rest is sent without
+ * copying.
+ */
+int http_server_response_send_prepared(http_server_response * res, http_server_prepared_response * prepared);
+
 #endif
@@ -2,8 +2,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include <strings.h>
 #include <assert.h>
+#include "timer.h"
+#include "client.h"
+#include "ratelimit.h"
+#include "log.h"
+#include "probes.h"
 
 static void http_server__client_free_headers(http_server_client * client)
 {
@@ -15,6 +21,165 @@ static void http_server__client_free_headers(http_server_client * client)
     }
 }
 
+static void http_server__client_reset_url(http_server_client * client)
+{
+    http_server_string_clear(&client->url);
+    // Keep memory of URL components so next request can reuse it
+    client->url_parts_.len = 0;
+    client->url_parsed_ = 0;
+    client->path_off_ = -1;
+    client->query_off_ = -1;
+    client->fragment_off_ = -1;
+    client->query_params_len_ = 0;
+}
+
+static int http_server__hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/**
+ * Percent-decode string in place. Returns new length.
+ */
+static int http_server__url_decode(char * str, int len)
+{
+    int i, j = 0;
+    for (i = 0; i < len; ++i)
+    {
+        if (str[i] == '+')
+        {
+            str[j++] = ' ';
+        }
+        else if (str[i] == '%' && i + 2 < len
+            && http_server__hex_value(str[i + 1]) != -1
+            && http_server__hex_value(str[i + 2]) != -1)
+        {
+            str[j++] = (char)(http_server__hex_value(str[i + 1]) * 16 + http_server__hex_value(str[i + 2]));
+            i += 2;
+        }
+        else
+        {
+            str[j++] = str[i];
+        }
+    }
+    return j;
+}
+
+static int http_server__client_index_query(http_server_client * client, int off, int len)
+{
+    int end = off + len;
+    while (off < end)
+    {
+        int sep = off;
+        int eq = -1;
+        while (sep < end && client->url_parts_.buf[sep] != '&')
+        {
+            if (eq == -1 && client->url_parts_.buf[sep] == '=')
+            {
+                eq = sep;
+            }
+            sep++;
+        }
+        if (sep > off)
+        {
+            if (client->query_params_len_ == client->query_params_size_)
+            {
+                int new_size = client->query_params_size_ ? client->query_params_size_ * 2 : 8;
+                http_server_query_param * new_params = realloc(client->query_params_, sizeof(http_server_query_param) * new_size);
+                if (!new_params)
+                {
+                    return HTTP_SERVER_NO_MEMORY;
+                }
+                client->query_params_ = new_params;
+                client->query_params_size_ = new_size;
+            }
+            http_server_query_param * param = &client->query_params_[client->query_params_len_++];
+            param->name_off = off;
+            param->name_len = (eq == -1 ? sep : eq) - off;
+            // Parameter without a value points to the end of its name
+            param->value_off = eq == -1 ? sep : eq + 1;
+            param->value_len = eq == -1 ? 0 : sep - eq - 1;
+            param->is_decoded = 0;
+        }
+        off = sep + 1;
+    }
+    return HTTP_SERVER_OK;
+}
+
+/**
+ * Split URL into components. This is done at most once per request.
+ */
+static int http_server__client_parse_url(http_server_client * client)
+{
+    if (client->url_parsed_ == 1)
+    {
+        return HTTP_SERVER_OK;
+    }
+    if (client->url_parsed_ == -1)
+    {
+        return HTTP_SERVER_PARSER_ERROR;
+    }
+    const char * url = http_server_string_str(&client->url);
+    if (!url)
+    {
+        // Nothing received yet
+        return HTTP_SERVER_OK;
+    }
+    client->url_parsed_ = -1;
+    struct http_parser_url u;
+    memset(&u, 0, sizeof(u));
+    if (http_parser_parse_url(url, client->url.len, client->parser_.method == HTTP_CONNECT, &u) != 0)
+    {
+        return HTTP_SERVER_PARSER_ERROR;
+    }
+    static const int fields[] = { UF_PATH, UF_QUERY, UF_FRAGMENT, UF_QUERY };
+    int * offsets[] = { &client->path_off_, &client->query_off_, &client->fragment_off_, NULL };
+    int scratch_off = -1;
+    int i, r;
+    for (i = 0; i < 4; ++i)
+    {
+        if (!(u.field_set & (1 << fields[i])))
+        {
+            continue;
+        }
+        int off = client->url_parts_.len;
+        if ((r = http_server_string_append(&client->url_parts_, url + u.field_data[fields[i]].off, u.field_data[fields[i]].len)) != HTTP_SERVER_OK)
+        {
+            return r;
+        }
+        if ((r = http_server_string_append(&client->url_parts_, "", 1)) != HTTP_SERVER_OK)
+        {
+            return r;
+        }
+        if (offsets[i])
+        {
+            *offsets[i] = off;
+        }
+        else
+        {
+            scratch_off = off;
+        }
+    }
+    if (scratch_off != -1 && (r = http_server__client_index_query(client, scratch_off, u.field_data[UF_QUERY].len)) != HTTP_SERVER_OK)
+    {
+        return r;
+    }
+    client->url_parsed_ = 1;
+    return HTTP_SERVER_OK;
+}
+
 static int my_url_callback(http_parser * parser, const char * at, size_t length)
 {
     http_server_client * client = parser->data;
@@ -27,28 +192,126 @@ static int my_url_callback(http_parser * parser, const char * at, size_t length)
     return rv;
 }
 
+static int my_message_begin_callback(http_parser * parser)
+{
+    http_server_client * client = parser->data;
+    client->request_state_ = 'H';
+    client->is_complete = 0;
+    client->in_request_ = 1;
+    HTTP_SERVER_PROBE2(request_begin, client->sock, client->requests_ + 1);
+    client->trace_.first_byte_read = Http_server_client_trace_time(client);
+    client->trace_.headers_complete = 0;
+    client->trace_.message_complete = 0;
+    Http_server_client_update_timeout(client, 0);
+    http_server * srv = client->server_;
+    // Request over a limit is still parsed to keep the connection in
+    // sync but the handler never sees it
+    client->is_limited_ = 0;
+    if (client->is_charged_)
+    {
+        // First request was paid for by the connection
+        client->is_charged_ = 0;
+    }
+    else if (srv && client->has_addr_
+        && !Http_server_rate_take(&srv->rate_table_, client->addr_, srv->rate_limit, srv->rate_burst, Http_server_timer_now()))
+    {
+        client->is_limited_ = HTTP_429_TOO_MANY_REQUESTS;
+    }
+    if (!client->is_limited_ && srv && srv->max_inflight > 0 && srv->inflight_ >= srv->max_inflight)
+    {
+        client->is_limited_ = HTTP_503_SERVICE_UNAVAILABLE;
+    }
+    return 0;
+}
+
 static int my_message_complete_callback(http_parser * parser)
 {
     http_server_client * client = parser->data;
     int rv = 0;
-    if (client->handler && client->handler->on_message_complete)
+    // Request is read so there is no read timeout while handler works
+    client->request_state_ = 'C';
+    client->requests_++;
+    client->in_request_ = 0;
+    client->request_time_ = Http_server_timer_now_us();
+    if (client->handler && client->handler->on_request_trace)
+    {
+        client->trace_.message_complete = client->request_time_;
+    }
+    if (client->server_)
+    {
+        client->server_->stats_.requests++;
+    }
+    long max_requests = client->server_ ? client->server_->max_keepalive_requests : 0;
+    int is_draining = client->server_ && client->server_->is_draining_;
+    client->is_http10_ = parser->http_major == 1 && parser->http_minor == 0;
+    client->keep_alive_http10_ = client->is_http10_ && http_should_keep_alive(parser);
+    if (!client->close_after_ && (!http_should_keep_alive(parser) || is_draining
+        || (max_requests > 0 && client->requests_ >= max_requests)))
+    {
+        // Response to this request is the last one. Requests pipelined
+        // after it are not processed.
+        client->close_after_ = client->requests_;
+        client->is_closing_ = 1;
+        http_parser_pause(parser, 1);
+    }
+    Http_server_client_update_timeout(client, 0);
+    http_server * srv = client->server_;
+    if (client->is_limited_)
+    {
+        // Shed the request before it reaches the handler
+        srv->stats_.requests_rejected++;
+        http_server_prepared_response * limit = http_server__limit_response(srv, client->is_limited_);
+        http_server_response * res = limit ? http_server_response_acquire(client) : NULL;
+        if (!res)
+        {
+            return 1;
+        }
+        int r = http_server_response_send_prepared(res, limit);
+        rv = r != HTTP_SERVER_OK && r != HTTP_SERVER_CLIENT_EOF;
+    }
+    else if (client->handler && client->handler->on_message_complete)
     {
         rv = client->handler->on_message_complete(client, client->handler->on_message_complete_data);
     }
     client->is_complete = 1;
+    client->pipeline_len_++;
+    HTTP_SERVER_PROBE3(request_complete, client->sock, client->requests_, client->pipeline_len_);
+    if (srv)
+    {
+        srv->inflight_++;
+    }
+    // Whole body is received so there is nothing left to throttle
+    client->body_pending_ = 0;
+    client->is_throttled_ = 0;
     http_server__client_free_headers(client);
-    http_server_string_clear(&client->url);
+    http_server__client_reset_url(client);
     return rv;
 }
 
 static int my_on_body(http_parser * parser, const char * at, size_t length)
 {
     http_server_client * client = parser->data;
-    int rv;
+    int rv = 0;
+    HTTP_SERVER_PROBE2(body, client->sock, length);
+    if (client->is_limited_)
+    {
+        return 0;
+    }
     if (client->handler && client->handler->on_body)
     {
         rv = client->handler->on_body(client, client->handler->on_body_data, at, length);
     }
+    long high_watermark = client->server_->body_high_watermark;
+    if (high_watermark > 0)
+    {
+        // Reading stops after current chunk of data is parsed so the
+        // overshoot is bounded by the size of single read.
+        client->body_pending_ += length;
+        if (client->body_pending_ >= high_watermark)
+        {
+            client->is_throttled_ = 1;
+        }
+    }
     return rv;
 }
 
@@ -74,9 +337,9 @@ static int my_on_header_field(http_parser * parser, const char * at, size_t leng
         // Move temporary fields into new header structure
         http_server_string_move(&client->header_field_, &new_header->field);
         http_server_string_move(&client->header_value_, &new_header->value);
-        //http_server__debug(srv, 1, "new header key[%s] value[%s]\n", http_server_string_str(&new_header->field), http_server_string_str(&new_header->value));
+        //HTTP_SERVER_TRACE(srv, CLIENT, "new header key[%s] value[%s]", http_server_string_str(&new_header->field), http_server_string_str(&new_header->value));
         TAILQ_INSERT_TAIL(&client->headers, new_header, headers);
-        if (client->handler && client->handler->on_header)
+        if (client->handler && client->handler->on_header && !client->is_limited_)
         {
             result = client->handler->on_header(client, client->handler->on_header_data, http_server_string_str(&new_header->field), http_server_string_str(&new_header->value));
         }
@@ -121,6 +384,10 @@ static int my_on_header_value(http_parser * parser, const char * at, size_t leng
 int my_on_headers_complete(http_parser * parser)
 {
     http_server_client * client = parser->data;
+    client->request_state_ = 'B';
+    client->trace_.headers_complete = Http_server_client_trace_time(client);
+    HTTP_SERVER_PROBE2(headers_complete, client->sock, (int)parser->method);
+    Http_server_client_update_timeout(client, 0);
     if (client->header_state_ != 'V')
     {
         return 0;
@@ -138,7 +405,7 @@ int my_on_headers_complete(http_parser * parser)
     client->header_state_ = 'S';
     TAILQ_INSERT_TAIL(&client->headers, new_header, headers);
     int r = 0;
-    if (client->handler && client->handler->on_header)
+    if (client->handler && client->handler->on_header && !client->is_limited_)
     {
         r = client->handler->on_header(client, client->handler->on_header_data, http_server_string_str(&new_header->field), http_server_string_str(&new_header->value));
     }
@@ -176,21 +443,34 @@ http_server_client * http_server_new_client(http_server * server, http_server_so
     // Request
     http_parser_init(&client->parser_, HTTP_REQUEST);
     client->parser_.data = client;
+    client->parser_settings_.on_message_begin = &my_message_begin_callback;
     client->parser_settings_.on_url = &my_url_callback;
     client->parser_settings_.on_body = &my_on_body;
     client->parser_settings_.on_message_complete = &my_message_complete_callback;
     client->parser_settings_.on_header_field = &my_on_header_field;
     client->parser_settings_.on_header_value = &my_on_header_value;
     client->parser_settings_.on_headers_complete = &my_on_headers_complete;
-    // Response should be NULL so we know when to poll for WRITE
-    client->current_response_ = NULL;
+    // Responses to pipelined requests
+    TAILQ_INIT(&client->responses_);
+    client->pipeline_len_ = 0;
+    client->requests_ = 0;
+    client->responses_started_ = 0;
+    client->close_after_ = 0;
+    client->is_http10_ = 0;
+    client->keep_alive_http10_ = 0;
     client->server_ = server;
     client->current_flags = 0;
     client->is_complete = 0;
     // Create new queue of outgoing chunks of data
     TAILQ_INIT(&client->buffer);
+    client->buffer_size_ = 0;
+    client->wants_writable_ = 0;
     // Initialize string which will hold full URL data
     http_server_string_init(&client->url);
+    http_server_string_init(&client->url_parts_);
+    client->query_params_ = NULL;
+    client->query_params_size_ = 0;
+    http_server__client_reset_url(client);
     // Initialize request headers
     TAILQ_INIT(&client->headers);
     // Temporary data for incomming request headers
@@ -198,11 +478,57 @@ http_server_client * http_server_new_client(http_server * server, http_server_so
     http_server_string_init(&client->header_field_);
     http_server_string_init(&client->header_value_);
     client->is_paused_ = 0;
+    client->body_pending_ = 0;
+    client->is_throttled_ = 0;
+    client->is_closing_ = 0;
+    // Timeout callback is set once the server starts managing the client
+    client->request_state_ = 'H';
+    http_server_timer_init(&client->timeout_timer_, NULL, client);
+    client->timeout_phase_ = 0;
+    client->listener_ = NULL;
+    memset(client->addr_, 0, sizeof(client->addr_));
+    client->has_addr_ = 0;
+    client->is_charged_ = 0;
+    client->is_limited_ = 0;
+    client->in_request_ = 0;
+    client->request_time_ = 0;
+    memset(&client->trace_, 0, sizeof(client->trace_));
+    client->trace_.accepted = Http_server_client_trace_time(client);
     return client;
 }
 
+unsigned long long Http_server_client_trace_time(http_server_client * client)
+{
+    if (!client->handler || !client->handler->on_request_trace)
+    {
+        return 0;
+    }
+    return Http_server_timer_now_us();
+}
+
 void http_server_client_free(http_server_client * client)
 {
+    if (client->server_)
+    {
+        Http_server_timer_wheel_remove(&client->server_->timers_, &client->timeout_timer_);
+        // Requests of this client are not in flight anymore
+        client->server_->inflight_ -= client->pipeline_len_;
+    }
+    // Finished responses are owned by the client. Unfinished ones are
+    // still used by the handler which frees them when it ends them.
+    while (!TAILQ_EMPTY(&client->responses_))
+    {
+        http_server_response * res = TAILQ_FIRST(&client->responses_);
+        if (res->is_done)
+        {
+            http_server_response_free(res);
+        }
+        else
+        {
+            TAILQ_REMOVE(&client->responses_, res, responses_);
+            res->client = NULL;
+        }
+    }
     http_server__client_free_headers(client);
     http_server_string_free(&client->header_field_);
     http_server_string_free(&client->header_value_);
@@ -212,11 +538,12 @@ void http_server_client_free(http_server_client * client)
         http_server_buf * buf = TAILQ_FIRST(&client->buffer);
         assert(buf);
         TAILQ_REMOVE(&client->buffer, buf, bufs);
-        free(buf->mem);
-        free(buf);
+        http_server__buf_free(client->server_, buf);
     }
     // Free URL data
     http_server_string_free(&client->url);
+    http_server_string_free(&client->url_parts_);
+    free(client->query_params_);
     free(client);
 }
 
@@ -224,11 +551,17 @@ int http_server_perform_client(http_server_client * client, const char * at, siz
 {
     assert(client);
     int nparsed = http_parser_execute(&client->parser_, &client->parser_settings_, at, size);
+    if (nparsed != size && client->is_closing_ && HTTP_PARSER_ERRNO(&client->parser_) == HPE_PAUSED)
+    {
+        // Parser is stopped after the last request on this connection
+        return HTTP_SERVER_OK;
+    }
     if (nparsed != size)
     {
         const char * err = http_errno_description(client->parser_.http_errno);
         // Error
-        http_server__debug(client->server_, 1, "unable to execute parser %d/%d (%s)\n", (int)nparsed, (int)size, err);
+        HTTP_SERVER_LOG(client->server_, DEBUG, CLIENT, "unable to execute parser %d/%d (%s)", (int)nparsed, (int)size, err);
+        HTTP_SERVER_PROBE2(parser_error, client->sock, (int)client->parser_.http_errno);
         return HTTP_SERVER_PARSER_ERROR;
     }
     return HTTP_SERVER_OK;
@@ -282,6 +615,21 @@ int http_server_client_getinfo(http_server_client * client, http_server_clientin
         *url = (char *)http_server_string_str(&client->url);
         va_end(ap);
     }
+    else if (code == HTTP_SERVER_CLIENTINFO_PATH
+        || code == HTTP_SERVER_CLIENTINFO_QUERY
+        || code == HTTP_SERVER_CLIENTINFO_FRAGMENT)
+    {
+        int r = http_server__client_parse_url(client);
+        va_list ap;
+        va_start(ap, code);
+        char ** component = va_arg(ap, char **);
+        int off = code == HTTP_SERVER_CLIENTINFO_PATH ? client->path_off_
+            : code == HTTP_SERVER_CLIENTINFO_QUERY ? client->query_off_
+            : client->fragment_off_;
+        *component = (r == HTTP_SERVER_OK && off != -1) ? client->url_parts_.buf + off : NULL;
+        va_end(ap);
+        return r;
+    }
     else
     {
         return HTTP_SERVER_INVALID_PARAM;
@@ -289,27 +637,187 @@ int http_server_client_getinfo(http_server_client * client, http_server_clientin
     return HTTP_SERVER_OK;
 }
 
-int http_server_client_write(http_server_client * client, char * data, int size)
+int http_server_client_query_param(http_server_client * client, const char * name, char ** value)
 {
-    if (!client)
+    if (!client || !name || !value)
     {
         return HTTP_SERVER_INVALID_PARAM;
     }
+    *value = NULL;
+    int r = http_server__client_parse_url(client);
+    if (r != HTTP_SERVER_OK)
+    {
+        return r;
+    }
+    int i;
+    for (i = 0; i < client->query_params_len_; ++i)
+    {
+        http_server_query_param * param = &client->query_params_[i];
+        char * buf = client->url_parts_.buf;
+        if (!param->is_decoded)
+        {
+            param->name_len = http_server__url_decode(buf + param->name_off, param->name_len);
+            param->value_len = http_server__url_decode(buf + param->value_off, param->value_len);
+            // Both slices are at most as long as before so it is safe to
+            // terminate them in place.
+            buf[param->name_off + param->name_len] = '\0';
+            buf[param->value_off + param->value_len] = '\0';
+            param->is_decoded = 1;
+        }
+        if (strcmp(buf + param->name_off, name) == 0)
+        {
+            *value = buf + param->value_off;
+            break;
+        }
+    }
+    return HTTP_SERVER_OK;
+}
+
+/**
+ * Take a block from the pool or allocate new one. Block memory follows
+ * the buffer structure.
+ */
+static http_server_buf * http_server__buf_block(http_server * srv)
+{
+    http_server_buf * buf;
+    if (srv && srv->buf_pool_len_ > 0)
+    {
+        buf = srv->buf_pool_[--srv->buf_pool_len_];
+    }
+    else if (!(buf = malloc(sizeof(http_server_buf) + HTTP_SERVER_BUF_BLOCK_SIZE)))
+    {
+        return NULL;
+    }
+    buf->mem = buf->data = (char *)(buf + 1);
+    buf->size = 0;
+    buf->capacity_ = HTTP_SERVER_BUF_BLOCK_SIZE;
+    buf->prepared_ = NULL;
+    return buf;
+}
+
+http_server_buf * http_server__buf_reserve(http_server * srv, struct http_server_bufs * bufs, int size)
+{
+    http_server_buf * buf = TAILQ_LAST(bufs, http_server_bufs);
+    if (buf && buf->mem && buf->mem + buf->capacity_ - (buf->data + buf->size) >= size)
+    {
+        return buf;
+    }
+    if (size <= HTTP_SERVER_BUF_BLOCK_SIZE)
+    {
+        buf = http_server__buf_block(srv);
+        if (!buf)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        // Large data gets a buffer of its own
+        buf = malloc(sizeof(http_server_buf));
+        if (!buf)
+        {
+            return NULL;
+        }
+        buf->mem = buf->data = malloc(size);
+        if (!buf->mem)
+        {
+            free(buf);
+            return NULL;
+        }
+        buf->size = 0;
+        buf->capacity_ = size;
+        buf->prepared_ = NULL;
+    }
+    TAILQ_INSERT_TAIL(bufs, buf, bufs);
+    return buf;
+}
+
+int http_server__buf_append(http_server * srv, struct http_server_bufs * bufs, const char * data, int size)
+{
+    http_server_buf * buf = http_server__buf_reserve(srv, bufs, size + 1);
+    if (!buf)
+    {
+        return HTTP_SERVER_NO_MEMORY;
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    buf->data[buf->size] = '\0';
+    return HTTP_SERVER_OK;
+}
+
+int http_server__buf_append_ref(struct http_server_bufs * bufs, http_server_prepared_response * prepared, int offset, int size)
+{
     http_server_buf * new_buffer = malloc(sizeof(http_server_buf));
     if (!new_buffer)
     {
         return HTTP_SERVER_NO_MEMORY;
     }
-    new_buffer->mem = new_buffer->data = malloc(size + 1);
-    if (!new_buffer->data)
+    new_buffer->mem = NULL;
+    new_buffer->data = prepared->data + offset;
+    new_buffer->size = size;
+    new_buffer->capacity_ = 0;
+    new_buffer->prepared_ = prepared;
+    prepared->refcount_++;
+    TAILQ_INSERT_TAIL(bufs, new_buffer, bufs);
+    return HTTP_SERVER_OK;
+}
+
+int http_server__buf_grow(http_server_buf * buf, int size)
+{
+    assert(buf->mem);
+    if (buf->mem + buf->capacity_ - (buf->data + buf->size) >= size)
+    {
+        return HTTP_SERVER_OK;
+    }
+    // Data is moved out of the block to memory of its own
+    char * new_mem = malloc(buf->size + size);
+    if (!new_mem)
     {
-        free(new_buffer);
         return HTTP_SERVER_NO_MEMORY;
     }
-    memcpy(new_buffer->data, data, size);
-    new_buffer->data[size] = '\0';
-    new_buffer->size = size;
-    TAILQ_INSERT_TAIL(&client->buffer, new_buffer, bufs);
+    memcpy(new_mem, buf->data, buf->size);
+    if (buf->mem != (char *)(buf + 1))
+    {
+        free(buf->mem);
+    }
+    buf->mem = buf->data = new_mem;
+    buf->capacity_ = buf->size + size;
+    return HTTP_SERVER_OK;
+}
+
+void http_server__buf_free(http_server * srv, http_server_buf * buf)
+{
+    if (buf->prepared_)
+    {
+        http_server_prepared_response_free(buf->prepared_);
+    }
+    if (buf->mem == (char *)(buf + 1))
+    {
+        if (srv && srv->buf_pool_len_ < HTTP_SERVER_BUF_POOL_SIZE)
+        {
+            srv->buf_pool_[srv->buf_pool_len_++] = buf;
+            return;
+        }
+    }
+    else
+    {
+        free(buf->mem);
+    }
+    free(buf);
+}
+
+int http_server_client_write(http_server_client * client, char * data, int size)
+{
+    if (!client)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    int r = http_server__buf_append(client->server_, &client->buffer, data, size);
+    if (r != HTTP_SERVER_OK)
+    {
+        return r;
+    }
+    client->buffer_size_ += size;
     return HTTP_SERVER_OK;
 }
 
@@ -317,11 +825,60 @@ int http_server_client_flush(http_server_client * client)
 {
     if (TAILQ_EMPTY(&client->buffer))
     {
-        return HTTP_SERVER_OK;
+        // Nothing to send but a finished response still has to be
+        // retired from the queue by the write handler.
+        http_server_response * res = TAILQ_FIRST(&client->responses_);
+        if (!res || !res->is_done)
+        {
+            return HTTP_SERVER_OK;
+        }
     }
+    Http_server_client_update_timeout(client, 0);
     return http_server_poll_client(client, HTTP_SERVER_POLL_OUT);
 }
 
+void Http_server_client_update_timeout(http_server_client * client, int restart)
+{
+    http_server * srv = client->server_;
+    if (!srv || !client->timeout_timer_.callback)
+    {
+        // Client is not managed by the server
+        return;
+    }
+    char phase = client->request_state_;
+    long timeout = 0;
+    if (!TAILQ_EMPTY(&client->buffer))
+    {
+        phase = 'W';
+        timeout = srv->write_timeout;
+    }
+    else if (phase == 'H')
+    {
+        timeout = srv->header_timeout;
+    }
+    else if (phase == 'B')
+    {
+        timeout = srv->body_timeout;
+    }
+    else if (phase == 'I')
+    {
+        timeout = srv->keepalive_timeout;
+    }
+    if (phase == client->timeout_phase_ && !restart)
+    {
+        return;
+    }
+    client->timeout_phase_ = phase;
+    if (timeout > 0)
+    {
+        Http_server_timer_wheel_add(&srv->timers_, &client->timeout_timer_, timeout);
+    }
+    else
+    {
+        Http_server_timer_wheel_remove(&srv->timers_, &client->timeout_timer_);
+    }
+}
+
 int http_server_client_pause(http_server_client * client, int pause)
 {
     if (!client)
@@ -329,13 +886,47 @@ int http_server_client_pause(http_server_client * client, int pause)
         return HTTP_SERVER_INVALID_PARAM;
     }
     int previous_state = client->is_paused_;
-    http_server__debug(client->server_, 1, "change paused on %d from %d->%d\n", client->sock, previous_state, pause);
+    HTTP_SERVER_TRACE(client->server_, CLIENT, "change paused on %d from %d->%d", client->sock, previous_state, pause);
     client->is_paused_ = pause;
     // If paused state is enabled after it was disabled then we try
     // to read data again.
-    if (previous_state == 1 && pause == 0)
+    if (previous_state == 1 && pause == 0 && Http_server_client_can_read(client))
     {
         return http_server_poll_client(client, HTTP_SERVER_POLL_IN);
     }
     return HTTP_SERVER_OK;
 }
+
+int http_server_client_consume(http_server_client * client, size_t size)
+{
+    if (!client)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    client->body_pending_ -= (long)size;
+    if (client->body_pending_ < 0)
+    {
+        client->body_pending_ = 0;
+    }
+    if (!client->is_throttled_ || client->body_pending_ > client->server_->body_low_watermark)
+    {
+        return HTTP_SERVER_OK;
+    }
+    HTTP_SERVER_LOG(client->server_, DEBUG, CLIENT, "client %d unthrottled with %ld bytes of body pending", client->sock, client->body_pending_);
+    client->is_throttled_ = 0;
+    if (!Http_server_client_can_read(client))
+    {
+        return HTTP_SERVER_OK;
+    }
+    return http_server_poll_client(client, HTTP_SERVER_POLL_IN);
+}
+
+int Http_server_client_can_read(http_server_client * client)
+{
+    if (client->is_paused_ || client->is_throttled_ || client->is_closing_)
+    {
+        return 0;
+    }
+    long max_pipeline = client->server_ ? client->server_->max_pipeline : 0;
+    return max_pipeline == 0 || client->pipeline_len_ < max_pipeline;
+}
@@ -0,0 +1,19 @@
+/**
+ * Arm or disarm client's timeout depending on what the client is
+ * currently doing.
+ * @param restart Restart timeout even if client is in the same phase
+ */
+void Http_server_client_update_timeout(http_server_client * client, int restart);
+
+/**
+ * Check if more requests should be read from the client. Reading stops
+ * while the client is paused, throttled, closing or has too many
+ * unanswered requests.
+ */
+int Http_server_client_can_read(http_server_client * client);
+
+/**
+ * Monotonic time in microseconds if the handler traces requests, 0
+ * otherwise
+ */
+unsigned long long Http_server_client_trace_time(http_server_client * client);
@@ -16,6 +16,9 @@
 #include <assert.h>
 #include <strings.h>
 #include "event.h"
+#include "timer.h"
+#include "socket.h"
+#include "log.h"
 #include "build_config.h"
 
 #if !defined(HTTP_SERVER_HAVE_KQUEUE)
@@ -86,53 +89,13 @@ static void Http_server_kqueue_event_loop_free(http_server * srv)
 static int _default_opensocket_function(void * clientp)
 {
     Http_server_event_handler * ev = clientp;
-    int s;
-    int optval;
-    // create default ipv4 socket for listener
-    s = socket(AF_INET, SOCK_STREAM, 0);
-    http_server__debug(ev->srv, 1, "open socket: %d", s);
-    if (s == -1)
-    {
-        return HTTP_SERVER_INVALID_SOCKET;
-    }
-    // TODO: this part should be separated somehow
-    // set SO_REUSEADDR on a socket to true (1):
-    optval = 1;
-    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval) == -1)
-    {
-        perror("setsockopt");
-        return HTTP_SERVER_INVALID_SOCKET;
-    }
-
-    int flags = fcntl(s, F_GETFL, 0);
-    fcntl(s, F_SETFL, flags | O_NONBLOCK);
-
-    struct sockaddr_in sin;
-    sin.sin_port = htons(5000);
-    sin.sin_addr.s_addr = 0;
-    sin.sin_addr.s_addr = INADDR_ANY;
-    sin.sin_family = AF_INET;
-
-    if (bind(s, (struct sockaddr *)&sin,sizeof(struct sockaddr_in) ) == -1)
-    {
-        perror("bind");
-        return HTTP_SERVER_INVALID_SOCKET;
-    }
-
-    if (listen(s, 128) < 0) {
-        perror("listen");
-        return HTTP_SERVER_INVALID_SOCKET;
-    }
-    // Watch event loop
-    // EV_SET(&ev->chlist[evsize], s, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, 0);
-    //EV_SET(&chlist[1], fileno(stdin), EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, 0);
-    return s;
+    return Http_server_socket_open_listener(ev->srv);
 }
 
 static int _default_closesocket_function(http_server_socket_t sock, void * clientp)
 {
     Http_server_event_handler * ev = clientp;
-    http_server__debug(ev->srv, 1, "close(%d)", sock);
+    HTTP_SERVER_LOG(ev->srv, DEBUG, EVENT, "close(%d)", sock);
     // Pop event from the events vector by rewriting all events
     // from the list to the new list excluding the event related
     // with fd descriptor.
@@ -178,7 +141,7 @@ static int _default_socket_function(void * clientp, http_server_socket_t sock, i
     {
         if (ev->evsize + 1 >= ev->chlist_size)
         {
-            http_server__debug(srv, 1, "RESIZE!!!");
+            HTTP_SERVER_TRACE(srv, EVENT, "RESIZE!!!");
             int current_evsize = ev->evsize;
             struct kevent * new_events = realloc(ev->chlist, sizeof(struct kevent) * (ev->chlist_size * 2));
             if (!new_events)
@@ -189,7 +152,7 @@ static int _default_socket_function(void * clientp, http_server_socket_t sock, i
             ev->evsize += 1;
             ev->chlist = new_events;
             kev = &ev->chlist[current_evsize];
-            http_server__debug(srv, 1, "evsize=%d chlist_size=%d", ev->evsize, ev->chlist_size);
+            HTTP_SERVER_TRACE(srv, EVENT, "evsize=%d chlist_size=%d", ev->evsize, ev->chlist_size);
         }
         else
         {
@@ -216,21 +179,30 @@ static int _default_socket_function(void * clientp, http_server_socket_t sock, i
 
 static int Http_server_kqueue_event_loop_run(http_server * srv)
 {
-    http_server__debug(srv, 1, "srv=%p", srv);
+    HTTP_SERVER_LOG(srv, DEBUG, EVENT, "srv=%p", srv);
     Http_server_event_handler * ev = srv->closesocket_data;
     for (;;)
     {
-        if (ev->evsize == 0)
+        // Expire timers first so timed out clients are not polled
+        Http_server_timer_wheel_run(srv);
+        long timeout = Http_server_timer_wheel_next(&srv->timers_);
+        if (ev->evsize == 0 && timeout == -1)
         {
-            http_server__debug(srv, 1, "no more events...");
+            HTTP_SERVER_LOG(srv, DEBUG, EVENT, "no more events...");
             break;
         }
-        struct kevent * evlist = calloc(ev->evsize, sizeof(struct kevent));
+        // kevent(2) does not wait at all when asked for zero events
+        int nevents = ev->evsize > 0 ? ev->evsize : 1;
+        struct kevent * evlist = calloc(nevents, sizeof(struct kevent));
         assert(evlist);
         assert(ev->chlist);
-        http_server__debug(srv, 1, "kq=%d chlist=%p evsize=%d", ev->kq, ev->chlist, ev->evsize);
-        int nev = kevent(ev->kq, ev->chlist, ev->evsize, evlist, ev->evsize, NULL);
-        http_server__debug(srv, 1, "nev=%d", nev);
+        HTTP_SERVER_TRACE(srv, EVENT, "kq=%d chlist=%p evsize=%d", ev->kq, ev->chlist, ev->evsize);
+        // Sleep until the nearest timer deadline
+        struct timespec ts;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        int nev = kevent(ev->kq, ev->chlist, ev->evsize, evlist, nevents, timeout == -1 ? NULL : &ts);
+        HTTP_SERVER_TRACE(srv, EVENT, "nev=%d", nev);
         if (nev == -1)
         {
             perror("kevent");
@@ -240,14 +212,14 @@ static int Http_server_kqueue_event_loop_run(http_server * srv)
         {
             if (evlist[i].flags & EV_ERROR)
             {
-                http_server__debug(srv, 1, "EV_ERROR: %s", strerror(evlist[i].data));
+                HTTP_SERVER_LOG(srv, WARNING, EVENT, "EV_ERROR: %s", strerror(evlist[i].data));
                 abort();
             }
             if (evlist[i].filter == EVFILT_READ)
             {
                 if (http_server_socket_action(srv, evlist[i].ident, HTTP_SERVER_POLL_IN) != HTTP_SERVER_OK)
                 {
-                    http_server__debug(srv, 1, "unable to read incoming data");
+                    HTTP_SERVER_LOG(srv, DEBUG, EVENT, "unable to read incoming data");
                     continue;
                 }
             }
@@ -255,7 +227,7 @@ static int Http_server_kqueue_event_loop_run(http_server * srv)
             {
                 if (http_server_socket_action(srv, evlist[i].ident, HTTP_SERVER_POLL_OUT) != HTTP_SERVER_OK)
                 {
-                    http_server__debug(srv, 1, "unable to write outgoing data");
+                    HTTP_SERVER_LOG(srv, DEBUG, EVENT, "unable to write outgoing data");
                     continue;
                 }
             }
@@ -12,6 +12,9 @@
 #include <assert.h>
 #include <strings.h>
 #include "event.h"
+#include "timer.h"
+#include "socket.h"
+#include "log.h"
 #include "build_config.h"
 
 #if !defined(HTTP_SERVER_HAVE_SELECT)
@@ -28,8 +31,8 @@ for ((var) = SLIST_FIRST((head)); \
 
 typedef struct
 {
-    // flags for clients
-    int flags[64];
+    // flags for clients (select(2) can't watch descriptors above FD_SETSIZE)
+    int flags[FD_SETSIZE];
     http_server * srv;
 } Http_server_event_handler;
 
@@ -66,53 +69,18 @@ static void Http_server_select_event_loop_free(http_server * srv)
 static int _default_opensocket_function(void * clientp)
 {
     Http_server_event_handler * ev = clientp;
-    http_server * srv = ev->srv;
-    int s;
-    int optval;
-    // create default ipv4 socket for listener
-    s = socket(AF_INET, SOCK_STREAM, 0);
-    http_server__debug(srv, 1, "open socket: %d\n", s);
-    if (s == -1)
-    {
-        return HTTP_SERVER_INVALID_SOCKET;
-    }
-    // TODO: this part should be separated somehow
-    // set SO_REUSEADDR on a socket to true (1):
-    optval = 1;
-    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval) == -1)
-    {
-        perror("setsockopt");
-        return HTTP_SERVER_INVALID_SOCKET;
-    }
-
-    int flags = fcntl(s, F_GETFL, 0);
-    fcntl(s, F_SETFL, flags | O_NONBLOCK);
-
-    struct sockaddr_in sin;
-    sin.sin_port = htons(5000);
-    sin.sin_addr.s_addr = 0;
-    sin.sin_addr.s_addr = INADDR_ANY;
-    sin.sin_family = AF_INET;
-
-    if (bind(s, (struct sockaddr *)&sin,sizeof(struct sockaddr_in) ) == -1)
-    {
-        perror("bind");
-        return HTTP_SERVER_INVALID_SOCKET;
-    }
-
-    if (listen(s, 128) < 0) {
-        perror("listen");
-        return HTTP_SERVER_INVALID_SOCKET;
-    }
-    return s;
+    return Http_server_socket_open_listener(ev->srv);
 }
 
 static int _default_closesocket_function(http_server_socket_t sock, void * clientp)
 {
     Http_server_event_handler * ev = clientp;
     http_server * srv = ev->srv;
-    http_server__debug(srv, 1, "close(%d)\n", sock);
-    ev->flags[sock] = 0;
+    HTTP_SERVER_LOG(srv, DEBUG, EVENT, "close(%d)", sock);
+    if (sock < FD_SETSIZE)
+    {
+        ev->flags[sock] = 0;
+    }
     if (close(sock) == -1)
     {
         perror("close");
@@ -125,6 +93,10 @@ static int _default_socket_function(void * clientp, http_server_socket_t sock, i
 {
     // Data assigned to listening socket is a `fd_set`
     Http_server_event_handler * ev = clientp;
+    if (sock < 0 || sock >= FD_SETSIZE)
+    {
+        return HTTP_SERVER_SOCKET_ERROR;
+    }
     if (flags & HTTP_SERVER_POLL_REMOVE)
     {
         ev->flags[sock] = 0;
@@ -139,9 +111,11 @@ static int _default_socket_function(void * clientp, http_server_socket_t sock, i
 static int Http_server_select_event_loop_run(http_server * srv)
 {
     int r;
-    Http_server_event_handler * ev = srv->sock_listen_data;
+    Http_server_event_handler * ev = srv->event_loop_data_;
     do
     {
+        // Expire timers first so timed out clients are not polled
+        Http_server_timer_wheel_run(srv);
         fd_set rd, wr;
         FD_ZERO(&rd);
         FD_ZERO(&wr);
@@ -154,7 +128,7 @@ static int Http_server_select_event_loop_run(http_server * srv)
             assert(it->sock > -1);
             if (ev->flags[it->sock] & HTTP_SERVER_POLL_IN)
             {
-                http_server__debug(srv, 1, "rd=%d\n", it->sock);
+                HTTP_SERVER_TRACE(srv, EVENT, "rd=%d", it->sock);
                 FD_SET(it->sock, &rd);
                 if (it->sock > nsock)
                 {
@@ -163,7 +137,7 @@ static int Http_server_select_event_loop_run(http_server * srv)
             }
             if (ev->flags[it->sock] & HTTP_SERVER_POLL_OUT)
             {
-                http_server__debug(srv, 1, "wr=%d\n", it->sock);
+                HTTP_SERVER_TRACE(srv, EVENT, "wr=%d", it->sock);
                 FD_SET(it->sock, &wr);
                 if (it->sock > nsock)
                 {
@@ -171,9 +145,22 @@ static int Http_server_select_event_loop_run(http_server * srv)
                 }
             }
         }
-        if (ev->flags[srv->sock_listen] & HTTP_SERVER_POLL_IN)
+        http_server_listener * listener;
+        SLIST_FOREACH(listener, &srv->listeners, next)
         {
-            http_server__debug(srv, 1, "rd sock listen %d\n", srv->sock_listen);
+            if (listener->sock != HTTP_SERVER_INVALID_SOCKET && ev->flags[listener->sock] & HTTP_SERVER_POLL_IN)
+            {
+                HTTP_SERVER_TRACE(srv, EVENT, "rd listener %d", listener->sock);
+                FD_SET(listener->sock, &rd);
+                if (listener->sock > nsock)
+                {
+                    nsock = listener->sock;
+                }
+            }
+        }
+        if (SLIST_EMPTY(&srv->listeners) && srv->sock_listen != HTTP_SERVER_INVALID_SOCKET && ev->flags[srv->sock_listen] & HTTP_SERVER_POLL_IN)
+        {
+            HTTP_SERVER_TRACE(srv, EVENT, "rd sock listen %d", srv->sock_listen);
             FD_SET(srv->sock_listen, &rd);
             if (srv->sock_listen > nsock)
             {
@@ -181,20 +168,21 @@ static int Http_server_select_event_loop_run(http_server * srv)
             }
         }
 
-        if (nsock == 0)
+        // Sleep until the nearest timer deadline
+        long timeout = Http_server_timer_wheel_next(&srv->timers_);
+        if (nsock == 0 && timeout == -1)
         {
-            http_server__debug(srv, 1, "no more events..\n");
+            HTTP_SERVER_LOG(srv, DEBUG, EVENT, "no more events..");
             break;
         }
-                
         
         // This will block
         struct timeval tv;
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
-        http_server__debug(srv, 1, "select(%d, {%d}, ...)\n", nsock + 1, srv->sock_listen);
-        r = select(nsock + 1, &rd, &wr, 0, &tv);
-        http_server__debug(srv, 1, "r=%d\n", r);
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        HTTP_SERVER_TRACE(srv, EVENT, "select(%d, {%d}, ...)", nsock + 1, srv->sock_listen);
+        r = select(nsock + 1, &rd, &wr, 0, timeout == -1 ? NULL : &tv);
+        HTTP_SERVER_TRACE(srv, EVENT, "r=%d", r);
         if (r == -1)
         {
             perror("select");
@@ -202,7 +190,7 @@ static int Http_server_select_event_loop_run(http_server * srv)
         }
         else
         {
-            http_server__debug(srv, 1, "select result=%d\n", r);
+            HTTP_SERVER_TRACE(srv, EVENT, "select result=%d", r);
         }
         if (r == 0)
         {
@@ -220,20 +208,20 @@ static int Http_server_select_event_loop_run(http_server * srv)
             {
                 assert(ev->flags[it->sock] & HTTP_SERVER_POLL_IN);
                 ev->flags[it->sock] ^= HTTP_SERVER_POLL_IN;
-                http_server__debug(srv, 1, "client data is available fd=%d\n", it->sock);
+                HTTP_SERVER_TRACE(srv, EVENT, "client data is available fd=%d", it->sock);
                 int action_result = http_server_socket_action(srv, it->sock, HTTP_SERVER_POLL_IN);
                 if (action_result != HTTP_SERVER_OK)
                 {
                     if (action_result != HTTP_SERVER_CLIENT_EOF)
                     {
-                        http_server__debug(srv, 1, "failed to do socket action on fd=%d\n", it->sock);
+                        HTTP_SERVER_LOG(srv, DEBUG, EVENT, "failed to do socket action on fd=%d", it->sock);
                     }
                     continue;
                 }
             }
             if (FD_ISSET(it->sock, &wr))
             {
-                http_server__debug(srv, 1, "send outgoing data=%d\n", it->sock);
+                HTTP_SERVER_TRACE(srv, EVENT, "send outgoing data=%d", it->sock);
                 // Send outgoing data
                 assert(ev->flags[it->sock] & HTTP_SERVER_POLL_OUT);
                 ev->flags[it->sock] ^= HTTP_SERVER_POLL_OUT;
@@ -241,13 +229,26 @@ static int Http_server_select_event_loop_run(http_server * srv)
                 {
                     continue;
                 }
-                http_server__debug(srv, 1, "sent success!\n");
+                HTTP_SERVER_TRACE(srv, EVENT, "sent success!");
             }
         }
 
-        if (FD_ISSET(srv->sock_listen, &rd))
+        SLIST_FOREACH(listener, &srv->listeners, next)
+        {
+            if (listener->sock != HTTP_SERVER_INVALID_SOCKET && FD_ISSET(listener->sock, &rd))
+            {
+                HTTP_SERVER_TRACE(srv, EVENT, "action on listener %d", listener->sock);
+                assert(ev->flags[listener->sock] & HTTP_SERVER_POLL_IN);
+                ev->flags[listener->sock] ^= HTTP_SERVER_POLL_IN;
+                if (http_server_socket_action(srv, listener->sock, HTTP_SERVER_POLL_IN) != HTTP_SERVER_OK)
+                {
+                    HTTP_SERVER_LOG(srv, WARNING, EVENT, "unable to accept new client");
+                }
+            }
+        }
+        if (SLIST_EMPTY(&srv->listeners) && srv->sock_listen != HTTP_SERVER_INVALID_SOCKET && FD_ISSET(srv->sock_listen, &rd))
         {
-            http_server__debug(srv, 1, "action on sock listen\n");
+            HTTP_SERVER_TRACE(srv, EVENT, "action on sock listen");
             // Check for new connection
             // This will create new client structure and it will be
             // saved in list.
@@ -255,7 +256,7 @@ static int Http_server_select_event_loop_run(http_server * srv)
             ev->flags[srv->sock_listen] ^= HTTP_SERVER_POLL_IN;
             if (http_server_socket_action(srv, srv->sock_listen, HTTP_SERVER_POLL_IN) != HTTP_SERVER_OK)
             {
-                http_server__debug(srv, 1, "unable to accept new client\n");
+                HTTP_SERVER_LOG(srv, WARNING, EVENT, "unable to accept new client");
                 continue;
             }
             continue;
@@ -11,5 +11,9 @@ int http_server_handler_init(http_server_handler * handler)
     handler->on_body_data = NULL;
     handler->on_header = NULL;
     handler->on_header_data = NULL;
+    handler->on_writable = NULL;
+    handler->on_writable_data = NULL;
+    handler->on_request_trace = NULL;
+    handler->on_request_trace_data = NULL;
 	return HTTP_SERVER_OK;
 }
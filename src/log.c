@@ -0,0 +1,153 @@
+#if !defined(_GNU_SOURCE)
+// vasprintf(3)
+#define _GNU_SOURCE
+#endif
+#include "http-server/http-server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "timer.h"
+#include "log.h"
+
+// Messages formatted on the stack. Longer ones are allocated.
+#define LOG_MESSAGE_SIZE 256
+
+#define LOG_ALIGN(size) (((size) + 7) & ~7UL)
+
+int http_server_log_ring_init(http_server_log_ring * ring, unsigned long size)
+{
+    if (size < 2 * sizeof(http_server_log_record))
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    unsigned long capacity = 64;
+    while (capacity < size)
+    {
+        capacity <<= 1;
+    }
+    ring->data = malloc(capacity);
+    if (!ring->data)
+    {
+        return HTTP_SERVER_NO_MEMORY;
+    }
+    ring->size = capacity;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+    return HTTP_SERVER_OK;
+}
+
+void http_server_log_ring_free(http_server_log_ring * ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+    ring->size = 0;
+}
+
+static void http_server__log_ring_copy_in(http_server_log_ring * ring, unsigned long pos, const void * src, unsigned long length)
+{
+    unsigned long offset = pos & (ring->size - 1);
+    unsigned long first = ring->size - offset;
+    if (first > length)
+    {
+        first = length;
+    }
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const char *)src + first, length - first);
+}
+
+static void http_server__log_ring_copy_out(http_server_log_ring * ring, unsigned long pos, void * dst, unsigned long length)
+{
+    unsigned long offset = pos & (ring->size - 1);
+    unsigned long first = ring->size - offset;
+    if (first > length)
+    {
+        first = length;
+    }
+    memcpy(dst, ring->data + offset, first);
+    memcpy((char *)dst + first, ring->data, length - first);
+}
+
+void Http_server_log_ring_write(http_server_log_ring * ring, int level, int category, const char * message, int length)
+{
+    if (length > 0xffff)
+    {
+        length = 0xffff;
+    }
+    unsigned long needed = LOG_ALIGN(sizeof(http_server_log_record) + length);
+    unsigned long head = ring->head;
+    // Reader publishes space it freed with release
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (needed > ring->size - (head - tail))
+    {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    http_server_log_record record;
+    memset(&record, 0, sizeof(record));
+    record.time = Http_server_timer_now_us();
+    record.length = (unsigned short)length;
+    record.level = (unsigned char)level;
+    record.category = (unsigned char)category;
+    http_server__log_ring_copy_in(ring, head, &record, sizeof(record));
+    http_server__log_ring_copy_in(ring, head + sizeof(record), message, length);
+    __atomic_store_n(&ring->head, head + needed, __ATOMIC_RELEASE);
+}
+
+int http_server_log_ring_read(http_server_log_ring * ring, http_server_log_record * record, char * buffer, int size)
+{
+    unsigned long tail = ring->tail;
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail == head)
+    {
+        return 0;
+    }
+    http_server__log_ring_copy_out(ring, tail, record, sizeof(*record));
+    if (size > 0)
+    {
+        int length = record->length < size - 1 ? record->length : size - 1;
+        http_server__log_ring_copy_out(ring, tail + sizeof(*record), buffer, length);
+        buffer[length] = '\0';
+    }
+    __atomic_store_n(&ring->tail, tail + LOG_ALIGN(sizeof(*record) + record->length), __ATOMIC_RELEASE);
+    return 1;
+}
+
+void http_server__log(http_server * srv, int level, int category, const char * format, ...)
+{
+    char message[LOG_MESSAGE_SIZE];
+    char * ptr = message;
+    char * buffer = NULL;
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (length < 0)
+    {
+        return;
+    }
+    if (length >= (int)sizeof(message))
+    {
+        va_start(args, format);
+        if (vasprintf(&buffer, format, args) == -1)
+        {
+            buffer = NULL;
+            length = sizeof(message) - 1;
+        }
+        else
+        {
+            ptr = buffer;
+        }
+        va_end(args);
+    }
+    if (srv->log_ring)
+    {
+        Http_server_log_ring_write(srv->log_ring, level, category, ptr, length);
+    }
+    if (srv->debug_func)
+    {
+        srv->debug_func(level, ptr, length, srv->debug_data);
+    }
+    free(buffer);
+}
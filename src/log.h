@@ -0,0 +1,41 @@
+#include "build_config.h"
+
+/**
+ * Leveled logging. Level and category are checked before the arguments
+ * are evaluated so disabled messages cost a compare. Trace messages are
+ * compiled out unless HTTP_SERVER_ENABLE_TRACE is configured.
+ *
+ *   HTTP_SERVER_LOG(srv, DEBUG, CLIENT, "client %d eof", sock);
+ *   HTTP_SERVER_TRACE(srv, EVENT, "rd=%d", sock);
+ */
+
+#define HTTP_SERVER_LOG(srv, level, category, ...) \
+    do \
+    { \
+        if (HTTP_SERVER_LOG_ ## level <= (srv)->log_threshold_ && ((srv)->log_categories & HTTP_SERVER_LOG_ ## category)) \
+        { \
+            http_server__log((srv), HTTP_SERVER_LOG_ ## level, HTTP_SERVER_LOG_ ## category, __VA_ARGS__); \
+        } \
+    } \
+    while (0)
+
+#if defined(HTTP_SERVER_ENABLE_TRACE)
+#define HTTP_SERVER_TRACE(srv, category, ...) HTTP_SERVER_LOG(srv, TRACE, category, __VA_ARGS__)
+#else
+// Arguments are still type checked
+#define HTTP_SERVER_TRACE(srv, category, ...) \
+    do \
+    { \
+        if (0) \
+        { \
+            http_server__log((srv), HTTP_SERVER_LOG_TRACE, HTTP_SERVER_LOG_ ## category, __VA_ARGS__); \
+        } \
+    } \
+    while (0)
+#endif
+
+/**
+ * Append message to the ring. Message is dropped if the ring is full.
+ * Called only by the event loop thread.
+ */
+void Http_server_log_ring_write(http_server_log_ring * ring, int level, int category, const char * message, int length);
@@ -0,0 +1,35 @@
+#include "build_config.h"
+
+/**
+ * Static tracepoints of the `http_server` provider. With <sys/sdt.h>
+ * every probe is a single nop and a note that bpftrace, perf or
+ * SystemTap attach to at run time. Without it probes compile to
+ * nothing.
+ *
+ *   accept(fd, listener fd)          reject(fd, status code)
+ *   accept_batch(listener fd, count) close(fd)
+ *   read(fd, bytes)                  read_again(fd)
+ *   writev(fd, iovecs, bytes, queued bytes left)
+ *   write_again(fd, queued bytes)
+ *   request_begin(fd, request no)    headers_complete(fd, method)
+ *   body(fd, bytes)                  request_complete(fd, request no, pipeline length)
+ *   parser_error(fd, http_errno)
+ *   response_begin(fd, request no)   response_head(fd, request no, status code)
+ *   response_end(fd, request no)
+ *   response_sent(fd, request no, microseconds since the request was read)
+ *
+ *   bpftrace -e 'usdt:./server:http_server:writev { @bytes = hist(arg2); }'
+ */
+
+#if defined(HTTP_SERVER_HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+#define HTTP_SERVER_PROBE1(name, a) DTRACE_PROBE1(http_server, name, a)
+#define HTTP_SERVER_PROBE2(name, a, b) DTRACE_PROBE2(http_server, name, a, b)
+#define HTTP_SERVER_PROBE3(name, a, b, c) DTRACE_PROBE3(http_server, name, a, b, c)
+#define HTTP_SERVER_PROBE4(name, a, b, c, d) DTRACE_PROBE4(http_server, name, a, b, c, d)
+#else
+#define HTTP_SERVER_PROBE1(name, a) do { } while (0)
+#define HTTP_SERVER_PROBE2(name, a, b) do { } while (0)
+#define HTTP_SERVER_PROBE3(name, a, b, c) do { } while (0)
+#define HTTP_SERVER_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
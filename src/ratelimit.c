@@ -0,0 +1,162 @@
+#include "http-server/http-server.h"
+#include <stdlib.h>
+#include <string.h>
+#include "ratelimit.h"
+
+// Buckets are allocated on first use
+#define RATE_TABLE_MIN 64
+// Table does not grow beyond this and lets new addresses through
+#define RATE_TABLE_MAX 65536
+// Idle buckets are evicted at least this often (milliseconds)
+#define RATE_SWEEP_INTERVAL 10000
+// and at most this often when the table fills up
+#define RATE_SWEEP_MIN_INTERVAL 100
+
+void Http_server_rate_table_init(http_server_rate_table * table)
+{
+    table->buckets = NULL;
+    table->capacity = 0;
+    table->len = 0;
+    table->swept = 0;
+}
+
+void Http_server_rate_table_free(http_server_rate_table * table)
+{
+    free(table->buckets);
+    Http_server_rate_table_init(table);
+}
+
+static unsigned int http_server__rate_hash(const unsigned char * addr)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < 16; ++i)
+    {
+        hash ^= addr[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Find bucket of the address or the free slot it belongs to
+ */
+static http_server_rate_bucket * http_server__rate_find(http_server_rate_bucket * buckets, int capacity, const unsigned char * addr)
+{
+    unsigned int i = http_server__rate_hash(addr) & (capacity - 1);
+    // Load factor is kept below 3/4 so there is always a free slot
+    while (buckets[i].is_used && memcmp(buckets[i].addr, addr, 16) != 0)
+    {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &buckets[i];
+}
+
+/**
+ * Refill bucket up to `burst` tokens
+ */
+static void http_server__rate_refill(http_server_rate_bucket * bucket, long rate, long burst, unsigned long long now)
+{
+    long full = burst * 1000;
+    if (now > bucket->updated)
+    {
+        unsigned long long elapsed = now - bucket->updated;
+        // Tokens are kept in thousandths, so one millisecond adds `rate`
+        if (elapsed >= (unsigned long long)(full / rate + 1))
+        {
+            bucket->tokens = full;
+        }
+        else if ((bucket->tokens += (long)elapsed * rate) > full)
+        {
+            bucket->tokens = full;
+        }
+        bucket->updated = now;
+    }
+}
+
+/**
+ * Rehash buckets into a table of `capacity` slots dropping the ones that
+ * refilled completely since they would start over with a full bucket
+ */
+static int http_server__rate_sweep(http_server_rate_table * table, int capacity, long rate, long burst, unsigned long long now)
+{
+    http_server_rate_bucket * buckets = calloc(capacity, sizeof(http_server_rate_bucket));
+    if (!buckets)
+    {
+        return HTTP_SERVER_NO_MEMORY;
+    }
+    int len = 0;
+    int i;
+    for (i = 0; i < table->capacity; ++i)
+    {
+        http_server_rate_bucket * bucket = &table->buckets[i];
+        if (!bucket->is_used)
+        {
+            continue;
+        }
+        http_server__rate_refill(bucket, rate, burst, now);
+        if (bucket->tokens >= burst * 1000)
+        {
+            continue;
+        }
+        *http_server__rate_find(buckets, capacity, bucket->addr) = *bucket;
+        len++;
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->capacity = capacity;
+    table->len = len;
+    table->swept = now;
+    return HTTP_SERVER_OK;
+}
+
+int Http_server_rate_take(http_server_rate_table * table, const unsigned char * addr, long rate, long burst, unsigned long long now)
+{
+    if (rate <= 0)
+    {
+        return 1;
+    }
+    if (burst <= 0)
+    {
+        burst = rate;
+    }
+    int is_full = (table->len + 1) * 4 > table->capacity * 3;
+    if (!table->buckets || now - table->swept >= RATE_SWEEP_INTERVAL
+        || (is_full && now - table->swept >= RATE_SWEEP_MIN_INTERVAL))
+    {
+        int capacity = table->capacity ? table->capacity : RATE_TABLE_MIN;
+        if (http_server__rate_sweep(table, capacity, rate, burst, now) != HTTP_SERVER_OK)
+        {
+            // Fail open
+            return 1;
+        }
+        // Grow if sweeping did not free enough slots
+        if ((table->len + 1) * 2 > table->capacity && table->capacity < RATE_TABLE_MAX
+            && http_server__rate_sweep(table, table->capacity * 2, rate, burst, now) != HTTP_SERVER_OK)
+        {
+            return 1;
+        }
+    }
+    http_server_rate_bucket * bucket = http_server__rate_find(table->buckets, table->capacity, addr);
+    if (!bucket->is_used)
+    {
+        if ((table->len + 1) * 4 > table->capacity * 3)
+        {
+            // Table is full of active addresses
+            return 1;
+        }
+        memcpy(bucket->addr, addr, 16);
+        bucket->updated = now;
+        bucket->tokens = burst * 1000;
+        bucket->is_used = 1;
+        table->len++;
+    }
+    http_server__rate_refill(bucket, rate, burst, now);
+    if (bucket->tokens < 1000)
+    {
+        return 0;
+    }
+    bucket->tokens -= 1000;
+    return 1;
+}
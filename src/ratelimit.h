@@ -0,0 +1,18 @@
+/**
+ * Per peer address token buckets kept in an open addressing table.
+ * Buckets are refilled lazily when taken from and buckets that refilled
+ * completely are evicted by periodic sweeps.
+ */
+
+void Http_server_rate_table_init(http_server_rate_table * table);
+
+void Http_server_rate_table_free(http_server_rate_table * table);
+
+/**
+ * Take a token from the bucket of the address. New address starts with
+ * a full bucket of `burst` tokens refilled at `rate` tokens per second.
+ * @param addr IPv6 or IPv4-mapped address
+ * @param now Current time in milliseconds
+ * @return 1 if token was taken, 0 if the address is over the limit
+ */
+int Http_server_rate_take(http_server_rate_table * table, const unsigned char * addr, long rate, long burst, unsigned long long now);
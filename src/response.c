@@ -3,22 +3,361 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
-#include <ctype.h>
 #include <stdarg.h>
+#include <strings.h>
+#include <time.h>
+#include "client.h"
+#include "stats.h"
+#include "probes.h"
 
-static int http_server_header_cmp(struct http_server_header * lhs, struct http_server_header * rhs)
+/**
+ * Response writes directly to the client's output queue only if all
+ * previous responses are finished.
+ */
+static int http_server__response_is_active(http_server_response * res)
 {
-    const char * a = http_server_string_str(&lhs->field);
-    const char * b = http_server_string_str(&rhs->field);
-    while( *a && *b )
+    http_server_response * it;
+    TAILQ_FOREACH(it, &res->client->responses_, responses_)
     {
-        int r = tolower(*a) - tolower(*b);
-        if( r )
+        if (it == res)
+        {
+            return 1;
+        }
+        if (!it->is_done)
+        {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Move buffered output of responses that are allowed to write now
+ * to the client's output queue.
+ */
+static void http_server__client_promote_responses(http_server_client * client)
+{
+    http_server_response * it;
+    TAILQ_FOREACH(it, &client->responses_, responses_)
+    {
+        if (!TAILQ_EMPTY(&it->pending_))
+        {
+            TAILQ_CONCAT(&client->buffer, &it->pending_, bufs);
+            client->buffer_size_ += it->pending_size_;
+            it->pending_size_ = 0;
+        }
+        if (!it->is_done)
+        {
+            break;
+        }
+    }
+}
+
+#define XX(id, name) { name, sizeof(name) - 1 },
+static const struct
+{
+    const char * name;
+    int len;
+} http_server__known_headers[HTTP_SERVER_HEADER_COUNT] = {
+    { NULL, 0 },
+    HTTP_SERVER_ENUM_KNOWN_HEADERS(XX)
+};
+#undef XX
+
+// Hashes of well-known header names computed on first use
+static unsigned int http_server__known_hashes[HTTP_SERVER_HEADER_COUNT];
+
+/**
+ * FNV-1a hash of lower case header name
+ */
+static unsigned int http_server__header_hash(const char * name, int len)
+{
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < len; ++i)
+    {
+        unsigned char c = name[i];
+        if (c >= 'A' && c <= 'Z')
+        {
+            c += 'a' - 'A';
+        }
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int http_server__header_id(const char * name, int len, unsigned int hash)
+{
+    int id;
+    for (id = 1; id < HTTP_SERVER_HEADER_COUNT; ++id)
+    {
+        if (!http_server__known_hashes[id])
+        {
+            http_server__known_hashes[id] = http_server__header_hash(http_server__known_headers[id].name, http_server__known_headers[id].len);
+        }
+        if (hash == http_server__known_hashes[id] && len == http_server__known_headers[id].len
+            && strncasecmp(name, http_server__known_headers[id].name, len) == 0)
+        {
+            return id;
+        }
+    }
+    return HTTP_SERVER_HEADER_OTHER;
+}
+
+/**
+ * Index of the first header with given name or -1
+ */
+static int http_server__response_find_header(http_server_response * res, const char * name, int len, unsigned int hash, int id)
+{
+    if (id != HTTP_SERVER_HEADER_OTHER)
+    {
+        return res->known_headers_[id] - 1;
+    }
+    int i;
+    for (i = 0; i < res->headers_len; ++i)
+    {
+        http_server_response_header * header = &res->headers[i];
+        if (header->name_len == len && header->hash == hash
+            && strncasecmp(res->header_data_.buf + header->off, name, len) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Store header line. Header at `index` is replaced or a new one is added
+ * if `index` is -1.
+ */
+static int http_server__response_store_header(http_server_response * res, int index, const char * name, int namelen, const char * value, int valuelen, unsigned int hash, int id)
+{
+    int off = res->header_data_.len;
+    int r;
+    if ((r = http_server_string_append(&res->header_data_, name, namelen)) != HTTP_SERVER_OK
+        || (r = http_server_string_append(&res->header_data_, ": ", 2)) != HTTP_SERVER_OK
+        || (r = http_server_string_append(&res->header_data_, value, valuelen)) != HTTP_SERVER_OK
+        || (r = http_server_string_append(&res->header_data_, "\r\n", 2)) != HTTP_SERVER_OK)
+    {
+        return r;
+    }
+    if (index == -1)
+    {
+        if (res->headers_len == res->headers_size_)
+        {
+            int new_size = res->headers_size_ ? res->headers_size_ * 2 : 8;
+            http_server_response_header * new_headers = realloc(res->headers, new_size * sizeof(http_server_response_header));
+            if (!new_headers)
+            {
+                return HTTP_SERVER_NO_MEMORY;
+            }
+            res->headers = new_headers;
+            res->headers_size_ = new_size;
+        }
+        index = res->headers_len++;
+        if (id != HTTP_SERVER_HEADER_OTHER && !res->known_headers_[id])
+        {
+            res->known_headers_[id] = index + 1;
+        }
+    }
+    http_server_response_header * header = &res->headers[index];
+    header->hash = hash;
+    header->id = id;
+    header->off = off;
+    header->name_len = namelen;
+    header->value_len = valuelen;
+    // Content-Length disables chunked encoding and setting
+    // Transfer-Encoding enables it back
+    if (id == HTTP_SERVER_HEADER_CONTENT_LENGTH)
+    {
+        r = http_server_response_remove_header(res, "Transfer-Encoding", 17);
+    }
+    else if (id == HTTP_SERVER_HEADER_TRANSFER_ENCODING)
+    {
+        res->is_chunked = 1;
+    }
+    return r;
+}
+
+static void http_server__response_clear_headers(http_server_response * res)
+{
+    // Memory is kept for the next use
+    res->headers_len = 0;
+    res->header_data_.len = 0;
+    memset(res->known_headers_, 0, sizeof(res->known_headers_));
+}
+
+/**
+ * Date and Server headers are the same for all responses sent within
+ * one second so they are formatted once per second of wall clock time.
+ */
+static const char * http_server__common_headers(http_server * srv, int * len)
+{
+    time_t now = time(NULL);
+    if ((long long)now != srv->common_headers_time_)
+    {
+        int size = sizeof(srv->common_headers_);
+        int n = 0;
+        if (srv->date_header)
+        {
+            struct tm tm;
+            gmtime_r(&now, &tm);
+            n += strftime(srv->common_headers_, size, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        }
+        srv->common_date_len_ = n;
+        if (srv->server_name)
+        {
+            int r = snprintf(srv->common_headers_ + n, size - n, "Server: %s\r\n", srv->server_name);
+            if (r > 0 && r < size - n)
+            {
+                n += r;
+            }
+        }
+        srv->common_headers_len_ = n;
+        srv->common_headers_time_ = now;
+    }
+    *len = srv->common_headers_len_;
+    return srv->common_headers_;
+}
+
+/**
+ * Add Connection header unless the handler set one. Handler asking to
+ * close the connection is honoured after this response.
+ */
+static int http_server__response_connection_header(http_server_response * res)
+{
+    http_server_client * client = res->client;
+    if (client->is_http10_ && res->is_chunked)
+    {
+        // HTTP/1.0 has no chunked encoding. Body without Content-Length
+        // is sent as is and ends when the connection is closed.
+        int r = http_server_response_remove_header(res, "Transfer-Encoding", 17);
+        if (r != HTTP_SERVER_OK)
+        {
             return r;
-        ++a;
-        ++b;
+        }
+        if (!client->close_after_ || res->request_no_ < client->close_after_)
+        {
+            client->close_after_ = res->request_no_;
+        }
+        client->is_closing_ = 1;
+        return http_server_response_set_header(res, "Connection", 10, "close", 5);
+    }
+    int index = res->known_headers_[HTTP_SERVER_HEADER_CONNECTION] - 1;
+    if (index >= 0)
+    {
+        http_server_response_header * header = &res->headers[index];
+        if (header->value_len == 5
+            && strncasecmp(res->header_data_.buf + header->off + header->name_len + 2, "close", 5) == 0
+            && (!client->close_after_ || res->request_no_ < client->close_after_))
+        {
+            client->close_after_ = res->request_no_;
+            client->is_closing_ = 1;
+        }
+        return HTTP_SERVER_OK;
+    }
+    if (client->close_after_ && res->request_no_ >= client->close_after_)
+    {
+        return http_server_response_set_header(res, "Connection", 10, "close", 5);
     }
-    return tolower(*a)-tolower(*b);
+    if (client->keep_alive_http10_)
+    {
+        return http_server_response_set_header(res, "Connection", 10, "keep-alive", 10);
+    }
+    return HTTP_SERVER_OK;
+}
+
+// Room for chunk size of any int in hex followed by CRLF
+#define HTTP_SERVER__CHUNK_HEADROOM 10
+
+/**
+ * Output queue the response writes to right now
+ */
+static struct http_server_bufs * http_server__response_bufs(http_server_response * res)
+{
+    return http_server__response_is_active(res) ? &res->client->buffer : &res->pending_;
+}
+
+/**
+ * Account data written in place to a buffer from `http_server__response_bufs`
+ */
+static void http_server__response_commit(http_server_response * res, struct http_server_bufs * bufs, http_server_buf * buf, int size)
+{
+    buf->size += size;
+    if (bufs == &res->client->buffer)
+    {
+        res->client->buffer_size_ += size;
+    }
+    else
+    {
+        res->pending_size_ += size;
+    }
+}
+
+/**
+ * Frame `size` bytes placed HTTP_SERVER__CHUNK_HEADROOM bytes after
+ * buffer's data as a chunk. Returns number of bytes added to the buffer.
+ */
+static int http_server__response_frame_chunk(http_server_buf * buf, int size)
+{
+    char prefix[HTTP_SERVER__CHUNK_HEADROOM + 1];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%x\r\n", size);
+    char * end = buf->data + buf->size;
+    char * chunk = end + HTTP_SERVER__CHUNK_HEADROOM;
+    if (buf->size == 0)
+    {
+        // Nothing in front of the chunk so only its start moves
+        buf->data = chunk - prefix_len;
+        end = buf->data;
+    }
+    else if (prefix_len < HTTP_SERVER__CHUNK_HEADROOM)
+    {
+        memmove(end + prefix_len, chunk, size);
+    }
+    memcpy(end, prefix, prefix_len);
+    memcpy(end + prefix_len + size, "\r\n", 3);
+    return prefix_len + size + 2;
+}
+
+static int http_server__response_queue(http_server_response * res, const char * data, int size)
+{
+    if (!res->client)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    if (http_server__response_is_active(res))
+    {
+        return http_server_client_write(res->client, (char *)data, size);
+    }
+    int r = http_server__buf_append(res->client->server_, &res->pending_, data, size);
+    if (r == HTTP_SERVER_OK)
+    {
+        res->pending_size_ += size;
+    }
+    return r;
+}
+
+/**
+ * Queue part of prepared response without copying
+ */
+static int http_server__response_queue_ref(http_server_response * res, http_server_prepared_response * prepared, int offset, int size)
+{
+    if (http_server__response_is_active(res))
+    {
+        int r = http_server__buf_append_ref(&res->client->buffer, prepared, offset, size);
+        if (r == HTTP_SERVER_OK)
+        {
+            res->client->buffer_size_ += size;
+        }
+        return r;
+    }
+    int r = http_server__buf_append_ref(&res->pending_, prepared, offset, size);
+    if (r == HTTP_SERVER_OK)
+    {
+        res->pending_size_ += size;
+    }
+    return r;
 }
 
 http_server_response * http_server_response_new()
@@ -30,7 +369,11 @@ http_server_response * http_server_response_new()
     }
     // Initialize output headers
     res->headers_sent = 0;
-    TAILQ_INIT(&res->headers);
+    res->headers = NULL;
+    res->headers_len = 0;
+    res->headers_size_ = 0;
+    http_server_string_init(&res->header_data_);
+    memset(res->known_headers_, 0, sizeof(res->known_headers_));
     // By default all responses are "chunked"
     int r = http_server_response_set_header(res, "Transfer-Encoding", 17, "chunked", 7);
     if (r != HTTP_SERVER_OK)
@@ -39,170 +382,291 @@ http_server_response * http_server_response_new()
     }
     res->client = NULL;
     res->is_done = 0;
+    TAILQ_INIT(&res->pending_);
+    res->pending_size_ = 0;
+    res->request_no_ = 0;
+    res->status_code_ = 0;
+    res->is_buffering_ = 0;
+    res->start_time_ = 0;
+    memset(&res->trace_, 0, sizeof(res->trace_));
+    http_server_string_init(&res->body_);
     return res;
 }
 
-void http_server_response_free(http_server_response * res)
+/**
+ * Bring response back to the state right after it was created.
+ * Header and body storage is kept.
+ */
+static int http_server__response_reset(http_server_response * res)
 {
-    if (res == NULL)
+    res->headers_sent = 0;
+    http_server__response_clear_headers(res);
+    res->client = NULL;
+    res->is_done = 0;
+    res->pending_size_ = 0;
+    res->request_no_ = 0;
+    res->status_code_ = 0;
+    res->is_buffering_ = 0;
+    res->start_time_ = 0;
+    memset(&res->trace_, 0, sizeof(res->trace_));
+    res->body_.len = 0;
+    if (res->body_.buf)
     {
-        return;
+        res->body_.buf[0] = '\0';
     }
-    // Free headers
-    while (!TAILQ_EMPTY(&res->headers))
+    return http_server_response_set_header(res, "Transfer-Encoding", 17, "chunked", 7);
+}
+
+http_server_response * http_server_response_acquire(http_server_client * client)
+{
+    assert(client);
+    http_server * srv = client->server_;
+    http_server_response * res;
+    if (srv && !TAILQ_EMPTY(&srv->response_pool_))
     {
-        struct http_server_header * header = TAILQ_FIRST(&res->headers);
-        TAILQ_REMOVE(&res->headers, header, headers);
-        http_server_header_free(header);
+        res = TAILQ_FIRST(&srv->response_pool_);
+        TAILQ_REMOVE(&srv->response_pool_, res, responses_);
+        srv->response_pool_len_--;
     }
-    free(res);
+    else if (!(res = http_server_response_new()))
+    {
+        return NULL;
+    }
+    if (http_server_response_begin(client, res) != HTTP_SERVER_OK)
+    {
+        http_server_response_free(res);
+        return NULL;
+    }
+    return res;
 }
 
-int http_server_response_begin(http_server_client * client, http_server_response * res)
+void http_server__response_recycle(http_server * srv, http_server_response * res)
 {
-    assert(client);
-    assert(!client->current_response_);
-    res->client = client;
-    client->current_response_ = res;
-    return http_server_client_flush(client);
+    assert(res->is_done);
+    assert(TAILQ_EMPTY(&res->pending_));
+    if (!srv || srv->response_pool_len_ >= srv->response_pool_size)
+    {
+        http_server_response_free(res);
+        return;
+    }
+    http_server_client * client = res->client;
+    if (client)
+    {
+        TAILQ_REMOVE(&client->responses_, res, responses_);
+        http_server__client_promote_responses(client);
+    }
+    if (http_server__response_reset(res) != HTTP_SERVER_OK)
+    {
+        http_server_response_free(res);
+        return;
+    }
+    TAILQ_INSERT_TAIL(&srv->response_pool_, res, responses_);
+    srv->response_pool_len_++;
 }
 
-int http_server_response_end(http_server_response * res)
+void http_server_response_free(http_server_response * res)
 {
-    assert(res);
-    assert(res->is_done == 0);
-    // Mark the response as "finished" so we can know when to proceed
-    // to the next request.
-    res->is_done = 1;
-    // Pop current response and proceed to the next?
-    // Add "empty frame" if there is chunked encoding
-    return http_server_response_write(res, NULL, 0);
+    if (res == NULL)
+    {
+        return;
+    }
+    // Free headers
+    free(res->headers);
+    http_server_string_free(&res->header_data_);
+    http_server_client * client = res->client;
+    if (client)
+    {
+        TAILQ_REMOVE(&client->responses_, res, responses_);
+        // Responses waiting for this one can write now
+        http_server__client_promote_responses(client);
+    }
+    while (!TAILQ_EMPTY(&res->pending_))
+    {
+        http_server_buf * buf = TAILQ_FIRST(&res->pending_);
+        TAILQ_REMOVE(&res->pending_, buf, bufs);
+        http_server__buf_free(client ? client->server_ : NULL, buf);
+    }
+    http_server_string_free(&res->body_);
+    free(res);
 }
 
-int http_server_response_write_head(http_server_response * res, int status_code)
+/**
+ * Format status line. Returns its length or -1 for unknown status code.
+ * Only validates the code if `buf` is NULL.
+ */
+static int http_server__status_line(int status_code, char * buf, int size)
 {
-    char head[1024];
-    int head_len = -1;
 #define XX(code, name, description) \
     case code: \
-        head_len = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\n", code, description); \
-        break;
+        return buf ? snprintf(buf, size, "HTTP/1.1 %d %s\r\n", code, description) : 0;
     switch (status_code)
     {
     HTTP_SERVER_ENUM_STATUS_CODES(XX)
     default:
-        return HTTP_SERVER_INVALID_PARAM;
+        return -1;
     }
-    int r = http_server_client_write(res->client, head, head_len);
-    return r;
 #undef XX
 }
 
-int http_server_response_set_header(http_server_response * res, char * name, int namelen, char * value, int valuelen)
+typedef int (*http_server__emit_cb)(void * ctx, const char * data, int size);
+
+static int http_server__emit_queue(void * ctx, const char * data, int size)
 {
-    assert(res);
-    // TODO: Add support to 'trailing' headers with chunked encoding
-    assert(!res->headers_sent && "Headers already sent");
+    return http_server__response_queue(ctx, data, size);
+}
 
-    // Add new header
-    struct http_server_header * hdr = http_server_header_new();
-    int r;
-    if ((r = http_server_string_append(&hdr->field, name, namelen)) != HTTP_SERVER_OK)
+static int http_server__emit_string(void * ctx, const char * data, int size)
+{
+    return http_server_string_append(ctx, data, size);
+}
+
+/**
+ * Headers of the response are queued
+ */
+static void http_server__response_first_byte(http_server_response * res)
+{
+    if (!res->client)
     {
-        return r;
+        return;
     }
-    if ((r = http_server_string_append(&hdr->value, value, valuelen)) != HTTP_SERVER_OK)
+    HTTP_SERVER_PROBE3(response_head, res->client->sock, res->request_no_, res->status_code_);
+    if (res->client->server_)
     {
-        return r;
+        Http_server_histogram_record_since(&res->client->server_->stats_.first_byte, res->start_time_);
     }
-    
-    // Disable chunked encoding if user specifies length
-    struct http_server_header hdr_contentlength;
-    http_server_string_init(&hdr_contentlength.field);
-    if ((r = http_server_string_append(&hdr_contentlength.field, "Content-Length", 14)) != HTTP_SERVER_OK)
+}
+
+/**
+ * Serialize status line and all headers
+ */
+static int http_server__response_serialize_head(http_server_response * res, http_server__emit_cb emit, void * ctx)
+{
+    int r = http_server__response_connection_header(res);
+    if (r != HTTP_SERVER_OK)
     {
         return r;
     }
-    struct http_server_header hdr_transferencoding;
-    http_server_string_init(&hdr_transferencoding.field);
-    if ((r = http_server_string_append(&hdr_transferencoding.field, "Transfer-Encoding", 17)) != HTTP_SERVER_OK)
+    if (res->status_code_)
     {
-        return r;
+        char head[1024];
+        int head_len = http_server__status_line(res->status_code_, head, sizeof(head));
+        if ((r = emit(ctx, head, head_len)) != HTTP_SERVER_OK)
+        {
+            return r;
+        }
     }
-    
-    // Check if user tries to set Content-length header, so we
-    // have to disable chunked encoding.
-    if (http_server_header_cmp(&hdr_contentlength, hdr) == 0)
+    http_server * srv = res->client->server_;
+    if (srv)
     {
-        // Remove Transfer-encoding if user sets content-length
-
-        while (!TAILQ_EMPTY(&res->headers))
+        // Handler's own Date or Server header takes precedence
+        int common_len;
+        const char * common = http_server__common_headers(srv, &common_len);
+        int date_len = res->known_headers_[HTTP_SERVER_HEADER_DATE] ? 0 : srv->common_date_len_;
+        int server_len = res->known_headers_[HTTP_SERVER_HEADER_SERVER] ? 0 : common_len - srv->common_date_len_;
+        if (date_len + server_len == common_len)
         {
-            struct http_server_header * header = TAILQ_FIRST(&res->headers);
-            if (http_server_header_cmp(&hdr_transferencoding, header) == 0)
-            {
-                TAILQ_REMOVE(&res->headers, header, headers);
-                http_server_header_free(header);
-            }
+            r = common_len > 0 ? emit(ctx, common, common_len) : HTTP_SERVER_OK;
+        }
+        else if (date_len > 0)
+        {
+            r = emit(ctx, common, date_len);
+        }
+        else if (server_len > 0)
+        {
+            r = emit(ctx, common + srv->common_date_len_, server_len);
+        }
+        if (r != HTTP_SERVER_OK)
+        {
+            return r;
         }
-        res->is_chunked = 0;
     }
-
-    // If user choose chunked encoding we "cache" it
-    if (http_server_header_cmp(&hdr_transferencoding, hdr) == 0)
+    int i;
+    for (i = 0; i < res->headers_len; ++i)
     {
-        res->is_chunked = 1;
+        http_server_response_header * header = &res->headers[i];
+        if (!header->name_len)
+        {
+            // Removed
+            continue;
+        }
+        r = emit(ctx, res->header_data_.buf + header->off, header->name_len + header->value_len + 4);
+        if (r != HTTP_SERVER_OK)
+        {
+            return r;
+        }
     }
-
-    TAILQ_INSERT_TAIL(&res->headers, hdr, headers);
+    http_server__response_clear_headers(res);
+    if ((r = emit(ctx, "\r\n", 2)) != HTTP_SERVER_OK)
+    {
+        return r;
+    }
+    res->headers_sent = 1;
+    http_server__response_first_byte(res);
     return HTTP_SERVER_OK;
 }
 
-int http_server_response_write(http_server_response * res, char * data, int size)
+/**
+ * Send whole buffered response with Content-Length as a single buffer
+ */
+static int http_server__response_send_buffered(http_server_response * res)
+{
+    char length[32];
+    int length_len = snprintf(length, sizeof(length), "%d", res->body_.len);
+    int r = http_server_response_set_header(res, "Content-Length", 14, length, length_len);
+    if (r != HTTP_SERVER_OK)
+    {
+        return r;
+    }
+    http_server_string out;
+    http_server_string_init(&out);
+    r = http_server__response_serialize_head(res, &http_server__emit_string, &out);
+    if (r == HTTP_SERVER_OK && res->body_.len > 0)
+    {
+        r = http_server_string_append(&out, res->body_.buf, res->body_.len);
+    }
+    if (r == HTTP_SERVER_OK)
+    {
+        r = http_server__response_queue(res, out.buf, out.len);
+    }
+    http_server_string_free(&out);
+    res->headers_sent = 1;
+    return r;
+}
+
+/**
+ * Write body data with framing required by the response. Headers are
+ * sent before the first write.
+ */
+static int http_server__response_write(http_server_response * res, char * data, int size)
 {
     // Flush all headers if they arent already sent
     if (!res->headers_sent)
     {
-        while (!TAILQ_EMPTY(&res->headers))
-        {
-            // Add all queued headers to the response queue
-            struct http_server_header * header = TAILQ_FIRST(&res->headers);
-            char data[1024];
-            int data_len = sprintf(data, "%s: %s\r\n", http_server_string_str(&header->field), http_server_string_str(&header->value));
-            int r = http_server_client_write(res->client, data, data_len);
-            // Remove first header from the queue
-            TAILQ_REMOVE(&res->headers, header, headers);
-            http_server_header_free(header);
-            if (r != HTTP_SERVER_OK)
-            {
-                return r;
-            }
-        }
-        assert(res->client);
-        int r = http_server_client_write(res->client, "\r\n", 2);
+        int r = http_server__response_serialize_head(res, &http_server__emit_queue, res);
         if (r != HTTP_SERVER_OK)
         {
             return r;
         }
-        res->headers_sent = 1;
     }
     if (res->is_chunked)
     {
-        // Create chunked encoding frame
-        char * frame = NULL;
-        int frame_length = asprintf(&frame, "%x\r\n%.*s\r\n", size, size, data);
-        if (frame_length == -1)
+        // Copy data once right between its chunk size and CRLF
+        char prefix[HTTP_SERVER__CHUNK_HEADROOM + 1];
+        int prefix_len = snprintf(prefix, sizeof(prefix), "%x\r\n", size);
+        struct http_server_bufs * bufs = http_server__response_bufs(res);
+        http_server_buf * buf = http_server__buf_reserve(res->client->server_, bufs, prefix_len + size + 3);
+        if (!buf)
         {
             return HTTP_SERVER_NO_MEMORY;
         }
-        assert(res->client);
-        int r = http_server_client_write(res->client, frame, frame_length);
-        if (r != HTTP_SERVER_OK)
+        char * end = buf->data + buf->size;
+        memcpy(end, prefix, prefix_len);
+        if (size > 0)
         {
-            free(frame);
-            return r;
+            memcpy(end + prefix_len, data, size);
         }
-        free(frame);
+        memcpy(end + prefix_len + size, "\r\n", 3);
+        http_server__response_commit(res, bufs, buf, prefix_len + size + 2);
     }
     else
     {
@@ -212,7 +676,7 @@ int http_server_response_write(http_server_response * res, char * data, int size
             // Do nothing - called once will create empty response.
             return http_server_client_flush(res->client);
         }
-        int r = http_server_client_write(res->client, data, size);
+        int r = http_server__response_queue(res, data, size);
         if (r != HTTP_SERVER_OK)
         {
             return r;
@@ -221,19 +685,360 @@ int http_server_response_write(http_server_response * res, char * data, int size
     return http_server_client_flush(res->client);
 }
 
+int http_server_response_begin(http_server_client * client, http_server_response * res)
+{
+    assert(client);
+    assert(!res->client);
+    res->client = client;
+    res->request_no_ = ++client->responses_started_;
+    res->start_time_ = client->request_time_;
+    res->trace_ = client->trace_;
+    res->trace_.response_begin = Http_server_client_trace_time(client);
+    HTTP_SERVER_PROBE2(response_begin, client->sock, res->request_no_);
+    res->is_buffering_ = client->server_ && client->server_->response_buffer_size > 0;
+    TAILQ_INSERT_TAIL(&client->responses_, res, responses_);
+    return http_server_client_flush(client);
+}
+
+int http_server_response_end(http_server_response * res)
+{
+    assert(res);
+    assert(res->is_done == 0);
+    if (!res->client)
+    {
+        // Client disconnected before the response was finished
+        res->is_done = 1;
+        http_server_response_free(res);
+        return HTTP_SERVER_CLIENT_EOF;
+    }
+    // Mark the response as "finished" so we can know when to proceed
+    // to the next request.
+    res->is_done = 1;
+    HTTP_SERVER_PROBE2(response_end, res->client->sock, res->request_no_);
+    int r;
+    if (res->is_buffering_ && res->is_chunked && !res->headers_sent)
+    {
+        // Whole body is known so send everything at once
+        r = http_server__response_send_buffered(res);
+    }
+    else
+    {
+        // Add "empty frame" if there is chunked encoding
+        r = http_server__response_write(res, NULL, 0);
+    }
+    // Next pipelined responses are sent after this one
+    http_server__client_promote_responses(res->client);
+    if (r != HTTP_SERVER_OK)
+    {
+        return r;
+    }
+    return http_server_client_flush(res->client);
+}
+
+int http_server_response_write_head(http_server_response * res, int status_code)
+{
+    if (http_server__status_line(status_code, NULL, 0) == -1)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    res->status_code_ = status_code;
+    return HTTP_SERVER_OK;
+}
+
+int http_server_response_set_header(http_server_response * res, char * name, int namelen, char * value, int valuelen)
+{
+    assert(res);
+    // TODO: Add support to 'trailing' headers with chunked encoding
+    assert(!res->headers_sent && "Headers already sent");
+    unsigned int hash = http_server__header_hash(name, namelen);
+    int id = http_server__header_id(name, namelen, hash);
+    int index = http_server__response_find_header(res, name, namelen, hash, id);
+    return http_server__response_store_header(res, index, name, namelen, value, valuelen, hash, id);
+}
+
+int http_server_response_add_header(http_server_response * res, char * name, int namelen, char * value, int valuelen)
+{
+    assert(res);
+    assert(!res->headers_sent && "Headers already sent");
+    unsigned int hash = http_server__header_hash(name, namelen);
+    int id = http_server__header_id(name, namelen, hash);
+    return http_server__response_store_header(res, -1, name, namelen, value, valuelen, hash, id);
+}
+
+int http_server_response_remove_header(http_server_response * res, char * name, int namelen)
+{
+    if (!res || res->headers_sent)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    unsigned int hash = http_server__header_hash(name, namelen);
+    int i;
+    for (i = 0; i < res->headers_len; ++i)
+    {
+        http_server_response_header * header = &res->headers[i];
+        if (header->name_len == namelen && header->hash == hash
+            && strncasecmp(res->header_data_.buf + header->off, name, namelen) == 0)
+        {
+            header->name_len = 0;
+            if (header->id != HTTP_SERVER_HEADER_OTHER)
+            {
+                res->known_headers_[header->id] = 0;
+            }
+            if (header->id == HTTP_SERVER_HEADER_TRANSFER_ENCODING)
+            {
+                res->is_chunked = 0;
+            }
+        }
+    }
+    return HTTP_SERVER_OK;
+}
+
+const char * http_server_response_get_header(http_server_response * res, const char * name, int * value_len)
+{
+    int namelen = strlen(name);
+    unsigned int hash = http_server__header_hash(name, namelen);
+    int id = http_server__header_id(name, namelen, hash);
+    int index = http_server__response_find_header(res, name, namelen, hash, id);
+    if (index == -1)
+    {
+        return NULL;
+    }
+    http_server_response_header * header = &res->headers[index];
+    if (value_len)
+    {
+        *value_len = header->value_len;
+    }
+    return res->header_data_.buf + header->off + header->name_len + 2;
+}
+
+/**
+ * Check if output queued by the response reached high watermark
+ */
+static int http_server__response_is_full(http_server_response * res)
+{
+    http_server_client * client = res->client;
+    return client->server_ && client->server_->output_high_watermark > 0
+        && (http_server__response_is_active(res) ? client->buffer_size_ : res->pending_size_) >= client->server_->output_high_watermark;
+}
+
+int http_server_response_write(http_server_response * res, char * data, int size)
+{
+    // Refuse more data if client is slow to receive it. End of response
+    // is always accepted.
+    http_server_client * client = res->client;
+    if (!client)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    if (data && size > 0 && http_server__response_is_full(res))
+    {
+        client->wants_writable_ = 1;
+        return HTTP_SERVER_WOULD_BLOCK;
+    }
+    if (res->is_buffering_ && res->is_chunked && !res->headers_sent)
+    {
+        if (!data || size == 0)
+        {
+            return HTTP_SERVER_OK;
+        }
+        if (client->server_ && res->body_.len + size <= client->server_->response_buffer_size)
+        {
+            return http_server_string_append(&res->body_, data, size);
+        }
+        // Body is too big to hold. Continue with chunked encoding
+        // starting with what was held so far.
+        res->is_buffering_ = 0;
+        if (res->body_.len > 0)
+        {
+            int r = http_server__response_write(res, res->body_.buf, res->body_.len);
+            http_server_string_free(&res->body_);
+            http_server_string_init(&res->body_);
+            if (r != HTTP_SERVER_OK)
+            {
+                return r;
+            }
+        }
+    }
+    return http_server__response_write(res, data, size);
+}
+
 int http_server_response_printf(http_server_response * res, const char * format, ...)
 {
     va_list args;
-    va_start(args, format);
-    char * buffer = NULL;
-    int result = vasprintf(&buffer, format, args);
-    if (result == -1)
+    http_server_client * client = res->client;
+    if (!client || http_server__response_is_full(res)
+        || (res->is_buffering_ && res->is_chunked && !res->headers_sent))
     {
+        // Output limits and held back body are handled by the regular
+        // write path
+        va_start(args, format);
+        char * buffer = NULL;
+        int result = vasprintf(&buffer, format, args);
         va_end(args);
+        if (result == -1)
+        {
+            return HTTP_SERVER_NO_MEMORY;
+        }
+        int r = http_server_response_write(res, buffer, result);
+        free(buffer);
+        return r;
+    }
+    if (!res->headers_sent)
+    {
+        int r = http_server__response_serialize_head(res, &http_server__emit_queue, res);
+        if (r != HTTP_SERVER_OK)
+        {
+            return r;
+        }
+    }
+    // Format right after queued data leaving room for chunk size
+    int headroom = res->is_chunked ? HTTP_SERVER__CHUNK_HEADROOM : 0;
+    int trailer = res->is_chunked ? 3 : 1;
+    http_server * srv = client->server_;
+    struct http_server_bufs * bufs = http_server__response_bufs(res);
+    http_server_buf * buf = http_server__buf_reserve(srv, bufs, headroom + 64 + trailer);
+    if (!buf)
+    {
         return HTTP_SERVER_NO_MEMORY;
     }
-    int r = http_server_response_write(res, buffer, result);
-    free(buffer);
+    int spare = buf->mem + buf->capacity_ - (buf->data + buf->size) - headroom;
+    va_start(args, format);
+    int result = vsnprintf(buf->data + buf->size + headroom, spare - trailer + 1, format, args);
     va_end(args);
-    return r;
+    if (result > 0 && result + trailer > spare)
+    {
+        // Output did not fit so grow the buffer and format again
+        if (http_server__buf_grow(buf, headroom + result + trailer) != HTTP_SERVER_OK)
+        {
+            result = -1;
+        }
+        else
+        {
+            va_start(args, format);
+            vsnprintf(buf->data + buf->size + headroom, result + 1, format, args);
+            va_end(args);
+        }
+    }
+    if (result <= 0)
+    {
+        if (buf->size == 0)
+        {
+            TAILQ_REMOVE(bufs, buf, bufs);
+            http_server__buf_free(srv, buf);
+        }
+        // Empty output is not an end of chunked body
+        return result == 0 ? HTTP_SERVER_OK : HTTP_SERVER_NO_MEMORY;
+    }
+    if (res->is_chunked)
+    {
+        result = http_server__response_frame_chunk(buf, result);
+    }
+    http_server__response_commit(res, bufs, buf, result);
+    return http_server_client_flush(client);
+}
+
+http_server_prepared_response * http_server_prepared_response_new(int status_code, const char * headers, int headers_len, const char * body, int body_len)
+{
+    char status[1024];
+    int status_len = http_server__status_line(status_code, status, sizeof(status));
+    if (status_len == -1 || headers_len < 0 || body_len < 0)
+    {
+        return NULL;
+    }
+    char length[48];
+    int length_len = snprintf(length, sizeof(length), "Content-Length: %d\r\n", body_len);
+    http_server_prepared_response * prepared = malloc(sizeof(http_server_prepared_response));
+    if (!prepared)
+    {
+        return NULL;
+    }
+    prepared->head_len = status_len + headers_len + length_len;
+    prepared->size = prepared->head_len + 2 + body_len;
+    prepared->data = malloc(prepared->size);
+    if (!prepared->data)
+    {
+        free(prepared);
+        return NULL;
+    }
+    char * p = prepared->data;
+    memcpy(p, status, status_len);
+    p += status_len;
+    if (headers_len > 0)
+    {
+        memcpy(p, headers, headers_len);
+        p += headers_len;
+    }
+    memcpy(p, length, length_len);
+    p += length_len;
+    memcpy(p, "\r\n", 2);
+    p += 2;
+    if (body_len > 0)
+    {
+        memcpy(p, body, body_len);
+    }
+    prepared->refcount_ = 1;
+    return prepared;
+}
+
+void http_server_prepared_response_free(http_server_prepared_response * prepared)
+{
+    if (!prepared || --prepared->refcount_ > 0)
+    {
+        return;
+    }
+    free(prepared->data);
+    free(prepared);
+}
+
+int http_server_response_send_prepared(http_server_response * res, http_server_prepared_response * prepared)
+{
+    assert(res);
+    assert(prepared);
+    assert(!res->headers_sent && "Headers already sent");
+    assert(res->is_done == 0);
+    http_server_client * client = res->client;
+    if (!client)
+    {
+        res->is_done = 1;
+        http_server_response_free(res);
+        return HTTP_SERVER_CLIENT_EOF;
+    }
+    // Per connection headers go right before the empty line
+    char extra[512];
+    int extra_len = 0;
+    if (client->server_)
+    {
+        int common_len;
+        const char * common = http_server__common_headers(client->server_, &common_len);
+        memcpy(extra, common, common_len);
+        extra_len = common_len;
+    }
+    if (client->close_after_ && res->request_no_ >= client->close_after_)
+    {
+        extra_len += snprintf(extra + extra_len, sizeof(extra) - extra_len, "Connection: close\r\n");
+    }
+    else if (client->keep_alive_http10_)
+    {
+        extra_len += snprintf(extra + extra_len, sizeof(extra) - extra_len, "Connection: keep-alive\r\n");
+    }
+    int r;
+    if (extra_len == 0)
+    {
+        r = http_server__response_queue_ref(res, prepared, 0, prepared->size);
+    }
+    else if ((r = http_server__response_queue_ref(res, prepared, 0, prepared->head_len)) == HTTP_SERVER_OK
+        && (r = http_server__response_queue(res, extra, extra_len)) == HTTP_SERVER_OK)
+    {
+        r = http_server__response_queue_ref(res, prepared, prepared->head_len, prepared->size - prepared->head_len);
+    }
+    res->headers_sent = 1;
+    http_server__response_first_byte(res);
+    res->is_done = 1;
+    // Next pipelined responses are sent after this one
+    http_server__client_promote_responses(client);
+    if (r != HTTP_SERVER_OK)
+    {
+        return r;
+    }
+    return http_server_client_flush(client);
 }
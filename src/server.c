@@ -7,10 +7,18 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <string.h>
 #include <strings.h>
 #include <errno.h>
 #include <sys/uio.h>
 #include "event.h"
+#include "timer.h"
+#include "client.h"
+#include "socket.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "log.h"
+#include "probes.h"
 #include "build_config.h"
 
 #ifndef SLIST_FOREACH_SAFE
@@ -20,6 +28,10 @@ for ((var) = SLIST_FIRST((head)); \
 (var) = (tvar))
 #endif
 
+// Milliseconds listeners are paused for when accept runs out of
+// descriptors or memory
+#define HTTP_SERVER_ACCEPT_RETRY 100
+
 int http_server_init(http_server * srv)
 {
     // Clear all fields. All of them is initialized in some way or another
@@ -34,6 +46,57 @@ int http_server_init(http_server * srv)
     srv->socket_data = NULL;
     srv->debug_func = NULL;
     srv->debug_data = NULL;
+    srv->log_level = HTTP_SERVER_LOG_DEBUG;
+    srv->log_categories = HTTP_SERVER_LOG_ALL;
+    srv->log_ring = NULL;
+    srv->log_threshold_ = 0;
+    srv->body_high_watermark = 0;
+    srv->body_low_watermark = 0;
+    srv->output_high_watermark = 0;
+    srv->output_low_watermark = 0;
+    srv->header_timeout = 60000;
+    srv->body_timeout = 60000;
+    srv->keepalive_timeout = 75000;
+    srv->write_timeout = 60000;
+    srv->max_pipeline = 16;
+    srv->max_keepalive_requests = 100;
+    srv->response_buffer_size = 0;
+    srv->date_header = 1;
+    srv->server_name = NULL;
+    srv->common_headers_len_ = 0;
+    srv->common_date_len_ = 0;
+    srv->response_pool_size = 64;
+    srv->cork = 1;
+    srv->bind_address = NULL;
+    srv->port = 5000;
+    srv->backlog = SOMAXCONN;
+    srv->reuseport = 0;
+    srv->defer_accept = 0;
+    srv->fastopen = 0;
+    srv->nodelay = 0;
+    srv->sndbuf = 0;
+    srv->rcvbuf = 0;
+    srv->accept_budget = 64;
+    srv->max_connections = 0;
+    srv->max_inflight = 0;
+    srv->retry_after = 1;
+    srv->connections_ = 0;
+    srv->inflight_ = 0;
+    srv->overload_response_ = NULL;
+    srv->rate_limit = 0;
+    srv->rate_burst = 0;
+    Http_server_rate_table_init(&srv->rate_table_);
+    srv->rate_limited_response_ = NULL;
+    TAILQ_INIT(&srv->response_pool_);
+    srv->response_pool_len_ = 0;
+    srv->buf_pool_len_ = 0;
+    srv->common_headers_time_ = -1;
+    Http_server_timer_wheel_init(&srv->timers_);
+    srv->is_draining_ = 0;
+    memset(&srv->stats_, 0, sizeof(srv->stats_));
+    http_server_timer_init(&srv->drain_timer_, NULL, NULL);
+    http_server_timer_init(&srv->accept_timer_, NULL, NULL);
+    SLIST_INIT(&srv->listeners);
     SLIST_INIT(&srv->clients);
     srv->handler_ = NULL;
     srv->response_ = NULL;
@@ -70,6 +133,29 @@ int http_server_init(http_server * srv)
 void http_server_free(http_server * srv)
 {
     Http_server_event_loop_free(srv);    
+    while (!SLIST_EMPTY(&srv->listeners))
+    {
+        http_server_listener * listener = SLIST_FIRST(&srv->listeners);
+        SLIST_REMOVE_HEAD(&srv->listeners, next);
+        free(listener->address);
+        free(listener);
+    }
+    while (!TAILQ_EMPTY(&srv->response_pool_))
+    {
+        http_server_response * res = TAILQ_FIRST(&srv->response_pool_);
+        TAILQ_REMOVE(&srv->response_pool_, res, responses_);
+        http_server_response_free(res);
+    }
+    srv->response_pool_len_ = 0;
+    http_server_prepared_response_free(srv->overload_response_);
+    srv->overload_response_ = NULL;
+    http_server_prepared_response_free(srv->rate_limited_response_);
+    srv->rate_limited_response_ = NULL;
+    Http_server_rate_table_free(&srv->rate_table_);
+    while (srv->buf_pool_len_ > 0)
+    {
+        free(srv->buf_pool_[--srv->buf_pool_len_]);
+    }
 }
 
 int http_server_setopt(http_server * srv, http_server_option opt, ...)
@@ -77,7 +163,152 @@ int http_server_setopt(http_server * srv, http_server_option opt, ...)
     int result = HTTP_SERVER_OK;
     va_list ap;
     va_start(ap, opt);
-    if (opt >= HTTP_SERVER_POINTER_POINT && opt < HTTP_SERVER_FUNCTION_POINT)
+    if (opt > HTTP_SERVER_LONG_POINT && opt < HTTP_SERVER_POINTER_POINT)
+    {
+        long value = va_arg(ap, long);
+        if (value < 0)
+        {
+            result = HTTP_SERVER_INVALID_PARAM;
+        }
+        else if (opt == HTTP_SERVER_OPT_BODY_HIGH_WATERMARK)
+        {
+            srv->body_high_watermark = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_BODY_LOW_WATERMARK)
+        {
+            srv->body_low_watermark = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_OUTPUT_HIGH_WATERMARK)
+        {
+            srv->output_high_watermark = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_OUTPUT_LOW_WATERMARK)
+        {
+            srv->output_low_watermark = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_HEADER_TIMEOUT)
+        {
+            srv->header_timeout = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_BODY_TIMEOUT)
+        {
+            srv->body_timeout = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_KEEPALIVE_TIMEOUT)
+        {
+            srv->keepalive_timeout = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_WRITE_TIMEOUT)
+        {
+            srv->write_timeout = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_MAX_PIPELINE)
+        {
+            srv->max_pipeline = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_MAX_KEEPALIVE_REQUESTS)
+        {
+            srv->max_keepalive_requests = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_RESPONSE_BUFFER_SIZE)
+        {
+            srv->response_buffer_size = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_RESPONSE_POOL_SIZE)
+        {
+            srv->response_pool_size = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_CORK)
+        {
+            srv->cork = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_PORT)
+        {
+            if (value > 65535)
+            {
+                result = HTTP_SERVER_INVALID_PARAM;
+            }
+            else
+            {
+                srv->port = value;
+            }
+        }
+        else if (opt == HTTP_SERVER_OPT_BACKLOG)
+        {
+            srv->backlog = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_REUSEPORT)
+        {
+            srv->reuseport = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_DEFER_ACCEPT)
+        {
+            srv->defer_accept = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_FASTOPEN)
+        {
+            srv->fastopen = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_NODELAY)
+        {
+            srv->nodelay = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_SNDBUF)
+        {
+            srv->sndbuf = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_RCVBUF)
+        {
+            srv->rcvbuf = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_ACCEPT_BUDGET)
+        {
+            srv->accept_budget = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_MAX_CONNECTIONS)
+        {
+            srv->max_connections = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_MAX_INFLIGHT)
+        {
+            srv->max_inflight = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_RETRY_AFTER)
+        {
+            srv->retry_after = value;
+            // Serialized again when needed
+            http_server_prepared_response_free(srv->overload_response_);
+            srv->overload_response_ = NULL;
+            http_server_prepared_response_free(srv->rate_limited_response_);
+            srv->rate_limited_response_ = NULL;
+        }
+        else if (opt == HTTP_SERVER_OPT_RATE_LIMIT)
+        {
+            srv->rate_limit = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_RATE_BURST)
+        {
+            srv->rate_burst = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_LOG_LEVEL && value <= HTTP_SERVER_LOG_TRACE)
+        {
+            srv->log_level = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_LOG_CATEGORIES)
+        {
+            srv->log_categories = value;
+        }
+        else if (opt == HTTP_SERVER_OPT_DATE_HEADER)
+        {
+            srv->date_header = value;
+            srv->common_headers_time_ = -1;
+        }
+        else
+        {
+            result = HTTP_SERVER_INVALID_PARAM;
+        }
+    }
+    else if (opt >= HTTP_SERVER_POINTER_POINT && opt < HTTP_SERVER_FUNCTION_POINT)
     {
         void * ptr = va_arg(ap, void*);
         if (opt == HTTP_SERVER_OPT_OPEN_SOCKET_DATA)
@@ -104,6 +335,19 @@ int http_server_setopt(http_server * srv, http_server_option opt, ...)
         {
             srv->debug_data = ptr;
         }
+        else if (opt == HTTP_SERVER_OPT_LOG_RING)
+        {
+            srv->log_ring = ptr;
+        }
+        else if (opt == HTTP_SERVER_OPT_BIND_ADDRESS)
+        {
+            srv->bind_address = ptr;
+        }
+        else if (opt == HTTP_SERVER_OPT_SERVER_NAME)
+        {
+            srv->server_name = ptr;
+            srv->common_headers_time_ = -1;
+        }
         else
         {
             result = HTTP_SERVER_INVALID_PARAM;
@@ -137,13 +381,153 @@ int http_server_setopt(http_server * srv, http_server_option opt, ...)
         result = HTTP_SERVER_INVALID_PARAM;
     }
     va_end(ap);
+    // Logging is off entirely when there is nowhere to send messages
+    srv->log_threshold_ = srv->debug_func || srv->log_ring ? srv->log_level : 0;
     return result;
 }
 
+/**
+ * Find listener that owns the socket
+ */
+static http_server_listener * http_server__find_listener(http_server * srv, http_server_socket_t sock)
+{
+    http_server_listener * listener;
+    SLIST_FOREACH(listener, &srv->listeners, next)
+    {
+        if (listener->sock == sock)
+        {
+            return listener;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Open listener socket and start polling on it
+ */
+static int http_server__start_listener(http_server * srv, http_server_listener * listener)
+{
+    if (listener->sock == HTTP_SERVER_INVALID_SOCKET)
+    {
+        listener->sock = Http_server_socket_open(srv, listener);
+    }
+    if (listener->sock == HTTP_SERVER_INVALID_SOCKET)
+    {
+        return HTTP_SERVER_SOCKET_ERROR;
+    }
+    if (srv->socket_func(srv->socket_data, listener->sock, HTTP_SERVER_POLL_IN, listener->data) != HTTP_SERVER_OK)
+    {
+        srv->closesocket_func(listener->sock, srv->closesocket_data);
+        listener->sock = HTTP_SERVER_INVALID_SOCKET;
+        return HTTP_SERVER_SOCKET_ERROR;
+    }
+    return HTTP_SERVER_OK;
+}
+
+/**
+ * Stop polling and close listener socket
+ */
+static int http_server__stop_listener(http_server * srv, http_server_listener * listener)
+{
+    if (listener->sock == HTTP_SERVER_INVALID_SOCKET)
+    {
+        return HTTP_SERVER_OK;
+    }
+    int r = HTTP_SERVER_OK;
+    if (srv->socket_func(srv->socket_data, listener->sock, HTTP_SERVER_POLL_REMOVE, listener->data) != HTTP_SERVER_OK)
+    {
+        r = HTTP_SERVER_SOCKET_ERROR;
+    }
+    if (srv->closesocket_func(listener->sock, srv->closesocket_data) != HTTP_SERVER_OK)
+    {
+        r = HTTP_SERVER_SOCKET_ERROR;
+    }
+    listener->sock = HTTP_SERVER_INVALID_SOCKET;
+    if (listener->family == HTTP_SERVER_LISTENER_UNIX && listener->address)
+    {
+        unlink(listener->address);
+    }
+    return r;
+}
+
+/**
+ * Append listener keeping the order listeners were added in
+ */
+static void http_server__append_listener(http_server * srv, http_server_listener * listener)
+{
+    if (SLIST_EMPTY(&srv->listeners))
+    {
+        SLIST_INSERT_HEAD(&srv->listeners, listener, next);
+    }
+    else
+    {
+        http_server_listener * last = SLIST_FIRST(&srv->listeners);
+        while (SLIST_NEXT(last, next))
+        {
+            last = SLIST_NEXT(last, next);
+        }
+        SLIST_INSERT_AFTER(last, listener, next);
+    }
+}
+
+int http_server_add_listener(http_server * srv, http_server_listener_family family, const char * address, long port, long accept_budget, long max_connections)
+{
+    assert(srv);
+    if (family != HTTP_SERVER_LISTENER_INET && family != HTTP_SERVER_LISTENER_INET6 && family != HTTP_SERVER_LISTENER_UNIX)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    if (family == HTTP_SERVER_LISTENER_UNIX ? !address : port < 0 || port > 65535)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    if (accept_budget < -1 || max_connections < 0)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    http_server_listener * listener = malloc(sizeof(http_server_listener));
+    if (!listener)
+    {
+        return HTTP_SERVER_NO_MEMORY;
+    }
+    listener->family = family;
+    listener->address = NULL;
+    if (address && !(listener->address = strdup(address)))
+    {
+        free(listener);
+        return HTTP_SERVER_NO_MEMORY;
+    }
+    listener->port = port;
+    listener->accept_budget = accept_budget;
+    listener->max_connections = max_connections;
+    listener->connections_ = 0;
+    listener->sock = HTTP_SERVER_INVALID_SOCKET;
+    listener->data = NULL;
+    http_server__append_listener(srv, listener);
+    return HTTP_SERVER_OK;
+}
+
 int http_server_start(http_server * srv)
 {
     assert(srv);
     assert(srv->sock_listen);
+    if (!SLIST_EMPTY(&srv->listeners))
+    {
+        http_server_listener * listener;
+        SLIST_FOREACH(listener, &srv->listeners, next)
+        {
+            if (http_server__start_listener(srv, listener) != HTTP_SERVER_OK)
+            {
+                // Start all listeners or none of them
+                (void)http_server_cancel(srv);
+                return HTTP_SERVER_SOCKET_ERROR;
+            }
+        }
+        listener = SLIST_FIRST(&srv->listeners);
+        srv->sock_listen = listener->sock;
+        srv->sock_listen_data = listener->data;
+        return HTTP_SERVER_OK;
+    }
     // Create listening socket
     srv->sock_listen = srv->opensocket_func(srv->opensocket_data);
     if (srv->sock_listen == HTTP_SERVER_INVALID_SOCKET)
@@ -158,6 +542,21 @@ int http_server_start(http_server * srv)
 int http_server_cancel(http_server * srv)
 {
     assert(srv);
+    Http_server_timer_wheel_remove(&srv->timers_, &srv->accept_timer_);
+    if (!SLIST_EMPTY(&srv->listeners))
+    {
+        int r = HTTP_SERVER_OK;
+        http_server_listener * listener;
+        SLIST_FOREACH(listener, &srv->listeners, next)
+        {
+            if (http_server__stop_listener(srv, listener) != HTTP_SERVER_OK)
+            {
+                r = HTTP_SERVER_SOCKET_ERROR;
+            }
+        }
+        srv->sock_listen = HTTP_SERVER_INVALID_SOCKET;
+        return r;
+    }
     if (srv->sock_listen == HTTP_SERVER_INVALID_SOCKET)
     {
         return HTTP_SERVER_INVALID_PARAM;
@@ -172,6 +571,7 @@ int http_server_cancel(http_server * srv)
     {
         return HTTP_SERVER_SOCKET_ERROR;
     }
+    srv->sock_listen = HTTP_SERVER_INVALID_SOCKET;
     return HTTP_SERVER_OK;
 }
 
@@ -183,9 +583,17 @@ int http_server_run(http_server * srv)
 int http_server_assign(http_server * srv, http_server_socket_t sock, void * data)
 {
     int r = HTTP_SERVER_OK;
+    http_server_listener * listener = http_server__find_listener(srv, sock);
+    if (listener)
+    {
+        listener->data = data;
+    }
     if (sock == srv->sock_listen)
     {
         srv->sock_listen_data = data;
+    }
+    if (listener || sock == srv->sock_listen)
+    {
         return r;
     }
     // Check if client exists on the list
@@ -204,10 +612,187 @@ int http_server_assign(http_server * srv, http_server_socket_t sock, void * data
     return r;
 }
 
+/**
+ * Client is not managed by the server anymore
+ */
+static void http_server__forget_client(http_server * srv, http_server_client * client)
+{
+    srv->connections_--;
+    srv->stats_.connections_closed++;
+    if (client->listener_)
+    {
+        client->listener_->connections_--;
+    }
+    if (srv->is_draining_ && SLIST_EMPTY(&srv->clients))
+    {
+        // Drained. Let the event loop finish.
+        Http_server_timer_wheel_remove(&srv->timers_, &srv->drain_timer_);
+    }
+}
+
+/**
+ * Stop polling, close the socket and free the client
+ */
+static int http_server__close_client(http_server * srv, http_server_client * client)
+{
+    int r = HTTP_SERVER_OK;
+    HTTP_SERVER_PROBE1(close, client->sock);
+    if (http_server_poll_client(client, HTTP_SERVER_POLL_REMOVE) != HTTP_SERVER_OK)
+    {
+        r = HTTP_SERVER_SOCKET_ERROR;
+    }
+    if (srv->closesocket_func(client->sock, srv->closesocket_data) != HTTP_SERVER_OK)
+    {
+        r = HTTP_SERVER_SOCKET_ERROR;
+    }
+    SLIST_REMOVE(&srv->clients, client, http_server_client, next);
+    http_server__forget_client(srv, client);
+    http_server_client_free(client);
+    return r;
+}
+
+int http_server_send_listeners(http_server * srv, http_server_socket_t channel)
+{
+    assert(srv);
+    http_server_socket_t fds[HTTP_SERVER_SOCKET_MAX_FDS];
+    int count = 0;
+    http_server_listener * listener;
+    SLIST_FOREACH(listener, &srv->listeners, next)
+    {
+        if (listener->sock != HTTP_SERVER_INVALID_SOCKET && count < HTTP_SERVER_SOCKET_MAX_FDS)
+        {
+            fds[count++] = listener->sock;
+        }
+    }
+    if (SLIST_EMPTY(&srv->listeners) && srv->sock_listen != HTTP_SERVER_INVALID_SOCKET)
+    {
+        fds[count++] = srv->sock_listen;
+    }
+    if (count == 0)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    int r = Http_server_socket_send_fds(channel, fds, count);
+    if (r != HTTP_SERVER_OK)
+    {
+        return r;
+    }
+    SLIST_FOREACH(listener, &srv->listeners, next)
+    {
+        if (listener->family == HTTP_SERVER_LISTENER_UNIX)
+        {
+            // Socket file belongs to the successor now
+            free(listener->address);
+            listener->address = NULL;
+        }
+    }
+    return HTTP_SERVER_OK;
+}
+
+int http_server_receive_listeners(http_server * srv, http_server_socket_t channel)
+{
+    assert(srv);
+    http_server_socket_t fds[HTTP_SERVER_SOCKET_MAX_FDS];
+    int count = Http_server_socket_recv_fds(channel, fds, HTTP_SERVER_SOCKET_MAX_FDS);
+    if (count < 0)
+    {
+        return HTTP_SERVER_SOCKET_ERROR;
+    }
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        http_server_listener * listener = malloc(sizeof(http_server_listener));
+        if (!listener || Http_server_socket_listener_family(fds[i], &listener->family, &listener->port) != HTTP_SERVER_OK)
+        {
+            int r = listener ? HTTP_SERVER_SOCKET_ERROR : HTTP_SERVER_NO_MEMORY;
+            free(listener);
+            for (; i < count; ++i)
+            {
+                close(fds[i]);
+            }
+            return r;
+        }
+        // Socket is bound already so there is no address to bind or
+        // socket file to remove
+        listener->address = NULL;
+        listener->accept_budget = -1;
+        listener->max_connections = 0;
+        listener->connections_ = 0;
+        listener->sock = fds[i];
+        listener->data = NULL;
+        http_server__append_listener(srv, listener);
+    }
+    return HTTP_SERVER_OK;
+}
+
+static int http_server__drain_timeout(http_server * srv, http_server_timer * timer, void * data)
+{
+    (void)timer;
+    (void)data;
+    HTTP_SERVER_LOG(srv, INFO, SERVER, "drain timed out");
+    int r = HTTP_SERVER_OK;
+    while (!SLIST_EMPTY(&srv->clients))
+    {
+        if (http_server__close_client(srv, SLIST_FIRST(&srv->clients)) != HTTP_SERVER_OK)
+        {
+            r = HTTP_SERVER_SOCKET_ERROR;
+        }
+    }
+    return r;
+}
+
+int http_server_drain(http_server * srv, long timeout)
+{
+    assert(srv);
+    if (timeout < 0)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    // Stop accepting. Server might not be listening at all.
+    (void)http_server_cancel(srv);
+    srv->is_draining_ = 1;
+    http_server_client * it, * it_temp;
+    SLIST_FOREACH_SAFE(it, &srv->clients, next, it_temp)
+    {
+        if (it->in_request_)
+        {
+            // Request being read becomes the last one
+            continue;
+        }
+        if (TAILQ_EMPTY(&it->responses_) && TAILQ_EMPTY(&it->buffer) && it->pipeline_len_ == 0)
+        {
+            HTTP_SERVER_LOG(srv, DEBUG, SERVER, "closing idle client %d", it->sock);
+            (void)http_server__close_client(srv, it);
+            continue;
+        }
+        // Answer requests read so far and close
+        if (!it->close_after_ || it->close_after_ > it->requests_)
+        {
+            it->close_after_ = it->requests_;
+        }
+        it->is_closing_ = 1;
+    }
+    if (timeout > 0 && !SLIST_EMPTY(&srv->clients))
+    {
+        http_server_timer_init(&srv->drain_timer_, &http_server__drain_timeout, NULL);
+        return http_server_timer_start(srv, &srv->drain_timer_, timeout, 0);
+    }
+    return HTTP_SERVER_OK;
+}
+
+static int http_server__client_timeout(http_server * srv, http_server_timer * timer, void * data)
+{
+    (void)timer;
+    http_server_client * client = data;
+    HTTP_SERVER_LOG(srv, DEBUG, CLIENT, "client %d timed out (%c)", client->sock, client->timeout_phase_);
+    srv->stats_.timeouts++;
+    return http_server__close_client(srv, client);
+}
+
 int http_server_add_client(http_server * srv, http_server_socket_t sock)
 {
     assert(srv);
-    if (sock == srv->sock_listen)
+    if (sock == srv->sock_listen || http_server__find_listener(srv, sock))
     {
         return HTTP_SERVER_SOCKET_EXISTS;
     }
@@ -223,6 +808,10 @@ int http_server_add_client(http_server * srv, http_server_socket_t sock)
     }
     it = http_server_new_client(srv, sock, srv->handler_);
     SLIST_INSERT_HEAD(&srv->clients, it, next);
+    srv->connections_++;
+    // Client has limited time to send its first request
+    http_server_timer_init(&it->timeout_timer_, &http_server__client_timeout, it);
+    Http_server_client_update_timeout(it, 1);
     // Start polling for read
     int r = srv->socket_func(srv->socket_data, it->sock, HTTP_SERVER_POLL_IN, it->data);
     return r;
@@ -239,6 +828,7 @@ int http_server_pop_client(http_server * srv, http_server_socket_t sock)
         if (it->sock == sock)
         {
             SLIST_REMOVE(&srv->clients, it, http_server_client, next);
+            http_server__forget_client(srv, it);
             http_server_client_free(it);
             r = HTTP_SERVER_OK;
             break;
@@ -247,37 +837,164 @@ int http_server_pop_client(http_server * srv, http_server_socket_t sock)
     return r;
 }
 
-int http_server_socket_action(http_server * srv, http_server_socket_t socket, int flags)
+/**
+ * Write 503 or 429 response to a connection over the limit and close it.
+ * Nothing else is sent so this is best effort.
+ */
+static void http_server__reject(http_server * srv, http_server_socket_t fd, int status_code)
 {
-    assert(srv);
-    if (socket == srv->sock_listen)
+    http_server_prepared_response * prepared = http_server__limit_response(srv, status_code);
+    if (prepared)
+    {
+        static char connection[] = "Connection: close\r\n";
+        struct iovec iov[3];
+        iov[0].iov_base = prepared->data;
+        iov[0].iov_len = prepared->head_len;
+        iov[1].iov_base = connection;
+        iov[1].iov_len = sizeof(connection) - 1;
+        iov[2].iov_base = prepared->data + prepared->head_len;
+        iov[2].iov_len = prepared->size - prepared->head_len;
+        (void)writev(fd, iov, 3);
+    }
+    HTTP_SERVER_LOG(srv, DEBUG, SERVER, "rejected client %d with %d", fd, status_code);
+    HTTP_SERVER_PROBE2(reject, fd, status_code);
+    srv->stats_.connections_rejected++;
+    // Closing with unread request bytes would reset the connection and
+    // the client could lose the response. Send FIN first and read what
+    // already arrived, a bounded amount since the socket is nonblocking.
+    (void)shutdown(fd, SHUT_WR);
+    char discard[1024];
+    int reads = 0;
+    while (reads++ < 16 && recv(fd, discard, sizeof(discard), 0) > 0)
+    {
+        // Request is not processed
+    }
+    (void)srv->closesocket_func(fd, srv->closesocket_data);
+}
+
+/**
+ * Poll listeners paused by `http_server__accept` again
+ */
+static int http_server__accept_resume(http_server * srv, http_server_timer * timer, void * data)
+{
+    (void)timer;
+    (void)data;
+    if (SLIST_EMPTY(&srv->listeners))
     {
-        // Listening socket is a special kind of socket to be managed
-        struct sockaddr_in cli_addr;
-        socklen_t clilen = sizeof(cli_addr);
-        // accept
-        http_server__debug(srv, 1, "new conn");
-        int fd = accept(srv->sock_listen, (struct sockaddr *) &cli_addr, &clilen);
-        if (fd == -1)
+        if (srv->sock_listen == HTTP_SERVER_INVALID_SOCKET)
         {
-            perror("accept");
-            return HTTP_SERVER_SOCKET_ERROR;
+            return HTTP_SERVER_OK;
+        }
+        return srv->socket_func(srv->socket_data, srv->sock_listen, HTTP_SERVER_POLL_IN, srv->sock_listen_data);
+    }
+    int r = HTTP_SERVER_OK;
+    http_server_listener * listener;
+    SLIST_FOREACH(listener, &srv->listeners, next)
+    {
+        if (listener->sock != HTTP_SERVER_INVALID_SOCKET
+            && srv->socket_func(srv->socket_data, listener->sock, HTTP_SERVER_POLL_IN, listener->data) != HTTP_SERVER_OK)
+        {
+            r = HTTP_SERVER_SOCKET_ERROR;
+        }
+    }
+    return r;
+}
+
+/**
+ * Accept pending connections on the listener up to its budget so a burst
+ * of connections does not need a wakeup for each one
+ */
+static int http_server__accept(http_server * srv, http_server_socket_t sock, http_server_listener * listener)
+{
+    long budget = listener && listener->accept_budget >= 0 ? listener->accept_budget : srv->accept_budget;
+    long accepted = 0;
+    int is_paused = 0;
+    while (budget == 0 || accepted < budget)
+    {
+        unsigned char addr[16];
+        int has_addr = 0;
+        http_server_socket_t fd = Http_server_socket_accept(sock, addr, &has_addr);
+        if (fd == HTTP_SERVER_INVALID_SOCKET)
+        {
+            int e = errno;
+            if (e == EINTR || e == ECONNABORTED)
+            {
+                continue;
+            }
+            if (e != EAGAIN && e != EWOULDBLOCK)
+            {
+                HTTP_SERVER_LOG(srv, WARNING, SOCKET, "accept: %s", strerror(e));
+            }
+            is_paused = e == EMFILE || e == ENFILE || e == ENOBUFS || e == ENOMEM;
+            break;
+        }
+        accepted++;
+        HTTP_SERVER_PROBE2(accept, fd, sock);
+        if ((srv->max_connections > 0 && srv->connections_ >= srv->max_connections)
+            || (listener && listener->max_connections > 0 && listener->connections_ >= listener->max_connections))
+        {
+            http_server__reject(srv, fd, HTTP_503_SERVICE_UNAVAILABLE);
+            continue;
+        }
+        if (has_addr && !Http_server_rate_take(&srv->rate_table_, addr, srv->rate_limit, srv->rate_burst, Http_server_timer_now()))
+        {
+            http_server__reject(srv, fd, HTTP_429_TOO_MANY_REQUESTS);
+            continue;
+        }
+        if (Http_server_socket_setup_client(srv, listener, fd) != HTTP_SERVER_OK)
+        {
+            HTTP_SERVER_LOG(srv, WARNING, SOCKET, "unable to set up client socket %d", fd);
         }
         // Add this socket to managed list
         if (http_server_add_client(srv, fd) != HTTP_SERVER_OK)
         {
             // If we can't manage this socket then disconnect it.
-            close(fd);
-            return HTTP_SERVER_SOCKET_ERROR;
+            (void)srv->closesocket_func(fd, srv->closesocket_data);
+            continue;
         }
-        if (srv->socket_func(srv->socket_data, srv->sock_listen, HTTP_SERVER_POLL_IN, srv->sock_listen_data) != HTTP_SERVER_OK)
+        // New client is the head of the list
+        http_server_client * client = SLIST_FIRST(&srv->clients);
+        memcpy(client->addr_, addr, sizeof(addr));
+        client->has_addr_ = has_addr;
+        client->is_charged_ = has_addr;
+        if (listener)
         {
-            (void)http_server_pop_client(srv, fd);
-            close(fd);
-            return HTTP_SERVER_SOCKET_ERROR;
+            client->listener_ = listener;
+            listener->connections_++;
         }
-        http_server__debug(srv, 1, "new client: %d", fd);
-        return HTTP_SERVER_OK;
+        srv->stats_.connections_accepted++;
+        HTTP_SERVER_LOG(srv, DEBUG, SERVER, "new client: %d", fd);
+    }
+    HTTP_SERVER_TRACE(srv, SERVER, "accepted %ld connections on %d", accepted, sock);
+    HTTP_SERVER_PROBE2(accept_batch, sock, accepted);
+    if (is_paused)
+    {
+        // Pending connection stays queued and the listener stays readable.
+        // Stop polling it for a while instead of waking up for it again
+        // right away.
+        if (srv->accept_timer_.is_active_)
+        {
+            // Resumed along with the listener that paused first
+            return HTTP_SERVER_OK;
+        }
+        http_server_timer_init(&srv->accept_timer_, &http_server__accept_resume, NULL);
+        return http_server_timer_start(srv, &srv->accept_timer_, HTTP_SERVER_ACCEPT_RETRY, 0);
+    }
+    if (srv->socket_func(srv->socket_data, sock, HTTP_SERVER_POLL_IN, listener ? listener->data : srv->sock_listen_data) != HTTP_SERVER_OK)
+    {
+        return HTTP_SERVER_SOCKET_ERROR;
+    }
+    return HTTP_SERVER_OK;
+}
+
+int http_server_socket_action(http_server * srv, http_server_socket_t socket, int flags)
+{
+    assert(srv);
+    http_server_listener * listener = http_server__find_listener(srv, socket);
+    if (listener || socket == srv->sock_listen)
+    {
+        // Listening socket is a special kind of socket to be managed.
+        return http_server__accept(srv, socket, listener);
     }
     int r = HTTP_SERVER_OK;
     http_server_client * it, * it_temp, * client = NULL;
@@ -319,58 +1036,78 @@ int http_server_socket_action(http_server * srv, http_server_socket_t socket, in
         // Read data
         char tmp[16384];
         int bytes_received = read(client->sock, tmp, sizeof(tmp));
-        if (bytes_received == -1)
+        if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            HTTP_SERVER_PROBE1(read_again, client->sock);
+            // Nothing to read after all
+            if (http_server_poll_client(client, HTTP_SERVER_POLL_IN) != HTTP_SERVER_OK)
+            {
+                return HTTP_SERVER_SOCKET_ERROR;
+            }
+        }
+        else if (bytes_received == -1)
         {
             r = HTTP_SERVER_SOCKET_ERROR;
         }
         else if (bytes_received == 0)
         {
-            http_server__debug(srv, 1, "client eof %d", client->sock);
+            HTTP_SERVER_LOG(srv, DEBUG, CLIENT, "client eof %d", client->sock);
             if (http_server_perform_client(client, tmp, bytes_received) != HTTP_SERVER_OK)
             {
+                (void)http_server__close_client(srv, client);
                 return HTTP_SERVER_SOCKET_ERROR;
             }
-            if (http_server_poll_client(it, HTTP_SERVER_POLL_REMOVE) != HTTP_SERVER_OK)
+            if (!TAILQ_EMPTY(&client->responses_) || client->pipeline_len_ > 0)
             {
-                return HTTP_SERVER_SOCKET_ERROR;
+                // Client is done sending requests but still waits for
+                // responses. Close after the last one is sent.
+                HTTP_SERVER_LOG(srv, DEBUG, CLIENT, "client %d half-closed", client->sock);
+                if (!client->close_after_ || client->close_after_ > client->requests_)
+                {
+                    client->close_after_ = client->requests_;
+                }
+                client->is_closing_ = 1;
+                return HTTP_SERVER_OK;
             }
-            if (srv->closesocket_func(it->sock, srv->closesocket_data) != HTTP_SERVER_OK)
+            // Remove client from the list and tell the caller that it should not
+            // do any operation with current socket.
+            if (http_server__close_client(srv, client) != HTTP_SERVER_OK)
             {
                 return HTTP_SERVER_SOCKET_ERROR;
             }
-            // Remove client from the list and tell the caller that it should not
-            // do any operation with current socket.
-            SLIST_REMOVE(&srv->clients, it, http_server_client, next);
-            free(it);
             return HTTP_SERVER_CLIENT_EOF;
         }
         else
         {
-            http_server__debug(srv, 1, "received %d bytes from %d", bytes_received, client->sock);
+            HTTP_SERVER_TRACE(srv, SOCKET, "received %d bytes from %d", bytes_received, client->sock);
+            HTTP_SERVER_PROBE2(read, client->sock, bytes_received);
+            srv->stats_.bytes_in += bytes_received;
             if (http_server_perform_client(client, tmp, bytes_received) != HTTP_SERVER_OK)
             {
+                srv->stats_.parser_errors++;
                 // TODO: close connection for now but this should be something like 400 BAD REQUEST.
-                if (http_server_poll_client(it, HTTP_SERVER_POLL_REMOVE) != HTTP_SERVER_OK)
-                {
-                    return HTTP_SERVER_SOCKET_ERROR;
-                }
-                if (srv->closesocket_func(it->sock, srv->closesocket_data) != HTTP_SERVER_OK)
+                if (http_server__close_client(srv, client) != HTTP_SERVER_OK)
                 {
                     return HTTP_SERVER_SOCKET_ERROR;
                 }
                 return r;
             }
-            http_server__debug(srv, 1, "is_complete: %d", it->is_complete);
-            if (!it->is_paused_ && !it->is_complete && http_server_poll_client(it, HTTP_SERVER_POLL_IN) != HTTP_SERVER_OK)
+            HTTP_SERVER_TRACE(srv, CLIENT, "is_complete: %d", it->is_complete);
+            if (it->is_throttled_)
+            {
+                HTTP_SERVER_LOG(srv, DEBUG, CLIENT, "client %d throttled with %ld bytes of body pending", it->sock, it->body_pending_);
+            }
+            // Keep reading pipelined requests while there is room for
+            // their responses
+            if (Http_server_client_can_read(it) && http_server_poll_client(it, HTTP_SERVER_POLL_IN) != HTTP_SERVER_OK)
             {
-                http_server__debug(srv, 1, "unable to poll in - request incomplete");
+                HTTP_SERVER_LOG(srv, WARNING, EVENT, "unable to poll in for more requests");
                 return HTTP_SERVER_SOCKET_ERROR;
             }
         }
     }
-    if (flags & HTTP_SERVER_POLL_OUT)
+    if (flags & HTTP_SERVER_POLL_OUT && !TAILQ_EMPTY(&client->buffer))
     {
-        assert(!TAILQ_EMPTY(&it->buffer));
         // Use scatter-gather I/O to deliver multiple chunks of data
         static const int maxiov =
 #if defined(MAXIOV)
@@ -395,26 +1132,55 @@ int http_server_socket_action(http_server * srv, http_server_socket_t socket, in
             wvec[iocnt].iov_len = buf->size;
             iocnt++;
         }
-        ssize_t bytes_transferred = writev(client->sock, wvec, iocnt);
-        if (bytes_transferred == -1)
+        ssize_t bytes_transferred;
+#if defined(MSG_MORE)
+        if (srv->cork && buf)
         {
-            // Unable to send data?
-            int e = errno;
-            http_server__debug(srv, 1, "unable to write: %s", strerror(e));
-            if (http_server_poll_client(it, HTTP_SERVER_POLL_REMOVE) != HTTP_SERVER_OK)
-            {
-                return HTTP_SERVER_SOCKET_ERROR;
-            }
-            if (srv->closesocket_func(it->sock, srv->closesocket_data) != HTTP_SERVER_OK)
+            // Queue did not fit in one call and the rest is written right
+            // after it, so let the kernel wait for a full segment. Output
+            // that is flushed completely is pushed out even in the middle
+            // of a response so streamed chunks are not held back.
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = wvec;
+            msg.msg_iovlen = iocnt;
+            bytes_transferred = sendmsg(client->sock, &msg, MSG_MORE);
+        }
+        else
+#endif
+        {
+            bytes_transferred = writev(client->sock, wvec, iocnt);
+        }
+        if (bytes_transferred == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            // Socket buffer is full. Try again when it drains.
+            HTTP_SERVER_PROBE2(write_again, client->sock, client->buffer_size_);
+            if (http_server_poll_client(client, HTTP_SERVER_POLL_OUT) != HTTP_SERVER_OK)
             {
                 return HTTP_SERVER_SOCKET_ERROR;
             }
-            //perror("write");
-            // int e = errno;
-            // fprintf(stderr, "Unable to write data to client %d: %d", e, bytes_transferred);
+            return r;
+        }
+        if (bytes_transferred == -1)
+        {
+            // Unable to send data?
+            int e = errno;
+            HTTP_SERVER_LOG(srv, DEBUG, SOCKET, "unable to write: %s", strerror(e));
+            (void)http_server__close_client(srv, client);
             return HTTP_SERVER_SOCKET_ERROR;
         }
-        http_server__debug(srv, 1, "Client %d: written %d bytes", client->sock, (int)bytes_transferred);
+        HTTP_SERVER_TRACE(srv, SOCKET, "Client %d: written %d bytes", client->sock, (int)bytes_transferred);
+        client->buffer_size_ -= bytes_transferred;
+        srv->stats_.bytes_out += bytes_transferred;
+        HTTP_SERVER_PROBE4(writev, client->sock, iocnt, bytes_transferred, client->buffer_size_);
+        // Output at the front of the buffer belongs to the first response
+        if (bytes_transferred > 0 && !TAILQ_EMPTY(&client->responses_)
+            && !TAILQ_FIRST(&client->responses_)->trace_.first_byte_written)
+        {
+            TAILQ_FIRST(&client->responses_)->trace_.first_byte_written = Http_server_client_trace_time(client);
+        }
+        // Client made progress so write-stall timeout starts again
+        Http_server_client_update_timeout(client, bytes_transferred > 0);
         // Pop buffers from response
         iocnt = 0;
         buf = NULL;
@@ -428,9 +1194,8 @@ int http_server_socket_action(http_server * srv, http_server_socket_t socket, in
             if (bytes_transferred >= buf->size)
             {
                 TAILQ_REMOVE(&client->buffer, buf, bufs);
-                free(buf->mem);
                 bytes_transferred -= buf->size;
-                free(buf);
+                http_server__buf_free(srv, buf);
             }
             iocnt++;
         }
@@ -438,11 +1203,11 @@ int http_server_socket_action(http_server * srv, http_server_socket_t socket, in
         if (bytes_transferred > 0 && !TAILQ_EMPTY(&client->buffer))
         {
             // This is probably buggy
-            http_server__debug(srv, 1, "truncate first buffer");
+            HTTP_SERVER_TRACE(srv, SOCKET, "truncate first buffer");
             buf = TAILQ_FIRST(&client->buffer);
             if (bytes_transferred > buf->size)
             {
-                http_server__debug(srv, 1, "there is too much to truncate: %d > %d", (int)bytes_transferred, buf->size);
+                HTTP_SERVER_LOG(srv, ERROR, SOCKET, "there is too much to truncate: %d > %d", (int)bytes_transferred, buf->size);
                 return HTTP_SERVER_OK;
             }
             // Truncate first buffer
@@ -458,39 +1223,108 @@ int http_server_socket_action(http_server * srv, http_server_socket_t socket, in
         {
             return HTTP_SERVER_SOCKET_ERROR;
         }
-        // If user finishes the response with `http_server_response_end` then
-        // it is clear when to proceed to the next response.
-        http_server_response * res = client->current_response_;
-        if (!client->is_paused_ && res && res->is_done)
-        {
-            // All response data is sent now. No need to hold this memory,
-            // and allow next requests inside the same connection to create
-            // new responses.
-            http_server_response_free(res);
-            client->current_response_ = NULL;
-            // All response is sent. Poll again for new request
-            if (http_server_poll_client(client, HTTP_SERVER_POLL_IN) != HTTP_SERVER_OK)
+        // Let the handler continue writing after queue drained
+        if (client->wants_writable_ && client->buffer_size_ <= srv->output_low_watermark)
+        {
+            client->wants_writable_ = 0;
+            if (client->handler && client->handler->on_writable)
             {
-                http_server__debug(srv, 1, "unable to poll in for next request on client %d", client->sock);
-                return HTTP_SERVER_SOCKET_ERROR;
+                (void)client->handler->on_writable(client, client->handler->on_writable_data);
+            }
+        }
+    }
+    // If user finishes the response with `http_server_response_end` then
+    // it is clear when to proceed to the next response.
+    if (flags & HTTP_SERVER_POLL_OUT && TAILQ_EMPTY(&client->buffer))
+    {
+        // All data of finished responses is sent now. No need to hold
+        // this memory. Finishing a response also moves output of the
+        // next pipelined responses to the buffer, so the loop stops at
+        // the first unfinished one.
+        unsigned long long written_time = 0;
+        while (!TAILQ_EMPTY(&client->responses_) && TAILQ_FIRST(&client->responses_)->is_done)
+        {
+            long request_no = TAILQ_FIRST(&client->responses_)->request_no_;
+            unsigned long long start_time = TAILQ_FIRST(&client->responses_)->start_time_;
+            HTTP_SERVER_PROBE3(response_sent, client->sock, request_no, start_time ? Http_server_timer_now_us() - start_time : 0);
+            srv->stats_.responses++;
+            Http_server_histogram_record_since(&srv->stats_.response, start_time);
+            if (client->handler && client->handler->on_request_trace)
+            {
+                http_server_request_trace * trace = &TAILQ_FIRST(&client->responses_)->trace_;
+                if (!written_time)
+                {
+                    written_time = Http_server_timer_now_us();
+                }
+                if (!trace->first_byte_written)
+                {
+                    // Sent together with the previous response
+                    trace->first_byte_written = written_time;
+                }
+                trace->last_byte_written = written_time;
+                (void)client->handler->on_request_trace(client, client->handler->on_request_trace_data, trace);
+            }
+            http_server__response_recycle(srv, TAILQ_FIRST(&client->responses_));
+            if (client->pipeline_len_ > 0)
+            {
+                client->pipeline_len_--;
+                srv->inflight_--;
             }
+            if (client->close_after_ > 0 && request_no >= client->close_after_)
+            {
+                // This was the last response on this connection
+                HTTP_SERVER_LOG(srv, DEBUG, CLIENT, "closing client %d after request %ld", client->sock, request_no);
+                if (http_server__close_client(srv, client) != HTTP_SERVER_OK)
+                {
+                    return HTTP_SERVER_SOCKET_ERROR;
+                }
+                return HTTP_SERVER_CLIENT_EOF;
+            }
+        }
+        if (!TAILQ_EMPTY(&client->buffer))
+        {
+            // Output of the following responses is ready as well
+            return http_server_poll_client(client, HTTP_SERVER_POLL_OUT);
+        }
+        if (TAILQ_EMPTY(&client->responses_))
+        {
+            if (client->is_closing_ && client->pipeline_len_ == 0)
+            {
+                HTTP_SERVER_TRACE(srv, CLIENT, "all responses sent to client %d", client->sock);
+                if (http_server__close_client(srv, client) != HTTP_SERVER_OK)
+                {
+                    return HTTP_SERVER_SOCKET_ERROR;
+                }
+                return HTTP_SERVER_CLIENT_EOF;
+            }
+            if (client->request_state_ == 'C')
+            {
+                client->request_state_ = 'I';
+            }
+            Http_server_client_update_timeout(client, 0);
+        }
+        // Poll again for new requests
+        if (Http_server_client_can_read(client) && http_server_poll_client(client, HTTP_SERVER_POLL_IN) != HTTP_SERVER_OK)
+        {
+            HTTP_SERVER_LOG(srv, WARNING, EVENT, "unable to poll in for next request on client %d", client->sock);
+            return HTTP_SERVER_SOCKET_ERROR;
         }
     }
     return r;
 }
 
-int http_server__debug(http_server * srv, int kind, char * format, ...)
+http_server_prepared_response * http_server__limit_response(http_server * srv, int status_code)
 {
-    if (!srv->debug_func)
+    http_server_prepared_response ** prepared = status_code == HTTP_429_TOO_MANY_REQUESTS
+        ? &srv->rate_limited_response_
+        : &srv->overload_response_;
+    if (!*prepared)
     {
-        return HTTP_SERVER_OK;
+        char headers[64];
+        int headers_len = snprintf(headers, sizeof(headers), "Retry-After: %ld\r\n", srv->retry_after);
+        char body[64];
+        int body_len = snprintf(body, sizeof(body), "%s\n", status_code == HTTP_429_TOO_MANY_REQUESTS ? "Too Many Requests" : "Service Unavailable");
+        *prepared = http_server_prepared_response_new(status_code, headers, headers_len, body, body_len);
     }
-    va_list args;
-    va_start(args, format);
-    char * buffer = NULL;
-    size_t length = vasprintf(&buffer, format, args);
-    int result = srv->debug_func(kind, buffer, length, srv->debug_data);
-    free(buffer);
-    va_end(args);
-    return result;
+    return *prepared;
 }
@@ -0,0 +1,376 @@
+#if !defined(_GNU_SOURCE)
+// accept4(2)
+#define _GNU_SOURCE
+#endif
+#include "http-server/http-server.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "socket.h"
+#include "log.h"
+#include "build_config.h"
+
+static int http_server__setsockopt(http_server * srv, http_server_socket_t sock, int level, int name, int value, const char * what)
+{
+    if (setsockopt(sock, level, name, &value, sizeof(value)) == -1)
+    {
+        HTTP_SERVER_LOG(srv, WARNING, SOCKET, "setsockopt(%s): %s", what, strerror(errno));
+        return HTTP_SERVER_SOCKET_ERROR;
+    }
+    return HTTP_SERVER_OK;
+}
+
+/**
+ * Fill bind address of the listener
+ * @return Address length or 0 if address is invalid
+ */
+static socklen_t http_server__listener_addr(http_server_listener * listener, struct sockaddr_storage * ss)
+{
+    memset(ss, 0, sizeof(*ss));
+    if (listener->family == HTTP_SERVER_LISTENER_INET)
+    {
+        struct sockaddr_in * sin = (struct sockaddr_in *)ss;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(listener->port);
+        sin->sin_addr.s_addr = INADDR_ANY;
+        if (listener->address && inet_pton(AF_INET, listener->address, &sin->sin_addr) != 1)
+        {
+            return 0;
+        }
+        return sizeof(*sin);
+    }
+    if (listener->family == HTTP_SERVER_LISTENER_INET6)
+    {
+        struct sockaddr_in6 * sin6 = (struct sockaddr_in6 *)ss;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(listener->port);
+        sin6->sin6_addr = in6addr_any;
+        if (listener->address && inet_pton(AF_INET6, listener->address, &sin6->sin6_addr) != 1)
+        {
+            return 0;
+        }
+        return sizeof(*sin6);
+    }
+    struct sockaddr_un * sun = (struct sockaddr_un *)ss;
+    if (!listener->address || strlen(listener->address) >= sizeof(sun->sun_path))
+    {
+        return 0;
+    }
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, listener->address);
+    return sizeof(*sun);
+}
+
+/**
+ * Dual-stack IPv6 socket would take the port of an IPv4 listener
+ */
+static int http_server__listener_v6only(http_server * srv, http_server_listener * listener)
+{
+    http_server_listener * it;
+    SLIST_FOREACH(it, &srv->listeners, next)
+    {
+        if (it->family == HTTP_SERVER_LISTENER_INET && it->port == listener->port)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+http_server_socket_t Http_server_socket_open(http_server * srv, http_server_listener * listener)
+{
+    struct sockaddr_storage ss;
+    socklen_t ss_len = http_server__listener_addr(listener, &ss);
+    if (ss_len == 0)
+    {
+        HTTP_SERVER_LOG(srv, ERROR, SOCKET, "invalid listener address: %s", listener->address ? listener->address : "(null)");
+        return HTTP_SERVER_INVALID_SOCKET;
+    }
+    http_server_socket_t s = socket(ss.ss_family, SOCK_STREAM, 0);
+    HTTP_SERVER_LOG(srv, DEBUG, SOCKET, "open socket: %d", s);
+    if (s == -1)
+    {
+        return HTTP_SERVER_INVALID_SOCKET;
+    }
+    int r = HTTP_SERVER_OK;
+    if (listener->family == HTTP_SERVER_LISTENER_UNIX)
+    {
+        // Remove socket file left by previous instance
+        struct stat st;
+        if (stat(listener->address, &st) == 0 && S_ISSOCK(st.st_mode))
+        {
+            unlink(listener->address);
+        }
+    }
+    else
+    {
+        r = http_server__setsockopt(srv, s, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+    }
+    if (r == HTTP_SERVER_OK && listener->family == HTTP_SERVER_LISTENER_INET6)
+    {
+        r = http_server__setsockopt(srv, s, IPPROTO_IPV6, IPV6_V6ONLY, http_server__listener_v6only(srv, listener), "IPV6_V6ONLY");
+    }
+#if defined(SO_REUSEPORT)
+    if (r == HTTP_SERVER_OK && srv->reuseport && listener->family != HTTP_SERVER_LISTENER_UNIX)
+    {
+        // Let multiple processes accept on the same port
+        r = http_server__setsockopt(srv, s, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+    }
+#endif
+#if defined(TCP_DEFER_ACCEPT)
+    if (r == HTTP_SERVER_OK && srv->defer_accept > 0 && listener->family != HTTP_SERVER_LISTENER_UNIX)
+    {
+        // Wake up only when request data arrived
+        r = http_server__setsockopt(srv, s, IPPROTO_TCP, TCP_DEFER_ACCEPT, srv->defer_accept, "TCP_DEFER_ACCEPT");
+    }
+#endif
+#if defined(TCP_FASTOPEN)
+    if (r == HTTP_SERVER_OK && srv->fastopen > 0 && listener->family != HTTP_SERVER_LISTENER_UNIX)
+    {
+        r = http_server__setsockopt(srv, s, IPPROTO_TCP, TCP_FASTOPEN, srv->fastopen, "TCP_FASTOPEN");
+    }
+#endif
+    if (r == HTTP_SERVER_OK && srv->rcvbuf > 0)
+    {
+        // Accepted sockets inherit receive buffer size of the listener
+        r = http_server__setsockopt(srv, s, SOL_SOCKET, SO_RCVBUF, srv->rcvbuf, "SO_RCVBUF");
+    }
+    if (r != HTTP_SERVER_OK)
+    {
+        close(s);
+        return HTTP_SERVER_INVALID_SOCKET;
+    }
+    int flags = fcntl(s, F_GETFL, 0);
+    fcntl(s, F_SETFL, flags | O_NONBLOCK);
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+    if (bind(s, (struct sockaddr *)&ss, ss_len) == -1)
+    {
+        perror("bind");
+        close(s);
+        return HTTP_SERVER_INVALID_SOCKET;
+    }
+    if (listen(s, srv->backlog) == -1)
+    {
+        perror("listen");
+        close(s);
+        return HTTP_SERVER_INVALID_SOCKET;
+    }
+    return s;
+}
+
+http_server_socket_t Http_server_socket_open_listener(http_server * srv)
+{
+    http_server_listener listener;
+    listener.family = HTTP_SERVER_LISTENER_INET;
+    listener.address = (char *)srv->bind_address;
+    listener.port = srv->port;
+    return Http_server_socket_open(srv, &listener);
+}
+
+int Http_server_socket_setup_client(http_server * srv, http_server_listener * listener, http_server_socket_t sock)
+{
+    int r = HTTP_SERVER_OK;
+    if (srv->nodelay && (!listener || listener->family != HTTP_SERVER_LISTENER_UNIX))
+    {
+        r = http_server__setsockopt(srv, sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (r == HTTP_SERVER_OK && srv->sndbuf > 0)
+    {
+        r = http_server__setsockopt(srv, sock, SOL_SOCKET, SO_SNDBUF, srv->sndbuf, "SO_SNDBUF");
+    }
+    return r;
+}
+
+/**
+ * Convert peer address to IPv6 form
+ */
+static int http_server__peer_addr(struct sockaddr_storage * ss, unsigned char * addr)
+{
+    if (ss->ss_family == AF_INET)
+    {
+        // IPv4-mapped ::ffff:a.b.c.d
+        memset(addr, 0, 10);
+        addr[10] = 0xff;
+        addr[11] = 0xff;
+        memcpy(addr + 12, &((struct sockaddr_in *)ss)->sin_addr, 4);
+        return 1;
+    }
+    if (ss->ss_family == AF_INET6)
+    {
+        memcpy(addr, &((struct sockaddr_in6 *)ss)->sin6_addr, 16);
+        return 1;
+    }
+    return 0;
+}
+
+http_server_socket_t Http_server_socket_accept(http_server_socket_t listener, unsigned char * addr, int * has_addr)
+{
+    struct sockaddr_storage ss;
+    socklen_t ss_len = sizeof(ss);
+#if defined(HTTP_SERVER_HAVE_ACCEPT4)
+    http_server_socket_t fd = accept4(listener, (struct sockaddr *)&ss, &ss_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1)
+    {
+        return HTTP_SERVER_INVALID_SOCKET;
+    }
+#else
+    http_server_socket_t fd = accept(listener, (struct sockaddr *)&ss, &ss_len);
+    if (fd == -1)
+    {
+        return HTTP_SERVER_INVALID_SOCKET;
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    *has_addr = ss_len > 0 && http_server__peer_addr(&ss, addr);
+    return fd;
+}
+
+int Http_server_socket_send_fds(http_server_socket_t channel, const http_server_socket_t * fds, int count)
+{
+    if (count <= 0 || count > HTTP_SERVER_SOCKET_MAX_FDS)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    // Number of descriptors is sent as data since some data is required
+    // to pass control messages
+    struct iovec iov;
+    iov.iov_base = &count;
+    iov.iov_len = sizeof(count);
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HTTP_SERVER_SOCKET_MAX_FDS)];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    ssize_t r;
+    do
+    {
+        r = sendmsg(channel, &msg, 0);
+    }
+    while (r == -1 && errno == EINTR);
+    return r == sizeof(count) ? HTTP_SERVER_OK : HTTP_SERVER_SOCKET_ERROR;
+}
+
+int Http_server_socket_recv_fds(http_server_socket_t channel, http_server_socket_t * fds, int max)
+{
+    int count = 0;
+    struct iovec iov;
+    iov.iov_base = &count;
+    iov.iov_len = sizeof(count);
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * HTTP_SERVER_SOCKET_MAX_FDS)];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    int flags = 0;
+#if defined(MSG_CMSG_CLOEXEC)
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+    ssize_t r;
+    do
+    {
+        r = recvmsg(channel, &msg, flags);
+    }
+    while (r == -1 && errno == EINTR);
+    if (r != sizeof(count))
+    {
+        return -1;
+    }
+    int received = 0;
+    struct cmsghdr * cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int * data = (int *)CMSG_DATA(cmsg);
+        int i;
+        for (i = 0; i < n; ++i)
+        {
+            if (received < max)
+            {
+                fds[received++] = data[i];
+            }
+            else
+            {
+                close(data[i]);
+            }
+        }
+    }
+    if (received != count || (msg.msg_flags & MSG_CTRUNC))
+    {
+        while (received > 0)
+        {
+            close(fds[--received]);
+        }
+        return -1;
+    }
+    int i;
+    for (i = 0; i < received; ++i)
+    {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    return received;
+}
+
+int Http_server_socket_listener_family(http_server_socket_t sock, http_server_listener_family * family, long * port)
+{
+    struct sockaddr_storage ss;
+    socklen_t ss_len = sizeof(ss);
+    if (getsockname(sock, (struct sockaddr *)&ss, &ss_len) == -1)
+    {
+        return HTTP_SERVER_SOCKET_ERROR;
+    }
+    if (ss.ss_family == AF_INET)
+    {
+        *family = HTTP_SERVER_LISTENER_INET;
+        *port = ntohs(((struct sockaddr_in *)&ss)->sin_port);
+    }
+    else if (ss.ss_family == AF_INET6)
+    {
+        *family = HTTP_SERVER_LISTENER_INET6;
+        *port = ntohs(((struct sockaddr_in6 *)&ss)->sin6_port);
+    }
+    else if (ss.ss_family == AF_UNIX)
+    {
+        *family = HTTP_SERVER_LISTENER_UNIX;
+        *port = 0;
+    }
+    else
+    {
+        return HTTP_SERVER_SOCKET_ERROR;
+    }
+    return HTTP_SERVER_OK;
+}
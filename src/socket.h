@@ -0,0 +1,45 @@
+/**
+ * Create, bind and listen on a socket described by the listener
+ * @return Socket or HTTP_SERVER_INVALID_SOCKET
+ */
+http_server_socket_t Http_server_socket_open(http_server * srv, http_server_listener * listener);
+
+/**
+ * Create listening socket configured with server's listener options.
+ * This is the default `opensocket_func` of every event loop.
+ * @return Socket or HTTP_SERVER_INVALID_SOCKET
+ */
+http_server_socket_t Http_server_socket_open_listener(http_server * srv);
+
+/**
+ * Apply server's options to a client socket accepted on the listener
+ * (NULL for `sock_listen` made by a custom `opensocket_func`)
+ */
+int Http_server_socket_setup_client(http_server * srv, http_server_listener * listener, http_server_socket_t sock);
+
+/**
+ * Accept connection as a nonblocking, close-on-exec socket
+ * @param addr Peer address as IPv6 or IPv4-mapped address (16 bytes)
+ * @param has_addr Set to 0 if peer has no IP address
+ * @return Socket or HTTP_SERVER_INVALID_SOCKET with `errno` set
+ */
+http_server_socket_t Http_server_socket_accept(http_server_socket_t listener, unsigned char * addr, int * has_addr);
+
+// Most listening sockets passed between processes at once
+#define HTTP_SERVER_SOCKET_MAX_FDS 16
+
+/**
+ * Send descriptors over a Unix socket
+ */
+int Http_server_socket_send_fds(http_server_socket_t channel, const http_server_socket_t * fds, int count);
+
+/**
+ * Receive descriptors sent by `Http_server_socket_send_fds`
+ * @return Number of descriptors or -1 on failure
+ */
+int Http_server_socket_recv_fds(http_server_socket_t channel, http_server_socket_t * fds, int max);
+
+/**
+ * Find out address family and port of a listening socket
+ */
+int Http_server_socket_listener_family(http_server_socket_t sock, http_server_listener_family * family, long * port);
@@ -0,0 +1,219 @@
+#include "http-server/http-server.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "timer.h"
+#include "stats.h"
+
+// Values below this are counted exactly
+#define HISTOGRAM_LINEAR 4
+
+static int http_server__histogram_bucket(unsigned long long value)
+{
+    if (value < HISTOGRAM_LINEAR)
+    {
+        return (int)value;
+    }
+    // Highest bit picks the range and two bits below it the bucket
+    int exponent = 63 - __builtin_clzll(value);
+    int bucket = (exponent - 1) * 4 + (int)((value >> (exponent - 2)) & 3);
+    return bucket < HTTP_SERVER_HISTOGRAM_BUCKETS ? bucket : HTTP_SERVER_HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * Smallest value that does not fit the bucket
+ */
+static unsigned long long http_server__histogram_bound(int bucket)
+{
+    if (bucket < HISTOGRAM_LINEAR)
+    {
+        return bucket + 1;
+    }
+    int exponent = bucket / 4 + 1;
+    return (unsigned long long)(5 + bucket % 4) << (exponent - 2);
+}
+
+void Http_server_histogram_record(http_server_histogram * histogram, unsigned long long value)
+{
+    histogram->counts[http_server__histogram_bucket(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+void Http_server_histogram_record_since(http_server_histogram * histogram, unsigned long long start)
+{
+    if (!start)
+    {
+        return;
+    }
+    unsigned long long now = Http_server_timer_now_us();
+    Http_server_histogram_record(histogram, now > start ? now - start : 0);
+}
+
+unsigned long long http_server_histogram_quantile(const http_server_histogram * histogram, double quantile)
+{
+    if (!histogram || histogram->count == 0)
+    {
+        return 0;
+    }
+    unsigned long long rank = (unsigned long long)(quantile * histogram->count + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    unsigned long long seen = 0;
+    int i;
+    for (i = 0; i < HTTP_SERVER_HISTOGRAM_BUCKETS; ++i)
+    {
+        seen += histogram->counts[i];
+        if (seen >= rank)
+        {
+            // Report the bucket by its highest value
+            unsigned long long value = http_server__histogram_bound(i) - 1;
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+int http_server_get_stats(http_server * srv, http_server_stats * stats)
+{
+    if (!srv || !stats)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    *stats = srv->stats_;
+    stats->connections = srv->connections_;
+    stats->inflight = srv->inflight_;
+    stats->output_queued = 0;
+    http_server_client * client;
+    SLIST_FOREACH(client, &srv->clients, next)
+    {
+        stats->output_queued += client->buffer_size_;
+    }
+    return HTTP_SERVER_OK;
+}
+
+static int http_server__stats_printf(http_server_string * out, const char * format, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0 || len >= (int)sizeof(line))
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    return http_server_string_append(out, line, len);
+}
+
+static int http_server__stats_metric(http_server_string * out, const char * name, const char * type, unsigned long long value)
+{
+    int r = http_server__stats_printf(out, "# TYPE http_server_%s %s\n", name, type);
+    if (r != HTTP_SERVER_OK)
+    {
+        return r;
+    }
+    return http_server__stats_printf(out, "http_server_%s %llu\n", name, value);
+}
+
+/**
+ * Histogram with buckets at powers of two microseconds reported in seconds
+ */
+static int http_server__stats_histogram(http_server_string * out, const char * name, const http_server_histogram * histogram)
+{
+    int r = http_server__stats_printf(out, "# TYPE http_server_%s histogram\n", name);
+    unsigned long long cumulative = 0;
+    int i;
+    for (i = 0; i < HTTP_SERVER_HISTOGRAM_BUCKETS - 1 && r == HTTP_SERVER_OK; ++i)
+    {
+        cumulative += histogram->counts[i];
+        if (i % 4 == 3)
+        {
+            r = http_server__stats_printf(out, "http_server_%s_bucket{le=\"%g\"} %llu\n", name, http_server__histogram_bound(i) / 1e6, cumulative);
+        }
+    }
+    if (r == HTTP_SERVER_OK)
+    {
+        r = http_server__stats_printf(out, "http_server_%s_bucket{le=\"+Inf\"} %llu\n", name, histogram->count);
+    }
+    if (r == HTTP_SERVER_OK)
+    {
+        r = http_server__stats_printf(out, "http_server_%s_sum %g\n", name, histogram->sum / 1e6);
+    }
+    if (r == HTTP_SERVER_OK)
+    {
+        r = http_server__stats_printf(out, "http_server_%s_count %llu\n", name, histogram->count);
+    }
+    return r;
+}
+
+int http_server_response_send_stats(http_server_response * res)
+{
+    if (!res || !res->client || !res->client->server_)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    http_server_stats stats;
+    int r = http_server_get_stats(res->client->server_, &stats);
+    if (r != HTTP_SERVER_OK)
+    {
+        return r;
+    }
+    http_server_string out;
+    http_server_string_init(&out);
+#define COUNTER(name) if (r == HTTP_SERVER_OK) r = http_server__stats_metric(&out, #name "_total", "counter", stats.name)
+#define GAUGE(name) if (r == HTTP_SERVER_OK) r = http_server__stats_metric(&out, #name, "gauge", (unsigned long long)stats.name)
+    COUNTER(connections_accepted);
+    COUNTER(connections_closed);
+    COUNTER(connections_rejected);
+    COUNTER(requests);
+    COUNTER(requests_rejected);
+    COUNTER(responses);
+    COUNTER(bytes_in);
+    COUNTER(bytes_out);
+    COUNTER(parser_errors);
+    COUNTER(timeouts);
+    GAUGE(connections);
+    GAUGE(inflight);
+    GAUGE(output_queued);
+#undef COUNTER
+#undef GAUGE
+    if (r == HTTP_SERVER_OK)
+    {
+        r = http_server__stats_histogram(&out, "first_byte_seconds", &stats.first_byte);
+    }
+    if (r == HTTP_SERVER_OK)
+    {
+        r = http_server__stats_histogram(&out, "response_seconds", &stats.response);
+    }
+    char length[32];
+    int length_len = snprintf(length, sizeof(length), "%d", out.len);
+    if (r == HTTP_SERVER_OK)
+    {
+        r = http_server_response_set_header(res, "Content-Type", 12, "text/plain; version=0.0.4", 25);
+    }
+    if (r == HTTP_SERVER_OK)
+    {
+        r = http_server_response_set_header(res, "Content-Length", 14, length, length_len);
+    }
+    if (r == HTTP_SERVER_OK)
+    {
+        r = http_server_response_write_head(res, HTTP_200_OK);
+    }
+    if (r == HTTP_SERVER_OK)
+    {
+        r = http_server_response_write(res, out.buf, out.len);
+    }
+    http_server_string_free(&out);
+    if (r != HTTP_SERVER_OK)
+    {
+        return r;
+    }
+    return http_server_response_end(res);
+}
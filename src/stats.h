@@ -0,0 +1,9 @@
+/**
+ * Add latency in microseconds to the histogram
+ */
+void Http_server_histogram_record(http_server_histogram * histogram, unsigned long long value);
+
+/**
+ * Record latency since `start` in microseconds (0 - unknown start)
+ */
+void Http_server_histogram_record_since(http_server_histogram * histogram, unsigned long long start);
@@ -0,0 +1,250 @@
+#include "http-server/http-server.h"
+#include <time.h>
+#include <assert.h>
+#include "timer.h"
+#include "log.h"
+
+#define WHEEL_BITS HTTP_SERVER_TIMER_WHEEL_BITS
+#define WHEEL_SLOTS HTTP_SERVER_TIMER_WHEEL_SLOTS
+#define WHEEL_LEVELS HTTP_SERVER_TIMER_WHEEL_LEVELS
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+// Longest timeout that fits on the wheel
+#define WHEEL_MAX ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+unsigned long long Http_server_timer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+unsigned long long Http_server_timer_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Http_server_timer_wheel_init(http_server_timer_wheel * wheel)
+{
+    int level, slot;
+    for (level = 0; level < WHEEL_LEVELS; ++level)
+    {
+        for (slot = 0; slot < WHEEL_SLOTS; ++slot)
+        {
+            LIST_INIT(&wheel->slots[level][slot]);
+        }
+    }
+    wheel->now = Http_server_timer_now();
+    wheel->current = wheel->now;
+    wheel->count = 0;
+}
+
+int http_server_timer_init(http_server_timer * timer, http_server_timer_callback callback, void * data)
+{
+    if (!timer)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    timer->expires_ = 0;
+    timer->callback = callback;
+    timer->data = data;
+    timer->repeat_ = 0;
+    timer->is_active_ = 0;
+    return HTTP_SERVER_OK;
+}
+
+int http_server_timer_start(http_server * srv, http_server_timer * timer, long timeout, long repeat)
+{
+    if (!srv || !timer || !timer->callback || timeout < 0 || repeat < 0)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    timer->repeat_ = repeat;
+    Http_server_timer_wheel_add(&srv->timers_, timer, timeout);
+    return HTTP_SERVER_OK;
+}
+
+int http_server_timer_stop(http_server * srv, http_server_timer * timer)
+{
+    if (!srv || !timer)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    timer->repeat_ = 0;
+    Http_server_timer_wheel_remove(&srv->timers_, timer);
+    return HTTP_SERVER_OK;
+}
+
+long http_server_timer_timeout(http_server * srv)
+{
+    assert(srv);
+    srv->timers_.now = Http_server_timer_now();
+    return Http_server_timer_wheel_next(&srv->timers_);
+}
+
+int http_server_timer_run(http_server * srv)
+{
+    if (!srv)
+    {
+        return HTTP_SERVER_INVALID_PARAM;
+    }
+    return Http_server_timer_wheel_run(srv);
+}
+
+static void Http_server_timer_wheel_insert(http_server_timer_wheel * wheel, http_server_timer * timer)
+{
+    unsigned long long expires = timer->expires_;
+    if (expires < wheel->current)
+    {
+        expires = wheel->current;
+    }
+    unsigned long long delta = expires - wheel->current;
+    if (delta > WHEEL_MAX)
+    {
+        // Timer will be cascaded again when it reaches the lowest level
+        delta = WHEEL_MAX;
+        expires = wheel->current + delta;
+    }
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+    {
+        level++;
+    }
+    int slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    LIST_INSERT_HEAD(&wheel->slots[level][slot], timer, entries_);
+}
+
+void Http_server_timer_wheel_add(http_server_timer_wheel * wheel, http_server_timer * timer, long timeout)
+{
+    assert(timer);
+    Http_server_timer_wheel_remove(wheel, timer);
+    // Timer might be armed long after the loop woke up
+    wheel->now = Http_server_timer_now();
+    if (wheel->count == 0 && wheel->current < wheel->now)
+    {
+        // Wheel is empty so there are no ticks worth catching up on
+        wheel->current = wheel->now;
+    }
+    timer->expires_ = wheel->now + (timeout > 0 ? timeout : 0);
+    Http_server_timer_wheel_insert(wheel, timer);
+    timer->is_active_ = 1;
+    wheel->count++;
+}
+
+void Http_server_timer_wheel_remove(http_server_timer_wheel * wheel, http_server_timer * timer)
+{
+    assert(timer);
+    if (!timer->is_active_)
+    {
+        return;
+    }
+    LIST_REMOVE(timer, entries_);
+    timer->is_active_ = 0;
+    wheel->count--;
+}
+
+long Http_server_timer_wheel_next(http_server_timer_wheel * wheel)
+{
+    if (wheel->count == 0)
+    {
+        return -1;
+    }
+    // Level 0 slots up to the next cascade hold timers in deadline order.
+    // If they are all empty the next cascade is the earliest point where
+    // something could expire.
+    unsigned long long tick = wheel->current;
+    unsigned long long boundary = (wheel->current | WHEEL_MASK) + 1;
+    for (; tick < boundary; ++tick)
+    {
+        if (!LIST_EMPTY(&wheel->slots[0][tick & WHEEL_MASK]))
+        {
+            break;
+        }
+    }
+    if (tick <= wheel->now)
+    {
+        return 0;
+    }
+    return (long)(tick - wheel->now);
+}
+
+/**
+ * Move timers from higher levels that are due in the next
+ * WHEEL_SLOTS ticks down to the lower levels.
+ */
+static void Http_server_timer_wheel_cascade(http_server_timer_wheel * wheel)
+{
+    int level;
+    for (level = 1; level < WHEEL_LEVELS; ++level)
+    {
+        int slot = (wheel->current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        struct http_server__timer_slot * head = &wheel->slots[level][slot];
+        while (!LIST_EMPTY(head))
+        {
+            http_server_timer * timer = LIST_FIRST(head);
+            LIST_REMOVE(timer, entries_);
+            Http_server_timer_wheel_insert(wheel, timer);
+        }
+        if (slot != 0)
+        {
+            break;
+        }
+    }
+}
+
+int Http_server_timer_wheel_run(http_server * srv)
+{
+    http_server_timer_wheel * wheel = &srv->timers_;
+    wheel->now = Http_server_timer_now();
+    while (wheel->current <= wheel->now)
+    {
+        if (wheel->count == 0)
+        {
+            // Nothing to expire so skip idle ticks
+            wheel->current = wheel->now + 1;
+            break;
+        }
+        if ((wheel->current & WHEEL_MASK) == 0)
+        {
+            Http_server_timer_wheel_cascade(wheel);
+        }
+        // Detach expired timers first. Loop time is advanced before any
+        // callback runs so timers armed by callbacks land in future slots.
+        struct http_server__timer_slot expired;
+        LIST_INIT(&expired);
+        struct http_server__timer_slot * head = &wheel->slots[0][wheel->current & WHEEL_MASK];
+        while (!LIST_EMPTY(head))
+        {
+            http_server_timer * timer = LIST_FIRST(head);
+            LIST_REMOVE(timer, entries_);
+            LIST_INSERT_HEAD(&expired, timer, entries_);
+        }
+        wheel->current++;
+        while (!LIST_EMPTY(&expired))
+        {
+            http_server_timer * timer = LIST_FIRST(&expired);
+            LIST_REMOVE(timer, entries_);
+            timer->is_active_ = 0;
+            wheel->count--;
+            if (timer->repeat_ > 0)
+            {
+                // Rearm before the callback so it is able to stop the timer.
+                // Next deadline is based on the previous one to avoid drift.
+                timer->expires_ += timer->repeat_;
+                if (timer->expires_ < wheel->current)
+                {
+                    timer->expires_ = wheel->current;
+                }
+                Http_server_timer_wheel_insert(wheel, timer);
+                timer->is_active_ = 1;
+                wheel->count++;
+            }
+            if (timer->callback && timer->callback(srv, timer, timer->data) != HTTP_SERVER_OK)
+            {
+                HTTP_SERVER_LOG(srv, WARNING, TIMER, "timer callback failed");
+            }
+        }
+    }
+    return HTTP_SERVER_OK;
+}
@@ -0,0 +1,40 @@
+/**
+ * Hierarchical timer wheel. Every level has HTTP_SERVER_TIMER_WHEEL_SLOTS
+ * slots and each slot on level N covers SLOTS^N milliseconds. Timers are
+ * cascaded to the lower level when the wheel reaches their slot, so
+ * arming and cancelling a timer is O(1).
+ */
+
+/**
+ * Monotonic clock in milliseconds
+ */
+unsigned long long Http_server_timer_now(void);
+
+/**
+ * Monotonic clock in microseconds
+ */
+unsigned long long Http_server_timer_now_us(void);
+
+void Http_server_timer_wheel_init(http_server_timer_wheel * wheel);
+
+/**
+ * Arm timer to expire `timeout` milliseconds from now. Timer that is
+ * already armed is moved.
+ */
+void Http_server_timer_wheel_add(http_server_timer_wheel * wheel, http_server_timer * timer, long timeout);
+
+/**
+ * Disarm timer. Does nothing if timer is not armed.
+ */
+void Http_server_timer_wheel_remove(http_server_timer_wheel * wheel, http_server_timer * timer);
+
+/**
+ * Milliseconds from current loop time until the wheel has to be
+ * serviced again or -1 if no timer is armed.
+ */
+long Http_server_timer_wheel_next(http_server_timer_wheel * wheel);
+
+/**
+ * Update loop time and run callbacks of all expired timers
+ */
+int Http_server_timer_wheel_run(http_server * srv);
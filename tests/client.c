@@ -1,5 +1,6 @@
 #include "clar.h"
 #include "http-server/http-server.h"
+#include <string.h>
 
 http_server server;
 http_server_handler handler;
@@ -49,3 +50,90 @@ void test_client__write(void)
 	}
 	cl_assert_equal_i(i, 1);
 }
+
+void test_client__getinfo_components(void)
+{
+	const char * url = "/path/to?a=1&b=2#frag";
+	int r = http_server_string_append(&client->url, url, strlen(url));
+	cl_assert_equal_i(r, HTTP_SERVER_OK);
+	char * path, * query, * fragment;
+	cl_assert_equal_i(http_server_client_getinfo(client, HTTP_SERVER_CLIENTINFO_PATH, &path), HTTP_SERVER_OK);
+	cl_assert_equal_s(path, "/path/to");
+	cl_assert_equal_i(http_server_client_getinfo(client, HTTP_SERVER_CLIENTINFO_QUERY, &query), HTTP_SERVER_OK);
+	cl_assert_equal_s(query, "a=1&b=2");
+	cl_assert_equal_i(http_server_client_getinfo(client, HTTP_SERVER_CLIENTINFO_FRAGMENT, &fragment), HTTP_SERVER_OK);
+	cl_assert_equal_s(fragment, "frag");
+}
+
+void test_client__query_param(void)
+{
+	const char * url = "/search?q=hello+world&empty&name=%41%62c&q2=%zz";
+	int r = http_server_string_append(&client->url, url, strlen(url));
+	cl_assert_equal_i(r, HTTP_SERVER_OK);
+	char * value;
+	cl_assert_equal_i(http_server_client_query_param(client, "name", &value), HTTP_SERVER_OK);
+	cl_assert_equal_s(value, "Abc");
+	cl_assert_equal_i(http_server_client_query_param(client, "q", &value), HTTP_SERVER_OK);
+	cl_assert_equal_s(value, "hello world");
+	cl_assert_equal_i(http_server_client_query_param(client, "empty", &value), HTTP_SERVER_OK);
+	cl_assert_equal_s(value, "");
+	cl_assert_equal_i(http_server_client_query_param(client, "q2", &value), HTTP_SERVER_OK);
+	cl_assert_equal_s(value, "%zz");
+	cl_assert_equal_i(http_server_client_query_param(client, "missing", &value), HTTP_SERVER_OK);
+	cl_assert(!value);
+	// Raw query string is not affected by decoding
+	char * query;
+	cl_assert_equal_i(http_server_client_getinfo(client, HTTP_SERVER_CLIENTINFO_QUERY, &query), HTTP_SERVER_OK);
+	cl_assert_equal_s(query, "q=hello+world&empty&name=%41%62c&q2=%zz");
+}
+
+static int poll_flags = 0;
+
+static int _socket_function(void * clientp, http_server_socket_t sock, int flags, void * socketp)
+{
+	poll_flags = flags;
+	return HTTP_SERVER_OK;
+}
+
+void test_client__body_watermarks(void)
+{
+	const char * request = "POST /upload/ HTTP/1.1\r\nContent-Length: 32\r\n\r\n0123456789abcdef";
+	server.socket_func = &_socket_function;
+	server.body_high_watermark = 10;
+	server.body_low_watermark = 4;
+	cl_assert_equal_i(http_server_perform_client(client, request, strlen(request)), HTTP_SERVER_OK);
+	cl_assert_equal_i(client->body_pending_, 16);
+	cl_assert_equal_i(client->is_throttled_, 1);
+	// Still above low watermark
+	cl_assert_equal_i(http_server_client_consume(client, 10), HTTP_SERVER_OK);
+	cl_assert_equal_i(client->is_throttled_, 1);
+	cl_assert_equal_i(poll_flags, 0);
+	cl_assert_equal_i(http_server_client_consume(client, 2), HTTP_SERVER_OK);
+	cl_assert_equal_i(client->body_pending_, 4);
+	cl_assert_equal_i(client->is_throttled_, 0);
+	cl_assert_equal_i(poll_flags, HTTP_SERVER_POLL_IN);
+	server.socket_func = NULL;
+	server.body_high_watermark = 0;
+	server.body_low_watermark = 0;
+}
+
+void test_client__keep_alive(void)
+{
+	const char * requests = "GET /a HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\n\r\nGET /c HTTP/1.1\r\n\r\n";
+	server.max_keepalive_requests = 2;
+	cl_assert_equal_i(http_server_perform_client(client, requests, strlen(requests)), HTTP_SERVER_OK);
+	// Third request is not processed
+	cl_assert_equal_i(client->requests_, 2);
+	cl_assert_equal_i(client->close_after_, 2);
+	cl_assert_equal_i(client->is_closing_, 1);
+	server.max_keepalive_requests = 0;
+}
+
+void test_client__connection_close(void)
+{
+	const char * requests = "GET /a HTTP/1.0\r\nConnection: keep-alive\r\n\r\nGET /b HTTP/1.1\r\nConnection: close\r\n\r\nGET /c HTTP/1.1\r\n\r\n";
+	cl_assert_equal_i(http_server_perform_client(client, requests, strlen(requests)), HTTP_SERVER_OK);
+	cl_assert_equal_i(client->requests_, 2);
+	cl_assert_equal_i(client->close_after_, 2);
+	cl_assert_equal_i(client->is_closing_, 1);
+}
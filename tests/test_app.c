@@ -19,6 +19,9 @@ http_server_request * create_request(void)
     return req;
 }
 
+// Constant response sent without building it again
+http_server_prepared_response * health_response;
+
 #define ASSERT(expr) do { if (!(expr)) { fprintf(stderr, "Error! assert(" #expr ") failed.\n"); abort(); }} while (0)
 
 int on_body(http_server_client * client, void * data, const char * buf, size_t size)
@@ -45,13 +48,11 @@ int on_message_complete(http_server_client * client, void * data)
 {
     http_server_request * req = client->data;
     fprintf(stderr, "Message complete\n");
-    http_server_response * res = http_server_response_new();
+    http_server_response * res = http_server_response_acquire(client);
     ASSERT(res);
     char * url;
     int r = http_server_client_getinfo(client, HTTP_SERVER_CLIENTINFO_URL, &url);
     ASSERT(r == HTTP_SERVER_OK);
-    r = http_server_response_begin(client, res);
-    ASSERT(r == HTTP_SERVER_OK);
     assert(url);
     if (strcmp(url, "/set-headers/") == 0)
     {
@@ -115,13 +116,26 @@ int on_message_complete(http_server_client * client, void * data)
         r = http_server_response_printf(res, "success=%d\n", result);
         ASSERT(r == HTTP_SERVER_OK);
     }
+    else if (strcmp(url, "/health/") == 0)
+    {
+        r = http_server_response_send_prepared(res, health_response);
+        ASSERT(r == HTTP_SERVER_OK);
+    }
+    else if (strcmp(url, "/metrics/") == 0)
+    {
+        r = http_server_response_send_stats(res);
+        ASSERT(r == HTTP_SERVER_OK);
+    }
     else
     {
         r = http_server_response_write_head(res, 404);
         ASSERT(r == HTTP_SERVER_OK);
     }
-    r = http_server_response_end(res);
-    ASSERT(r == HTTP_SERVER_OK);
+    if (!res->is_done)
+    {
+        r = http_server_response_end(res);
+        ASSERT(r == HTTP_SERVER_OK);
+    }
     free(req);
     client->data = NULL;
     return 0;
@@ -150,6 +164,9 @@ int main(int argc, char * argv[])
         fprintf(stderr, "Unable to set debug function: %s\n", http_server_errstr(result));
         return 1;
     }
+    const char * health_headers = "Content-Type: application/json\r\n";
+    health_response = http_server_prepared_response_new(200, health_headers, strlen(health_headers), "{\"status\":\"ok\"}\n", 16);
+    ASSERT(health_response);
     // Init handler function
     http_server_handler handler;
     result = http_server_handler_init(&handler);
@@ -177,5 +194,6 @@ int main(int argc, char * argv[])
     exit_code = http_server_run(&srv);
     // Cleans up everything
     http_server_free(&srv);
+    http_server_prepared_response_free(health_response);
     return exit_code;
 }
@@ -4,7 +4,14 @@
 #include <assert.h>
 #include "http-server/http-server.h"
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <string.h>
 
 static http_server srv;
 
@@ -84,6 +91,121 @@ void test_test_http_server__setopt(void)
     r = http_server_setopt(&srv, HTTP_SERVER_OPT_DEBUG_DATA, &debug_data);
     cl_assert_equal_i(r, HTTP_SERVER_OK);
     cl_assert(srv.debug_data == &debug_data);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_BODY_HIGH_WATERMARK, 65536L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.body_high_watermark, 65536);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_BODY_LOW_WATERMARK, 16384L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.body_low_watermark, 16384);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_OUTPUT_HIGH_WATERMARK, 131072L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.output_high_watermark, 131072);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_OUTPUT_LOW_WATERMARK, 32768L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.output_low_watermark, 32768);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_HEADER_TIMEOUT, 1000L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.header_timeout, 1000);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_BODY_TIMEOUT, 2000L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.body_timeout, 2000);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_KEEPALIVE_TIMEOUT, 3000L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.keepalive_timeout, 3000);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_WRITE_TIMEOUT, 4000L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.write_timeout, 4000);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_MAX_PIPELINE, 4L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.max_pipeline, 4);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_MAX_KEEPALIVE_REQUESTS, 1000L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.max_keepalive_requests, 1000);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_RESPONSE_BUFFER_SIZE, 4096L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.response_buffer_size, 4096);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_DATE_HEADER, 0L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.date_header, 0);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_SERVER_NAME, "http-server");
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_s(srv.server_name, "http-server");
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_RESPONSE_POOL_SIZE, 8L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.response_pool_size, 8);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_CORK, 0L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.cork, 0);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_BIND_ADDRESS, "127.0.0.1");
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_s(srv.bind_address, "127.0.0.1");
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_PORT, 8080L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.port, 8080);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_PORT, 65536L);
+    cl_assert_equal_i(r, HTTP_SERVER_INVALID_PARAM);
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_PORT, -1L);
+    cl_assert_equal_i(r, HTTP_SERVER_INVALID_PARAM);
+    cl_assert_equal_i(srv.port, 8080);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_BACKLOG, 4096L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.backlog, 4096);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_REUSEPORT, 1L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.reuseport, 1);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_DEFER_ACCEPT, 5L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.defer_accept, 5);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_FASTOPEN, 16L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.fastopen, 16);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_NODELAY, 1L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.nodelay, 1);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_SNDBUF, 65536L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.sndbuf, 65536);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_RCVBUF, 65536L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.rcvbuf, 65536);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_ACCEPT_BUDGET, 16L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.accept_budget, 16);
+
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_MAX_CONNECTIONS, 1000L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.max_connections, 1000);
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_MAX_INFLIGHT, -1L);
+    cl_assert_equal_i(r, HTTP_SERVER_INVALID_PARAM);
+    r = http_server_setopt(&srv, HTTP_SERVER_OPT_MAX_INFLIGHT, 100L);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.max_inflight, 100);
 }
 
 void test_test_http_server__setopt_failure(void)
@@ -101,6 +223,508 @@ void test_test_http_server__start(void)
     cl_assert(srv.sock_listen != HTTP_SERVER_INVALID_SOCKET);
 }
 
+void test_test_http_server__listener_options(void)
+{
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_BIND_ADDRESS, "invalid"), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_start(&srv), HTTP_SERVER_SOCKET_ERROR);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_BIND_ADDRESS, "127.0.0.1"), HTTP_SERVER_OK);
+    // Any free port
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_PORT, 0L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_BACKLOG, 16L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_REUSEPORT, 1L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_DEFER_ACCEPT, 5L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_start(&srv), HTTP_SERVER_OK);
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    cl_assert(getsockname(srv.sock_listen, (struct sockaddr *)&sin, &len) != -1);
+    cl_assert_equal_i(ntohl(sin.sin_addr.s_addr), INADDR_LOOPBACK);
+    cl_assert(ntohs(sin.sin_port) != 0);
+    cl_assert_equal_i(http_server_cancel(&srv), HTTP_SERVER_OK);
+}
+
+/**
+ * Listen on an ephemeral loopback port
+ */
+static void listen_on_loopback(void)
+{
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_BIND_ADDRESS, "127.0.0.1"), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_PORT, 0L), HTTP_SERVER_OK);
+}
+
+/**
+ * Open `count` connections to a listening socket
+ */
+static void connect_clients(http_server_socket_t sock_listen, int * conns, int count)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    cl_assert(getsockname(sock_listen, (struct sockaddr *)&sin, &len) != -1);
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        conns[i] = socket(AF_INET, SOCK_STREAM, 0);
+        cl_assert(conns[i] != -1);
+        cl_assert(connect(conns[i], (struct sockaddr *)&sin, sizeof(sin)) != -1);
+    }
+}
+
+static void close_clients(int * conns, int count)
+{
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        close(conns[i]);
+    }
+}
+
+/**
+ * Read from the connection until the server closes it
+ */
+static void read_all(int conn, char * data, int size)
+{
+    int n = 0, r;
+    while ((r = read(conn, data + n, size - n - 1)) > 0)
+    {
+        n += r;
+    }
+    data[n] = '\0';
+}
+
+void test_test_http_server__accept_batch(void)
+{
+    listen_on_loopback();
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_ACCEPT_BUDGET, 2L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_start(&srv), HTTP_SERVER_OK);
+    int conns[3];
+    connect_clients(srv.sock_listen, conns, 3);
+    // Two connections fit in the budget of one wakeup
+    cl_assert_equal_i(http_server_socket_action(&srv, srv.sock_listen, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    int n = 0;
+    http_server_client * client;
+    SLIST_FOREACH(client, &srv.clients, next)
+    {
+        n++;
+        cl_assert(fcntl(client->sock, F_GETFL) & O_NONBLOCK);
+        cl_assert(fcntl(client->sock, F_GETFD) & FD_CLOEXEC);
+    }
+    cl_assert_equal_i(n, 2);
+    cl_assert_equal_i(http_server_socket_action(&srv, srv.sock_listen, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    // Backlog is empty now
+    cl_assert_equal_i(http_server_socket_action(&srv, srv.sock_listen, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    n = 0;
+    SLIST_FOREACH(client, &srv.clients, next)
+    {
+        n++;
+    }
+    cl_assert_equal_i(n, 3);
+    while (!SLIST_EMPTY(&srv.clients))
+    {
+        int sock = SLIST_FIRST(&srv.clients)->sock;
+        cl_assert_equal_i(http_server_pop_client(&srv, sock), HTTP_SERVER_OK);
+        close(sock);
+    }
+    close_clients(conns, 3);
+    cl_assert_equal_i(http_server_cancel(&srv), HTTP_SERVER_OK);
+}
+
+void test_test_http_server__listeners(void)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/http-server-test-%d.sock", (int)getpid());
+    cl_assert_equal_i(http_server_add_listener(&srv, HTTP_SERVER_LISTENER_UNIX, NULL, 0L, -1L, 0L), HTTP_SERVER_INVALID_PARAM);
+    cl_assert_equal_i(http_server_add_listener(&srv, HTTP_SERVER_LISTENER_INET, NULL, 70000L, -1L, 0L), HTTP_SERVER_INVALID_PARAM);
+    cl_assert_equal_i(http_server_add_listener(&srv, HTTP_SERVER_LISTENER_INET, "127.0.0.1", 0L, -1L, 0L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_add_listener(&srv, HTTP_SERVER_LISTENER_INET6, "::1", 0L, 1L, 0L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_add_listener(&srv, HTTP_SERVER_LISTENER_UNIX, path, 0L, -1L, 0L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_start(&srv), HTTP_SERVER_OK);
+    http_server_listener * listeners[3];
+    int n = 0;
+    http_server_listener * listener;
+    SLIST_FOREACH(listener, &srv.listeners, next)
+    {
+        cl_assert(listener->sock != HTTP_SERVER_INVALID_SOCKET);
+        listeners[n++] = listener;
+    }
+    cl_assert_equal_i(n, 3);
+    // First listener added is the primary one
+    cl_assert_equal_i(srv.sock_listen, listeners[0]->sock);
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    cl_assert(getsockname(listeners[0]->sock, (struct sockaddr *)&sin, &len) != -1);
+    struct sockaddr_in6 sin6;
+    len = sizeof(sin6);
+    cl_assert(getsockname(listeners[1]->sock, (struct sockaddr *)&sin6, &len) != -1);
+    cl_assert_equal_i(sin6.sin6_family, AF_INET6);
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    int conns[4];
+    conns[0] = socket(AF_INET, SOCK_STREAM, 0);
+    cl_assert(connect(conns[0], (struct sockaddr *)&sin, sizeof(sin)) != -1);
+    conns[1] = socket(AF_INET6, SOCK_STREAM, 0);
+    cl_assert(connect(conns[1], (struct sockaddr *)&sin6, sizeof(sin6)) != -1);
+    conns[2] = socket(AF_INET6, SOCK_STREAM, 0);
+    cl_assert(connect(conns[2], (struct sockaddr *)&sin6, sizeof(sin6)) != -1);
+    conns[3] = socket(AF_UNIX, SOCK_STREAM, 0);
+    cl_assert(connect(conns[3], (struct sockaddr *)&sun, sizeof(sun)) != -1);
+    int i;
+    for (i = 0; i < 3; ++i)
+    {
+        cl_assert_equal_i(http_server_socket_action(&srv, listeners[i]->sock, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    }
+    // IPv6 listener accepts one connection per wakeup
+    n = 0;
+    http_server_client * client;
+    SLIST_FOREACH(client, &srv.clients, next)
+    {
+        n++;
+    }
+    cl_assert_equal_i(n, 3);
+    cl_assert_equal_i(http_server_socket_action(&srv, listeners[1]->sock, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    while (!SLIST_EMPTY(&srv.clients))
+    {
+        int sock = SLIST_FIRST(&srv.clients)->sock;
+        cl_assert_equal_i(http_server_pop_client(&srv, sock), HTTP_SERVER_OK);
+        close(sock);
+        n--;
+    }
+    cl_assert_equal_i(n, -1);
+    for (i = 0; i < 4; ++i)
+    {
+        close(conns[i]);
+    }
+    cl_assert_equal_i(http_server_cancel(&srv), HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.sock_listen, HTTP_SERVER_INVALID_SOCKET);
+    // Socket file is removed
+    cl_assert(access(path, F_OK) == -1);
+}
+
+static int _count_closes(http_server_socket_t sock, void * arg)
+{
+    (*(int *)arg)++;
+    return close(sock) == 0 ? HTTP_SERVER_OK : HTTP_SERVER_SOCKET_ERROR;
+}
+
+void test_test_http_server__max_connections(void)
+{
+    int closes = 0;
+    cl_assert_equal_i(http_server_add_listener(&srv, HTTP_SERVER_LISTENER_INET, "127.0.0.1", 0L, -1L, -1L), HTTP_SERVER_INVALID_PARAM);
+    cl_assert_equal_i(http_server_add_listener(&srv, HTTP_SERVER_LISTENER_INET, "127.0.0.1", 0L, -1L, 1L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_RETRY_AFTER, 5L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_CLOSE_SOCKET_FUNCTION, &_count_closes), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_CLOSE_SOCKET_DATA, &closes), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_start(&srv), HTTP_SERVER_OK);
+    int conns[2];
+    connect_clients(srv.sock_listen, conns, 2);
+    // Request of the rejected client is already waiting to be read
+    const char * request = "GET / HTTP/1.1\r\n\r\n";
+    int i;
+    for (i = 0; i < 2; ++i)
+    {
+        cl_assert_equal_i(write(conns[i], request, strlen(request)), strlen(request));
+    }
+    cl_assert_equal_i(http_server_socket_action(&srv, srv.sock_listen, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.connections_, 1);
+    cl_assert_equal_i(closes, 1);
+    cl_assert_equal_i(SLIST_FIRST(&srv.listeners)->connections_, 1);
+    // Second connection is turned away without reaching the handler
+    const char * expected = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 5\r\nContent-Length: 20\r\nConnection: close\r\n\r\nService Unavailable\n";
+    char data[256];
+    read_all(conns[1], data, sizeof(data));
+    cl_assert_equal_s(data, expected);
+    int sock = SLIST_FIRST(&srv.clients)->sock;
+    cl_assert_equal_i(http_server_pop_client(&srv, sock), HTTP_SERVER_OK);
+    close(sock);
+    cl_assert_equal_i(srv.connections_, 0);
+    cl_assert_equal_i(SLIST_FIRST(&srv.listeners)->connections_, 0);
+    close_clients(conns, 2);
+    cl_assert_equal_i(http_server_cancel(&srv), HTTP_SERVER_OK);
+}
+
+static int respond_message_complete(http_server_client * client, void * data)
+{
+    http_server_response * res = http_server_response_acquire(client);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    return http_server_response_end(res);
+}
+
+/**
+ * Send a request and read the response to it
+ */
+static void request_response(int conn, http_server_client * client, char * data, int size)
+{
+    const char * request = "GET / HTTP/1.1\r\n\r\n";
+    cl_assert_equal_i(write(conn, request, strlen(request)), strlen(request));
+    cl_assert_equal_i(http_server_socket_action(&srv, client->sock, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_socket_action(&srv, client->sock, HTTP_SERVER_POLL_OUT), HTTP_SERVER_OK);
+    int n = read(conn, data, size - 1);
+    cl_assert(n > 0);
+    data[n] = '\0';
+}
+
+void test_test_http_server__rate_limit(void)
+{
+    http_server_handler handler;
+    http_server_handler_init(&handler);
+    handler.on_message_complete = &respond_message_complete;
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_HANDLER, &handler), HTTP_SERVER_OK);
+    listen_on_loopback();
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_RATE_LIMIT, 1L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_start(&srv), HTTP_SERVER_OK);
+    int conns[2];
+    connect_clients(srv.sock_listen, conns, 2);
+    cl_assert_equal_i(http_server_socket_action(&srv, srv.sock_listen, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.connections_, 1);
+    http_server_client * client = SLIST_FIRST(&srv.clients);
+    cl_assert_equal_i(client->has_addr_, 1);
+    cl_assert_equal_i(client->addr_[12], 127);
+    cl_assert_equal_i(client->addr_[15], 1);
+    // Second connection from the same address is over the limit
+    char data[256];
+    read_all(conns[1], data, sizeof(data));
+    cl_assert(strncmp(data, "HTTP/1.1 429 Too Many Requests\r\n", 32) == 0);
+    // Token taken at accept pays for the first request
+    request_response(conns[0], client, data, sizeof(data));
+    cl_assert(strncmp(data, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    request_response(conns[0], client, data, sizeof(data));
+    cl_assert(strncmp(data, "HTTP/1.1 429 Too Many Requests\r\n", 32) == 0);
+    int sock = client->sock;
+    cl_assert_equal_i(http_server_pop_client(&srv, sock), HTTP_SERVER_OK);
+    close(sock);
+    close_clients(conns, 2);
+    cl_assert_equal_i(http_server_cancel(&srv), HTTP_SERVER_OK);
+}
+
+/**
+ * Find server side of a connection
+ */
+static int listener_polls;
+
+static int _count_listener_polls(void * clientp, http_server_socket_t sock, int flags, void * socketp)
+{
+    (void)clientp;
+    (void)socketp;
+    if (sock == srv.sock_listen && flags & HTTP_SERVER_POLL_IN)
+    {
+        listener_polls++;
+    }
+    return HTTP_SERVER_OK;
+}
+
+void test_test_http_server__accept_out_of_descriptors(void)
+{
+    listen_on_loopback();
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_SOCKET_FUNCTION, &_count_listener_polls), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_start(&srv), HTTP_SERVER_OK);
+    int conn;
+    connect_clients(srv.sock_listen, &conn, 1);
+    // No descriptor is left for the accepted connection
+    struct rlimit rl, lowered;
+    cl_assert(getrlimit(RLIMIT_NOFILE, &rl) != -1);
+    int fd = dup(conn);
+    cl_assert(fd != -1);
+    close(fd);
+    lowered = rl;
+    lowered.rlim_cur = fd;
+    cl_assert(setrlimit(RLIMIT_NOFILE, &lowered) != -1);
+    listener_polls = 0;
+    int r = http_server_socket_action(&srv, srv.sock_listen, HTTP_SERVER_POLL_IN);
+    cl_assert(setrlimit(RLIMIT_NOFILE, &rl) != -1);
+    cl_assert_equal_i(r, HTTP_SERVER_OK);
+    cl_assert(SLIST_EMPTY(&srv.clients));
+    // Listener is not polled again until the pause is over
+    cl_assert_equal_i(listener_polls, 0);
+    cl_assert(srv.accept_timer_.is_active_);
+    cl_assert_equal_i(http_server_run(&srv), HTTP_SERVER_OK);
+    cl_assert_equal_i(listener_polls, 1);
+    cl_assert_equal_i(http_server_socket_action(&srv, srv.sock_listen, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    cl_assert(!SLIST_EMPTY(&srv.clients));
+    close(conn);
+    cl_assert_equal_i(http_server_cancel(&srv), HTTP_SERVER_OK);
+}
+
+static http_server_client * find_client(int conn)
+{
+    struct sockaddr_in local, peer;
+    socklen_t len = sizeof(local);
+    cl_assert(getsockname(conn, (struct sockaddr *)&local, &len) != -1);
+    http_server_client * client;
+    SLIST_FOREACH(client, &srv.clients, next)
+    {
+        len = sizeof(peer);
+        cl_assert(getpeername(client->sock, (struct sockaddr *)&peer, &len) != -1);
+        if (peer.sin_port == local.sin_port)
+        {
+            return client;
+        }
+    }
+    return NULL;
+}
+
+static http_server_response * drain_response;
+static http_server_client * drain_deferred;
+
+/**
+ * Start the first response right away and leave the next request
+ * without a response
+ */
+static int drain_message_complete(http_server_client * client, void * data)
+{
+    if (!drain_response)
+    {
+        drain_response = http_server_response_acquire(client);
+    }
+    else
+    {
+        drain_deferred = client;
+    }
+    return 0;
+}
+
+void test_test_http_server__drain(void)
+{
+    http_server_handler handler;
+    http_server_handler_init(&handler);
+    handler.on_message_complete = &drain_message_complete;
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_HANDLER, &handler), HTTP_SERVER_OK);
+    listen_on_loopback();
+    cl_assert_equal_i(http_server_start(&srv), HTTP_SERVER_OK);
+    drain_response = NULL;
+    drain_deferred = NULL;
+    // Active, idle, in the middle of a request and waiting for the handler
+    int conns[4];
+    connect_clients(srv.sock_listen, conns, 4);
+    cl_assert_equal_i(http_server_socket_action(&srv, srv.sock_listen, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    http_server_client * active = find_client(conns[0]);
+    http_server_client * partial = find_client(conns[2]);
+    http_server_client * deferred = find_client(conns[3]);
+    cl_assert(active && partial && deferred);
+    const char * request = "GET / HTTP/1.1\r\n\r\n";
+    cl_assert_equal_i(write(conns[0], request, strlen(request)), strlen(request));
+    cl_assert_equal_i(http_server_socket_action(&srv, active->sock, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    cl_assert(!!drain_response);
+    cl_assert_equal_i(write(conns[3], request, strlen(request)), strlen(request));
+    cl_assert_equal_i(http_server_socket_action(&srv, deferred->sock, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    cl_assert(drain_deferred == deferred);
+    cl_assert_equal_i(write(conns[2], request, 5), 5);
+    cl_assert_equal_i(http_server_socket_action(&srv, partial->sock, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_drain(&srv, 50L), HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.sock_listen, HTTP_SERVER_INVALID_SOCKET);
+    // Idle connection is closed right away
+    char data[512];
+    cl_assert_equal_i(read(conns[1], data, sizeof(data)), 0);
+    cl_assert_equal_i(srv.connections_, 3);
+    cl_assert_equal_i(active->is_closing_, 1);
+    cl_assert_equal_i(deferred->is_closing_, 1);
+    cl_assert(srv.drain_timer_.is_active_);
+    // Active connection is closed after its response
+    cl_assert_equal_i(http_server_response_write_head(drain_response, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_end(drain_response), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_socket_action(&srv, active->sock, HTTP_SERVER_POLL_OUT), HTTP_SERVER_CLIENT_EOF);
+    read_all(conns[0], data, sizeof(data));
+    cl_assert(strstr(data, "HTTP/1.1 200 OK\r\n") == data);
+    cl_assert(strstr(data, "Connection: close\r\n"));
+    // Handler can still answer a request read before the drain
+    http_server_response * res = http_server_response_acquire(deferred);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_end(res), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_socket_action(&srv, deferred->sock, HTTP_SERVER_POLL_OUT), HTTP_SERVER_CLIENT_EOF);
+    read_all(conns[3], data, sizeof(data));
+    cl_assert(strstr(data, "HTTP/1.1 200 OK\r\n") == data);
+    cl_assert(strstr(data, "Connection: close\r\n"));
+    // Unfinished request is cut off by the deadline
+    cl_assert_equal_i(http_server_run(&srv), HTTP_SERVER_OK);
+    cl_assert(SLIST_EMPTY(&srv.clients));
+    cl_assert_equal_i(srv.connections_, 0);
+    cl_assert_equal_i(read(conns[2], data, sizeof(data)), 0);
+    close_clients(conns, 4);
+}
+
+void test_test_http_server__stream_not_corked(void)
+{
+    http_server_handler handler;
+    http_server_handler_init(&handler);
+    handler.on_message_complete = &drain_message_complete;
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_HANDLER, &handler), HTTP_SERVER_OK);
+    listen_on_loopback();
+    cl_assert_equal_i(http_server_start(&srv), HTTP_SERVER_OK);
+    drain_response = NULL;
+    int conn;
+    connect_clients(srv.sock_listen, &conn, 1);
+    cl_assert_equal_i(http_server_socket_action(&srv, srv.sock_listen, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    http_server_client * client = find_client(conn);
+    cl_assert(!!client);
+    const char * request = "GET / HTTP/1.1\r\n\r\n";
+    cl_assert_equal_i(write(conn, request, strlen(request)), strlen(request));
+    cl_assert_equal_i(http_server_socket_action(&srv, client->sock, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    cl_assert(!!drain_response);
+    // Chunk of a response that is not finished arrives without waiting
+    // for the rest
+    cl_assert_equal_i(http_server_response_write_head(drain_response, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write(drain_response, "Hello", 5), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_socket_action(&srv, client->sock, HTTP_SERVER_POLL_OUT), HTTP_SERVER_OK);
+    struct pollfd pfd;
+    pfd.fd = conn;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    cl_assert_equal_i(poll(&pfd, 1, 50), 1);
+    char data[256];
+    int n = read(conn, data, sizeof(data) - 1);
+    cl_assert(n > 0);
+    data[n] = '\0';
+    cl_assert(strstr(data, "5\r\nHello\r\n"));
+    cl_assert_equal_i(http_server_response_end(drain_response), HTTP_SERVER_OK);
+    int sock = client->sock;
+    cl_assert_equal_i(http_server_pop_client(&srv, sock), HTTP_SERVER_OK);
+    close(sock);
+    close(conn);
+    cl_assert_equal_i(http_server_cancel(&srv), HTTP_SERVER_OK);
+}
+
+void test_test_http_server__handoff(void)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/http-server-handoff-%d.sock", (int)getpid());
+    cl_assert_equal_i(http_server_add_listener(&srv, HTTP_SERVER_LISTENER_INET, "127.0.0.1", 0L, -1L, 0L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_add_listener(&srv, HTTP_SERVER_LISTENER_UNIX, path, 0L, -1L, 0L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_start(&srv), HTTP_SERVER_OK);
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    cl_assert(getsockname(srv.sock_listen, (struct sockaddr *)&sin, &len) != -1);
+    int channel[2];
+    cl_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, channel) != -1);
+    cl_assert_equal_i(http_server_send_listeners(&srv, channel[0]), HTTP_SERVER_OK);
+    http_server successor;
+    cl_assert_equal_i(http_server_init(&successor), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_receive_listeners(&successor, channel[1]), HTTP_SERVER_OK);
+    // Predecessor stops listening without removing the socket file
+    cl_assert_equal_i(http_server_drain(&srv, 0L), HTTP_SERVER_OK);
+    cl_assert(access(path, F_OK) == 0);
+    http_server_listener * listener = SLIST_FIRST(&successor.listeners);
+    cl_assert(!!listener);
+    cl_assert_equal_i(listener->family, HTTP_SERVER_LISTENER_INET);
+    cl_assert_equal_i(listener->port, ntohs(sin.sin_port));
+    cl_assert_equal_i(SLIST_NEXT(listener, next)->family, HTTP_SERVER_LISTENER_UNIX);
+    cl_assert(!SLIST_NEXT(SLIST_NEXT(listener, next), next));
+    cl_assert_equal_i(http_server_start(&successor), HTTP_SERVER_OK);
+    cl_assert_equal_i(successor.sock_listen, listener->sock);
+    // Connections to the same port are accepted by the successor
+    int conn;
+    connect_clients(successor.sock_listen, &conn, 1);
+    cl_assert_equal_i(http_server_socket_action(&successor, successor.sock_listen, HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    cl_assert(!SLIST_EMPTY(&successor.clients));
+    int sock = SLIST_FIRST(&successor.clients)->sock;
+    cl_assert_equal_i(http_server_pop_client(&successor, sock), HTTP_SERVER_OK);
+    close(sock);
+    close(conn);
+    cl_assert_equal_i(http_server_cancel(&successor), HTTP_SERVER_OK);
+    http_server_free(&successor);
+    unlink(path);
+    close(channel[0]);
+    close(channel[1]);
+}
+
 void test_test_http_server__manage_clients(void)
 {
     int r;
@@ -128,4 +752,198 @@ void test_test_http_server__manage_clients(void)
 
     r = http_server_pop_client(&srv, 300);
     cl_assert_equal_i(r, HTTP_SERVER_INVALID_SOCKET);
-}
\ No newline at end of file
+}
+
+void test_test_http_server__header_timeout(void)
+{
+    int fds[2];
+    cl_assert(socketpair(PF_LOCAL, SOCK_STREAM, 0, fds) != -1);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_HEADER_TIMEOUT, 1L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_add_client(&srv, fds[0]), HTTP_SERVER_OK);
+    http_server_client * client = SLIST_FIRST(&srv.clients);
+    cl_assert(!!client);
+    cl_assert_equal_i(client->timeout_timer_.is_active_, 1);
+    usleep(10000);
+    // Client did not send anything so it is disconnected and the loop
+    // has nothing more to do.
+    cl_assert_equal_i(http_server_run(&srv), HTTP_SERVER_OK);
+    cl_assert(SLIST_EMPTY(&srv.clients));
+    char c;
+    cl_assert_equal_i(read(fds[1], &c, 1), 0);
+    close(fds[1]);
+}
+
+void test_test_http_server__half_close(void)
+{
+    http_server_handler handler;
+    http_server_handler_init(&handler);
+    handler.on_message_complete = &drain_message_complete;
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_HANDLER, &handler), HTTP_SERVER_OK);
+    drain_response = NULL;
+    int fds[2];
+    cl_assert(socketpair(PF_LOCAL, SOCK_STREAM, 0, fds) != -1);
+    cl_assert_equal_i(http_server_add_client(&srv, fds[0]), HTTP_SERVER_OK);
+    http_server_client * client = SLIST_FIRST(&srv.clients);
+    // Both requests are read before the handler responds to either
+    const char * requests = "GET /a HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\n\r\n";
+    cl_assert_equal_i(write(fds[1], requests, strlen(requests)), strlen(requests));
+    cl_assert(shutdown(fds[1], SHUT_WR) != -1);
+    cl_assert_equal_i(http_server_socket_action(&srv, fds[0], HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_socket_action(&srv, fds[0], HTTP_SERVER_POLL_IN), HTTP_SERVER_OK);
+    cl_assert(SLIST_FIRST(&srv.clients) == client);
+    cl_assert_equal_i(client->is_closing_, 1);
+    cl_assert_equal_i(client->pipeline_len_, 2);
+    cl_assert_equal_i(http_server_response_write_head(drain_response, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_end(drain_response), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_socket_action(&srv, fds[0], HTTP_SERVER_POLL_OUT), HTTP_SERVER_OK);
+    // Connection stays open for the response that is not started yet
+    cl_assert(drain_deferred == client);
+    http_server_response * res = http_server_response_acquire(client);
+    cl_assert_equal_i(http_server_response_write_head(res, 204), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_end(res), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_socket_action(&srv, fds[0], HTTP_SERVER_POLL_OUT), HTTP_SERVER_CLIENT_EOF);
+    cl_assert(SLIST_EMPTY(&srv.clients));
+    char data[512];
+    read_all(fds[1], data, sizeof(data));
+    cl_assert(strstr(data, "HTTP/1.1 200 OK\r\n") == data);
+    cl_assert(strstr(data, "HTTP/1.1 204 No Content\r\n"));
+    close(fds[1]);
+}
+
+void test_test_http_server__timeout_after_idle(void)
+{
+    int fds[2];
+    cl_assert(socketpair(PF_LOCAL, SOCK_STREAM, 0, fds) != -1);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_HEADER_TIMEOUT, 1000L), HTTP_SERVER_OK);
+    // Loop time is left behind by a long sleep with nothing to do
+    srv.timers_.now = srv.timers_.now > 2000 ? srv.timers_.now - 2000 : 0;
+    cl_assert_equal_i(http_server_add_client(&srv, fds[0]), HTTP_SERVER_OK);
+    http_server_client * client = SLIST_FIRST(&srv.clients);
+    cl_assert_equal_i(client->timeout_timer_.is_active_, 1);
+    // Deadline is counted from the time the client arrived
+    (void)http_server_timer_timeout(&srv);
+    cl_assert(client->timeout_timer_.expires_ > srv.timers_.now + 500);
+    cl_assert_equal_i(http_server_pop_client(&srv, fds[0]), HTTP_SERVER_OK);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static int _timer_callback(http_server * s, http_server_timer * timer, void * data)
+{
+    int * counter = data;
+    (*counter)++;
+    if (timer->repeat_ && *counter == 3)
+    {
+        cl_assert_equal_i(http_server_timer_stop(s, timer), HTTP_SERVER_OK);
+    }
+    return HTTP_SERVER_OK;
+}
+
+void test_test_http_server__timers(void)
+{
+    http_server_timer oneshot, repeating;
+    int oneshot_count = 0, repeating_count = 0;
+    cl_assert_equal_i(http_server_timer_init(&oneshot, &_timer_callback, &oneshot_count), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_timer_init(&repeating, &_timer_callback, &repeating_count), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_timer_timeout(&srv), -1);
+    cl_assert_equal_i(http_server_timer_start(&srv, &oneshot, -1L, 0L), HTTP_SERVER_INVALID_PARAM);
+    cl_assert_equal_i(http_server_timer_start(&srv, &oneshot, 5L, 0L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_timer_start(&srv, &repeating, 2L, 2L), HTTP_SERVER_OK);
+    long timeout = http_server_timer_timeout(&srv);
+    cl_assert(timeout >= 0 && timeout <= 2);
+    // Loop keeps running while there are timers armed
+    cl_assert_equal_i(http_server_run(&srv), HTTP_SERVER_OK);
+    cl_assert_equal_i(oneshot_count, 1);
+    cl_assert_equal_i(repeating_count, 3);
+    cl_assert_equal_i(oneshot.is_active_, 0);
+    cl_assert_equal_i(repeating.is_active_, 0);
+    cl_assert_equal_i(http_server_timer_timeout(&srv), -1);
+    // External event loop runs expired timers itself
+    cl_assert_equal_i(http_server_timer_start(&srv, &oneshot, 1L, 0L), HTTP_SERVER_OK);
+    usleep(5000);
+    cl_assert_equal_i(http_server_timer_run(&srv), HTTP_SERVER_OK);
+    cl_assert_equal_i(oneshot_count, 2);
+    cl_assert_equal_i(oneshot.is_active_, 0);
+    cl_assert_equal_i(http_server_timer_run(NULL), HTTP_SERVER_INVALID_PARAM);
+}
+
+static int log_messages;
+static int log_kind;
+
+static int _log_function(int kind, char * data, int length, void * userp)
+{
+    log_messages++;
+    log_kind = kind;
+    cl_assert_equal_i(length, (int)strlen(data));
+    return HTTP_SERVER_OK;
+}
+
+void test_test_http_server__log(void)
+{
+    http_server_log_ring ring;
+    cl_assert_equal_i(http_server_log_ring_init(&ring, 8), HTTP_SERVER_INVALID_PARAM);
+    cl_assert_equal_i(http_server_log_ring_init(&ring, 100), HTTP_SERVER_OK);
+    cl_assert_equal_i(ring.size, 128);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_LOG_LEVEL, 6L), HTTP_SERVER_INVALID_PARAM);
+    // Nothing is formatted without a sink
+    cl_assert_equal_i(srv.log_threshold_, 0);
+    log_messages = 0;
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_DEBUG_FUNCTION, &_log_function), HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.log_threshold_, HTTP_SERVER_LOG_DEBUG);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_LOG_RING, &ring), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_LOG_CATEGORIES, (long)HTTP_SERVER_LOG_SERVER), HTTP_SERVER_OK);
+    listen_on_loopback();
+    cl_assert_equal_i(http_server_start(&srv), HTTP_SERVER_OK);
+    cl_assert_equal_i(log_messages, 0);
+    cl_assert_equal_i(http_server_cancel(&srv), HTTP_SERVER_OK);
+    // Opening socket is logged in socket category
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_LOG_CATEGORIES, (long)HTTP_SERVER_LOG_ALL), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_start(&srv), HTTP_SERVER_OK);
+    cl_assert_equal_i(log_messages, 1);
+    cl_assert_equal_i(log_kind, HTTP_SERVER_LOG_DEBUG);
+    http_server_log_record record;
+    char buffer[64];
+    cl_assert_equal_i(http_server_log_ring_read(&ring, &record, buffer, sizeof(buffer)), 1);
+    cl_assert_equal_i(record.level, HTTP_SERVER_LOG_DEBUG);
+    cl_assert_equal_i(record.category, HTTP_SERVER_LOG_SOCKET);
+    cl_assert(record.time > 0);
+    char expected[64];
+    snprintf(expected, sizeof(expected), "open socket: %d", srv.sock_listen);
+    cl_assert_equal_s(buffer, expected);
+    cl_assert_equal_i(http_server_log_ring_read(&ring, &record, buffer, sizeof(buffer)), 0);
+    cl_assert_equal_i(http_server_cancel(&srv), HTTP_SERVER_OK);
+    cl_assert_equal_i(log_messages, 2);
+    cl_assert_equal_i(http_server_log_ring_read(&ring, &record, buffer, sizeof(buffer)), 1);
+    cl_assert_equal_i(record.category, HTTP_SERVER_LOG_EVENT);
+    // Debug messages are below info level
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_LOG_LEVEL, (long)HTTP_SERVER_LOG_INFO), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_start(&srv), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_cancel(&srv), HTTP_SERVER_OK);
+    cl_assert_equal_i(log_messages, 2);
+    cl_assert_equal_i(http_server_log_ring_read(&ring, &record, buffer, sizeof(buffer)), 0);
+    // Records wrap around the ring and ones that do not fit are dropped
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_DEBUG_FUNCTION, NULL), HTTP_SERVER_OK);
+    int i;
+    for (i = 0; i < 10; ++i)
+    {
+        http_server__log(&srv, HTTP_SERVER_LOG_INFO, HTTP_SERVER_LOG_CLIENT, "message %d", i);
+        if (i % 3 == 2)
+        {
+            cl_assert_equal_i(http_server_log_ring_read(&ring, &record, buffer, sizeof(buffer)), 1);
+            snprintf(expected, sizeof(expected), "message %d", i - 2);
+            cl_assert_equal_s(buffer, expected);
+            cl_assert_equal_i(http_server_log_ring_read(&ring, &record, buffer, sizeof(buffer)), 1);
+            cl_assert_equal_i(http_server_log_ring_read(&ring, &record, buffer, sizeof(buffer)), 1);
+            cl_assert_equal_i(ring.dropped, 0);
+        }
+    }
+    http_server__log(&srv, HTTP_SERVER_LOG_INFO, HTTP_SERVER_LOG_CLIENT, "%s", "this message is too long to fit in the ring next to the other one that is already there");
+    cl_assert_equal_i(ring.dropped, 1);
+    cl_assert_equal_i(http_server_log_ring_read(&ring, &record, buffer, 4), 1);
+    cl_assert_equal_s(buffer, "mes");
+    cl_assert_equal_i(record.length, 9);
+    cl_assert_equal_i(http_server_log_ring_read(&ring, &record, buffer, sizeof(buffer)), 0);
+    cl_assert_equal_i(http_server_setopt(&srv, HTTP_SERVER_OPT_LOG_RING, NULL), HTTP_SERVER_OK);
+    cl_assert_equal_i(srv.log_threshold_, 0);
+    http_server_log_ring_free(&ring);
+}
@@ -1,9 +1,11 @@
 #include "clar.h"
 #include "http-server/http-server.h"
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <time.h>
 
 const char * content_length = "Content-Length";
 
@@ -12,21 +14,87 @@ http_server server;
 http_server_handler handler;
 http_server_client * client;
 
+/**
+ * Check `n`-th live response header
+ */
+static void assert_header(http_server_response * res, int n, const char * name, const char * value)
+{
+    int i;
+    for (i = 0; i < res->headers_len; ++i)
+    {
+        http_server_response_header * header = &res->headers[i];
+        if (!header->name_len || n--)
+        {
+            continue;
+        }
+        const char * data = res->header_data_.buf + header->off;
+        cl_assert_equal_i(header->name_len, strlen(name));
+        cl_assert(strncmp(data, name, header->name_len) == 0);
+        cl_assert_equal_i(header->value_len, strlen(value));
+        cl_assert(strncmp(data + header->name_len + 2, value, header->value_len) == 0);
+        return;
+    }
+    cl_fail("Header not found");
+}
+
+static int live_headers(http_server_response * res)
+{
+    int i, n = 0;
+    for (i = 0; i < res->headers_len; ++i)
+    {
+        n += res->headers[i].name_len > 0;
+    }
+    return n;
+}
+
+// Position of `assert_buf` in current buffer
+static int buf_offset;
+
+/**
+ * Check next bytes of the output queue. Small writes are coalesced so
+ * expected data might span multiple buffers or only a part of one.
+ */
+static void assert_buf(struct http_server_buf ** buf, const char * expected)
+{
+    int len = strlen(expected);
+    while (len > 0)
+    {
+        cl_assert(!!*buf);
+        int n = (*buf)->size - buf_offset;
+        if (n > len)
+        {
+            n = len;
+        }
+        cl_assert_equal_i(memcmp((*buf)->data + buf_offset, expected, n), 0);
+        expected += n;
+        len -= n;
+        buf_offset += n;
+        if (buf_offset == (*buf)->size)
+        {
+            *buf = TAILQ_NEXT(*buf, bufs);
+            buf_offset = 0;
+        }
+    }
+}
+
 void test_test_response__initialize(void)
 {
     int r = socketpair(PF_LOCAL, SOCK_STREAM, 0, client_fds);
     if (r == -1) cl_fail("unable to create socketpair");
 
     http_server_init(&server);
+    // Responses are compared byte by byte
+    http_server_setopt(&server, HTTP_SERVER_OPT_DATE_HEADER, 0L);
     http_server_handler_init(&handler);
     client = http_server_new_client(&server, client_fds[0], &handler);
+    buf_offset = 0;
 }
 
 void test_test_response__cleanup(void)
 {
+    http_server_client_free(client);
     http_server_free(&server);
     //http_server_handler_free(&server);
-    http_server_client_free(client);
     close(client_fds[0]);
     close(client_fds[1]);
 }
@@ -42,17 +110,10 @@ void http_response_write_head_test(int code, const char * message)
     sprintf(expected, "HTTP/1.1 %d %s\r\n", code, message);
 
     struct http_server_buf * buf = TAILQ_FIRST(&client->buffer);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, expected);
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "Transfer-Encoding: chunked\r\n");
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "\r\n");
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "0\r\n\r\n");
+    assert_buf(&buf, expected);
+    assert_buf(&buf, "Transfer-Encoding: chunked\r\n");
+    assert_buf(&buf, "\r\n");
+    assert_buf(&buf, "0\r\n\r\n");
     http_server_response_free(res);
 }
 
@@ -156,30 +217,16 @@ void test_test_response__without_chunked_response(void)
     cl_assert_equal_i(http_server_response_begin(client, res), HTTP_SERVER_OK);
     // by default http response is chunked
     cl_assert_equal_i(res->is_chunked, 1);
-    cl_assert(!TAILQ_EMPTY(&res->headers));
     // check if there is only one header and its chunked encoding
-    struct http_server_header * header = TAILQ_FIRST(&res->headers);
-    cl_assert(!!header);
-    cl_assert_equal_s(http_server_string_str(&header->field), "Transfer-Encoding");
-    cl_assert_equal_s(http_server_string_str(&header->value), "chunked");
-    header = TAILQ_NEXT(header, headers);
-    cl_assert(!header); // no more headers
+    cl_assert_equal_i(live_headers(res), 1);
+    assert_header(res, 0, "Transfer-Encoding", "chunked");
     // now siwtch to content-length and chunked encoding should be gone
     cl_assert_equal_i(http_server_response_set_header(res, "Key0", 4, "Value0", 6), HTTP_SERVER_OK);
     cl_assert_equal_i(res->is_chunked, 1);
     // find content-length
-    cl_assert(!TAILQ_EMPTY(&res->headers));
-    // check if there is only one header and its chunked encoding
-    header = TAILQ_FIRST(&res->headers);
-    cl_assert(!!header);
-    cl_assert_equal_s(http_server_string_str(&header->field), "Transfer-Encoding");
-    cl_assert_equal_s(http_server_string_str(&header->value), "chunked");
-    header = TAILQ_NEXT(header, headers);
-    cl_assert(!!header);
-    cl_assert_equal_s(http_server_string_str(&header->field), "Key0");
-    cl_assert_equal_s(http_server_string_str(&header->value), "Value0");
-    header = TAILQ_NEXT(header, headers);
-    cl_assert(!header);
+    cl_assert_equal_i(live_headers(res), 2);
+    assert_header(res, 0, "Transfer-Encoding", "chunked");
+    assert_header(res, 1, "Key0", "Value0");
     // write some data to flush headers
     cl_assert_equal_i(res->headers_sent, 0);
     http_server_response_write_head(res, 200);
@@ -188,30 +235,16 @@ void test_test_response__without_chunked_response(void)
     http_server_response_end(res);
     // headers are fluhsed
     cl_assert_equal_i(res->headers_sent, 1);
-    cl_assert(TAILQ_EMPTY(&res->headers));
+    cl_assert_equal_i(live_headers(res), 0);
     // check for buffer frames
     struct http_server_buf * buf = TAILQ_FIRST(&client->buffer);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "HTTP/1.1 200 OK\r\n");
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "Transfer-Encoding: chunked\r\n");
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "Key0: Value0\r\n");
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "\r\n");
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "c\r\nHello world!\r\n");
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "11\r\nHello world 1234!\r\n");
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "0\r\n\r\n");
-    buf = TAILQ_NEXT(buf, bufs);
+    assert_buf(&buf, "HTTP/1.1 200 OK\r\n");
+    assert_buf(&buf, "Transfer-Encoding: chunked\r\n");
+    assert_buf(&buf, "Key0: Value0\r\n");
+    assert_buf(&buf, "\r\n");
+    assert_buf(&buf, "c\r\nHello world!\r\n");
+    assert_buf(&buf, "11\r\nHello world 1234!\r\n");
+    assert_buf(&buf, "0\r\n\r\n");
     cl_assert(!buf);
     // check again if something didnt changed
     cl_assert_equal_i(res->is_chunked, 1);
@@ -230,32 +263,18 @@ void test_test_response__with_content_length(void)
     cl_assert_equal_i(http_server_response_begin(client, res), HTTP_SERVER_OK);
     // by default http response is chunked
     cl_assert_equal_i(res->is_chunked, 1);
-    cl_assert(!TAILQ_EMPTY(&res->headers));
     // check if there is only one header and its chunked encoding
-    struct http_server_header * header = TAILQ_FIRST(&res->headers);
-    cl_assert(!!header);
-    cl_assert_equal_s(http_server_string_str(&header->field), "Transfer-Encoding");
-    cl_assert_equal_s(http_server_string_str(&header->value), "chunked");
-    header = TAILQ_NEXT(header, headers);
-    cl_assert(!header); // no more headers
+    cl_assert_equal_i(live_headers(res), 1);
+    assert_header(res, 0, "Transfer-Encoding", "chunked");
     // now siwtch to content-length and chunked encoding should be gone
     cl_assert_equal_i(http_server_response_set_header(res, (char*)content_length, strlen(content_length), "123", 3), HTTP_SERVER_OK);
     cl_assert_equal_i(http_server_response_set_header(res, "Key0", 4, "Value0", 6), HTTP_SERVER_OK);
 
     cl_assert_equal_i(res->is_chunked, 0);
     // find content-length
-    cl_assert(!TAILQ_EMPTY(&res->headers));
-    // check if there is only one header and its chunked encoding
-    header = TAILQ_FIRST(&res->headers);
-    cl_assert(!!header);
-    cl_assert_equal_s(http_server_string_str(&header->field), content_length);
-    cl_assert_equal_s(http_server_string_str(&header->value), "123");
-    header = TAILQ_NEXT(header, headers);
-    cl_assert(!!header);
-    cl_assert_equal_s(http_server_string_str(&header->field), "Key0");
-    cl_assert_equal_s(http_server_string_str(&header->value), "Value0");
-    header = TAILQ_NEXT(header, headers);
-    cl_assert(!header);
+    cl_assert_equal_i(live_headers(res), 2);
+    assert_header(res, 0, content_length, "123");
+    assert_header(res, 1, "Key0", "Value0");
     // write some data to flush headers
     cl_assert_equal_i(res->headers_sent, 0);
     http_server_response_write_head(res, 200);
@@ -263,28 +282,588 @@ void test_test_response__with_content_length(void)
     http_server_response_printf(res, "Hello world %d!", 1234);
     // headers are fluhsed
     cl_assert_equal_i(res->headers_sent, 1);
-    cl_assert(TAILQ_EMPTY(&res->headers));
+    cl_assert_equal_i(live_headers(res), 0);
     // check for buffer frames
     struct http_server_buf * buf = TAILQ_FIRST(&client->buffer);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "HTTP/1.1 200 OK\r\n");
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "Content-Length: 123\r\n");
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "Key0: Value0\r\n");
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "\r\n");
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "Hello world!");
-    buf = TAILQ_NEXT(buf, bufs);
-    cl_assert(!!buf);
-    cl_assert_equal_s(buf->data, "Hello world 1234!");
-    buf = TAILQ_NEXT(buf, bufs);
+    assert_buf(&buf, "HTTP/1.1 200 OK\r\n");
+    assert_buf(&buf, "Content-Length: 123\r\n");
+    assert_buf(&buf, "Key0: Value0\r\n");
+    assert_buf(&buf, "\r\n");
+    assert_buf(&buf, "Hello world!");
+    assert_buf(&buf, "Hello world 1234!");
     cl_assert(!buf);
     // all done
     http_server_response_free(res);
 }
+
+void test_test_response__output_watermark(void)
+{
+    server.output_high_watermark = 32;
+    http_server_response * res = http_server_response_new();
+    cl_assert_equal_i(http_server_response_begin(client, res), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write(res, "Hello world!", 12), HTTP_SERVER_OK);
+    cl_assert(client->buffer_size_ >= 32);
+    // Queue is full now
+    cl_assert_equal_i(http_server_response_write(res, "Hello world!", 12), HTTP_SERVER_WOULD_BLOCK);
+    cl_assert_equal_i(client->wants_writable_, 1);
+    // Response can still be finished
+    cl_assert_equal_i(http_server_response_end(res), HTTP_SERVER_OK);
+    http_server_response_free(res);
+}
+
+void test_test_response__pipelined(void)
+{
+    http_server_response * first = http_server_response_new();
+    http_server_response * second = http_server_response_new();
+    cl_assert_equal_i(http_server_response_begin(client, first), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_begin(client, second), HTTP_SERVER_OK);
+    // Second response is finished first but it has to wait
+    cl_assert_equal_i(http_server_response_write_head(second, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write(second, "two", 3), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_end(second), HTTP_SERVER_OK);
+    cl_assert(TAILQ_EMPTY(&client->buffer));
+    cl_assert(second->pending_size_ > 0);
+    cl_assert_equal_i(http_server_response_write_head(first, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write(first, "one", 3), HTTP_SERVER_OK);
+    cl_assert(second->pending_size_ > 0);
+    cl_assert_equal_i(http_server_response_end(first), HTTP_SERVER_OK);
+    cl_assert_equal_i(second->pending_size_, 0);
+    struct http_server_buf * buf = TAILQ_FIRST(&client->buffer);
+    assert_buf(&buf, "HTTP/1.1 200 OK\r\n");
+    assert_buf(&buf, "Transfer-Encoding: chunked\r\n");
+    assert_buf(&buf, "\r\n");
+    assert_buf(&buf, "3\r\none\r\n");
+    assert_buf(&buf, "0\r\n\r\n");
+    assert_buf(&buf, "HTTP/1.1 200 OK\r\n");
+    assert_buf(&buf, "Transfer-Encoding: chunked\r\n");
+    assert_buf(&buf, "\r\n");
+    assert_buf(&buf, "3\r\ntwo\r\n");
+    assert_buf(&buf, "0\r\n\r\n");
+    cl_assert(!buf);
+    // Finished responses are released with the client
+}
+
+void test_test_response__buffered(void)
+{
+    server.response_buffer_size = 64;
+    http_server_response * res = http_server_response_new();
+    cl_assert_equal_i(http_server_response_begin(client, res), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write(res, "Hello", 5), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_printf(res, " world %d!", 1234), HTTP_SERVER_OK);
+    // Nothing is sent until the response ends
+    cl_assert(TAILQ_EMPTY(&client->buffer));
+    cl_assert_equal_i(http_server_response_end(res), HTTP_SERVER_OK);
+    struct http_server_buf * buf = TAILQ_FIRST(&client->buffer);
+    assert_buf(&buf, "HTTP/1.1 200 OK\r\nContent-Length: 17\r\n\r\nHello world 1234!");
+    cl_assert(!buf);
+}
+
+void test_test_response__buffered_overflow(void)
+{
+    server.response_buffer_size = 8;
+    http_server_response * res = http_server_response_new();
+    cl_assert_equal_i(http_server_response_begin(client, res), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write(res, "Hello", 5), HTTP_SERVER_OK);
+    cl_assert(TAILQ_EMPTY(&client->buffer));
+    // Too much data to hold so response falls back to chunked encoding
+    cl_assert_equal_i(http_server_response_write(res, " world!", 7), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_end(res), HTTP_SERVER_OK);
+    struct http_server_buf * buf = TAILQ_FIRST(&client->buffer);
+    assert_buf(&buf, "HTTP/1.1 200 OK\r\n");
+    assert_buf(&buf, "Transfer-Encoding: chunked\r\n");
+    assert_buf(&buf, "\r\n");
+    assert_buf(&buf, "5\r\nHello\r\n");
+    assert_buf(&buf, "7\r\n world!\r\n");
+    assert_buf(&buf, "0\r\n\r\n");
+    cl_assert(!buf);
+}
+
+void test_test_response__common_headers(void)
+{
+    cl_assert_equal_i(http_server_setopt(&server, HTTP_SERVER_OPT_DATE_HEADER, 1L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_setopt(&server, HTTP_SERVER_OPT_SERVER_NAME, "test"), HTTP_SERVER_OK);
+    time_t before = time(NULL);
+    http_server_response * res = http_server_response_new();
+    cl_assert_equal_i(http_server_response_begin(client, res), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_end(res), HTTP_SERVER_OK);
+    struct http_server_buf * buf = TAILQ_FIRST(&client->buffer);
+    assert_buf(&buf, "HTTP/1.1 200 OK\r\n");
+    cl_assert(!!buf);
+    // Date: Sun, 06 Nov 1994 08:49:37 GMT
+    const char * date = buf->data + buf_offset;
+    cl_assert_equal_i(strncmp(date, "Date: ", 6), 0);
+    cl_assert_equal_i(strlen("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"), strstr(date, "\r\n") - date + 2);
+    buf_offset += strstr(date, "\r\n") - date + 2;
+    assert_buf(&buf, "Server: test\r\n");
+    assert_buf(&buf, "Transfer-Encoding: chunked\r\n");
+    // Cached text is kept for the second of the Date it contains
+    cl_assert(server.common_headers_time_ >= before && server.common_headers_time_ <= time(NULL));
+}
+
+void test_test_response__set_header(void)
+{
+    http_server_response * res = http_server_response_new();
+    cl_assert_equal_i(http_server_response_begin(client, res), HTTP_SERVER_OK);
+    // Names are case insensitive and set replaces the value
+    cl_assert_equal_i(http_server_response_set_header(res, "X-Key", 5, "first", 5), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_set_header(res, "x-KEY", 5, "second", 6), HTTP_SERVER_OK);
+    cl_assert_equal_i(live_headers(res), 2);
+    assert_header(res, 1, "x-KEY", "second");
+    int len = 0;
+    const char * value = http_server_response_get_header(res, "X-KEY", &len);
+    cl_assert(!!value);
+    cl_assert_equal_i(len, 6);
+    cl_assert(strncmp(value, "second", 6) == 0);
+    // Add keeps previous values
+    cl_assert_equal_i(http_server_response_add_header(res, "Set-Cookie", 10, "a=1", 3), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_add_header(res, "Set-Cookie", 10, "b=2", 3), HTTP_SERVER_OK);
+    cl_assert_equal_i(live_headers(res), 4);
+    // Removing Transfer-Encoding disables chunked encoding
+    cl_assert_equal_i(http_server_response_remove_header(res, "transfer-encoding", 17), HTTP_SERVER_OK);
+    cl_assert_equal_i(res->is_chunked, 0);
+    cl_assert(!http_server_response_get_header(res, "Transfer-Encoding", NULL));
+    cl_assert_equal_i(http_server_response_remove_header(res, "set-cookie", 10), HTTP_SERVER_OK);
+    cl_assert_equal_i(live_headers(res), 1);
+    cl_assert_equal_i(http_server_response_set_header(res, "Transfer-Encoding", 17, "chunked", 7), HTTP_SERVER_OK);
+    cl_assert_equal_i(res->is_chunked, 1);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_end(res), HTTP_SERVER_OK);
+    struct http_server_buf * buf = TAILQ_FIRST(&client->buffer);
+    assert_buf(&buf, "HTTP/1.1 200 OK\r\n");
+    assert_buf(&buf, "x-KEY: second\r\n");
+    assert_buf(&buf, "Transfer-Encoding: chunked\r\n");
+    assert_buf(&buf, "\r\n");
+    assert_buf(&buf, "0\r\n\r\n");
+    cl_assert(!buf);
+}
+
+void test_test_response__prepared(void)
+{
+    const char * headers = "Content-Type: text/plain\r\n";
+    http_server_prepared_response * prepared = http_server_prepared_response_new(200, headers, strlen(headers), "OK", 2);
+    cl_assert(!!prepared);
+    cl_assert(!http_server_prepared_response_new(999, NULL, 0, NULL, 0));
+    http_server_response * first = http_server_response_new();
+    http_server_response * second = http_server_response_new();
+    cl_assert_equal_i(http_server_response_begin(client, first), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_begin(client, second), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_send_prepared(second, prepared), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_send_prepared(first, prepared), HTTP_SERVER_OK);
+    // Both responses share the same memory
+    cl_assert_equal_i(prepared->refcount_, 3);
+    http_server_prepared_response_free(prepared);
+    const char * expected = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nOK";
+    struct http_server_buf * buf = TAILQ_FIRST(&client->buffer);
+    int i;
+    for (i = 0; i < 2; ++i)
+    {
+        cl_assert(!!buf);
+        cl_assert(buf->data == prepared->data);
+        cl_assert_equal_i(buf->size, strlen(expected));
+        cl_assert(memcmp(buf->data, expected, buf->size) == 0);
+        buf = TAILQ_NEXT(buf, bufs);
+    }
+    cl_assert(!buf);
+    cl_assert_equal_i(client->buffer_size_, 2 * strlen(expected));
+}
+
+void test_test_response__pool(void)
+{
+    http_server_response * res = http_server_response_acquire(client);
+    cl_assert(!!res);
+    cl_assert(res->client == client);
+    cl_assert_equal_i(http_server_response_set_header(res, (char*)content_length, strlen(content_length), "5", 1), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write(res, "Hello", 5), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_end(res), HTTP_SERVER_OK);
+    // Sent response goes back to the pool
+    SLIST_INSERT_HEAD(&server.clients, client, next);
+    cl_assert_equal_i(http_server_socket_action(&server, client->sock, HTTP_SERVER_POLL_OUT), HTTP_SERVER_OK);
+    SLIST_REMOVE(&server.clients, client, http_server_client, next);
+    cl_assert(TAILQ_EMPTY(&client->responses_));
+    cl_assert_equal_i(server.response_pool_len_, 1);
+    char data[128];
+    cl_assert(read(client_fds[1], data, sizeof(data)) > 0);
+    // and comes back reset
+    cl_assert(http_server_response_acquire(client) == res);
+    cl_assert_equal_i(server.response_pool_len_, 0);
+    cl_assert_equal_i(res->headers_sent, 0);
+    cl_assert_equal_i(res->is_done, 0);
+    cl_assert_equal_i(res->is_chunked, 1);
+    cl_assert_equal_i(live_headers(res), 1);
+    assert_header(res, 0, "Transfer-Encoding", "chunked");
+    cl_assert_equal_i(http_server_response_end(res), HTTP_SERVER_OK);
+}
+
+void test_test_response__printf(void)
+{
+    http_server_response * res = http_server_response_new();
+    cl_assert_equal_i(http_server_response_begin(client, res), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    // Longer than initial capacity of the buffer
+    char large[1000];
+    memset(large, 'x', sizeof(large) - 1);
+    large[sizeof(large) - 1] = '\0';
+    cl_assert_equal_i(http_server_response_printf(res, "%s", large), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_printf(res, "%s", ""), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_end(res), HTTP_SERVER_OK);
+    struct http_server_buf * buf = TAILQ_FIRST(&client->buffer);
+    assert_buf(&buf, "HTTP/1.1 200 OK\r\n");
+    assert_buf(&buf, "Transfer-Encoding: chunked\r\n");
+    assert_buf(&buf, "\r\n");
+    char expected[1024];
+    snprintf(expected, sizeof(expected), "3e7\r\n%s\r\n", large);
+    assert_buf(&buf, expected);
+    assert_buf(&buf, "0\r\n\r\n");
+    cl_assert(!buf);
+    http_server_response_free(res);
+}
+
+void test_test_response__printf_content_length(void)
+{
+    http_server_response * res = http_server_response_new();
+    cl_assert_equal_i(http_server_response_begin(client, res), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_set_header(res, (char*)content_length, strlen(content_length), "15", 2), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    // Formatted in place after previous output
+    cl_assert_equal_i(http_server_response_printf(res, "{\"id\":%d,", 1), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_printf(res, "\"ok\":%s}", "1"), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_end(res), HTTP_SERVER_OK);
+    struct http_server_buf * buf = TAILQ_FIRST(&client->buffer);
+    assert_buf(&buf, "HTTP/1.1 200 OK\r\n");
+    assert_buf(&buf, "Content-Length: 15\r\n");
+    assert_buf(&buf, "\r\n");
+    assert_buf(&buf, "{\"id\":1,\"ok\":1}");
+    cl_assert(!buf);
+    cl_assert_equal_i(client->buffer_size_, 17 + 20 + 2 + 15);
+    http_server_response_free(res);
+}
+
+void test_test_response__coalesce(void)
+{
+    http_server_response * res = http_server_response_acquire(client);
+    cl_assert(!!res);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write(res, "Hello", 5), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_printf(res, " %s!", "world"), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_end(res), HTTP_SERVER_OK);
+    // Whole response is a single block
+    struct http_server_buf * buf = TAILQ_FIRST(&client->buffer);
+    cl_assert(buf == TAILQ_LAST(&client->buffer, http_server_bufs));
+    cl_assert_equal_i(buf->capacity_, HTTP_SERVER_BUF_BLOCK_SIZE);
+    assert_buf(&buf, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nHello\r\n7\r\n world!\r\n0\r\n\r\n");
+    cl_assert(!buf);
+    // Large write gets a buffer of its own
+    char large[HTTP_SERVER_BUF_BLOCK_SIZE + 1];
+    memset(large, 'x', sizeof(large));
+    cl_assert_equal_i(http_server_client_write(client, large, sizeof(large)), HTTP_SERVER_OK);
+    buf = TAILQ_LAST(&client->buffer, http_server_bufs);
+    cl_assert(buf != TAILQ_FIRST(&client->buffer));
+    cl_assert_equal_i(buf->size, sizeof(large));
+    // Sent block goes back to the pool
+    SLIST_INSERT_HEAD(&server.clients, client, next);
+    cl_assert_equal_i(http_server_socket_action(&server, client->sock, HTTP_SERVER_POLL_OUT), HTTP_SERVER_OK);
+    SLIST_REMOVE(&server.clients, client, http_server_client, next);
+    cl_assert(TAILQ_EMPTY(&client->buffer));
+    cl_assert_equal_i(server.buf_pool_len_, 1);
+}
+
+void test_test_response__cork(void)
+{
+    http_server_response * res = http_server_response_acquire(client);
+    cl_assert(!!res);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_write(res, "Hello", 5), HTTP_SERVER_OK);
+    // Unfinished response that fits in one write is pushed out as is
+    SLIST_INSERT_HEAD(&server.clients, client, next);
+    cl_assert_equal_i(http_server_socket_action(&server, client->sock, HTTP_SERVER_POLL_OUT), HTTP_SERVER_OK);
+    cl_assert(TAILQ_EMPTY(&client->buffer));
+    cl_assert_equal_i(http_server_response_end(res), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_socket_action(&server, client->sock, HTTP_SERVER_POLL_OUT), HTTP_SERVER_OK);
+    SLIST_REMOVE(&server.clients, client, http_server_client, next);
+    const char * expected = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nHello\r\n0\r\n\r\n";
+    char data[128];
+    int len = 0, n;
+    while (len < (int)strlen(expected) && (n = read(client_fds[1], data + len, sizeof(data) - len)) > 0)
+    {
+        len += n;
+    }
+    cl_assert_equal_i(len, strlen(expected));
+    cl_assert(memcmp(data, expected, len) == 0);
+}
+
+static http_server_response * shed_first;
+static int shed_calls;
+static int shed_headers;
+static int shed_body;
+
+static int shed_header(http_server_client * client, void * data, const char * field, const char * value)
+{
+    shed_headers++;
+    return 0;
+}
+
+static int shed_on_body(http_server_client * client, void * data, const char * at, size_t size)
+{
+    shed_body++;
+    return 0;
+}
+
+static int shed_message_complete(http_server_client * client, void * data)
+{
+    shed_calls++;
+    shed_first = http_server_response_acquire(client);
+    return 0;
+}
+
+void test_test_response__shed_inflight(void)
+{
+    const char * requests = "GET /a HTTP/1.1\r\n\r\nPOST /b HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc";
+    shed_calls = 0;
+    shed_headers = 0;
+    shed_body = 0;
+    handler.on_message_complete = &shed_message_complete;
+    handler.on_header = &shed_header;
+    handler.on_body = &shed_on_body;
+    cl_assert_equal_i(http_server_setopt(&server, HTTP_SERVER_OPT_MAX_INFLIGHT, 1L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_setopt(&server, HTTP_SERVER_OPT_RETRY_AFTER, 7L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_perform_client(client, requests, strlen(requests)), HTTP_SERVER_OK);
+    // Second request did not reach the handler at all
+    cl_assert_equal_i(shed_calls, 1);
+    cl_assert_equal_i(shed_headers, 0);
+    cl_assert_equal_i(shed_body, 0);
+    cl_assert_equal_i(server.inflight_, 2);
+    cl_assert(TAILQ_EMPTY(&client->buffer));
+    cl_assert_equal_i(http_server_response_write_head(shed_first, 200), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_response_end(shed_first), HTTP_SERVER_OK);
+    struct http_server_buf * buf = TAILQ_FIRST(&client->buffer);
+    assert_buf(&buf, "HTTP/1.1 200 OK\r\n");
+    assert_buf(&buf, "Transfer-Encoding: chunked\r\n");
+    assert_buf(&buf, "\r\n");
+    assert_buf(&buf, "0\r\n\r\n");
+    assert_buf(&buf, "HTTP/1.1 503 Service Unavailable\r\n");
+    assert_buf(&buf, "Retry-After: 7\r\n");
+    assert_buf(&buf, "Content-Length: 20\r\n");
+    assert_buf(&buf, "\r\n");
+    assert_buf(&buf, "Service Unavailable\n");
+    cl_assert(!buf);
+}
+
+static int rate_calls;
+
+static int rate_message_complete(http_server_client * client, void * data)
+{
+    rate_calls++;
+    http_server_response * res = http_server_response_acquire(client);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    return http_server_response_end(res);
+}
+
+/**
+ * Copy the whole output queue as a string
+ */
+static void output_string(char * data, int size)
+{
+    int len = 0;
+    struct http_server_buf * buf;
+    TAILQ_FOREACH(buf, &client->buffer, bufs)
+    {
+        cl_assert(len + buf->size < size);
+        memcpy(data + len, buf->data, buf->size);
+        len += buf->size;
+    }
+    data[len] = '\0';
+}
+
+/**
+ * Count responses with the status line in the output queue
+ */
+static int count_responses(const char * status_line)
+{
+    char data[4096];
+    output_string(data, sizeof(data));
+    int n = 0;
+    const char * p = data;
+    while ((p = strstr(p, status_line)))
+    {
+        n++;
+        p++;
+    }
+    return n;
+}
+
+/**
+ * Move every bucket and the last sweep `ms` milliseconds into the past
+ */
+static void age_rate_table(unsigned long long ms)
+{
+    int i;
+    for (i = 0; i < server.rate_table_.capacity; ++i)
+    {
+        server.rate_table_.buckets[i].updated -= ms;
+    }
+    server.rate_table_.swept -= ms;
+}
+
+void test_test_response__rate_limit(void)
+{
+    const char * requests = "GET /a HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\n\r\nGET /c HTTP/1.1\r\n\r\n";
+    rate_calls = 0;
+    handler.on_message_complete = &rate_message_complete;
+    cl_assert_equal_i(http_server_setopt(&server, HTTP_SERVER_OPT_RATE_LIMIT, 1L), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_setopt(&server, HTTP_SERVER_OPT_RATE_BURST, 2L), HTTP_SERVER_OK);
+    // 127.0.0.1
+    memset(client->addr_, 0, sizeof(client->addr_));
+    client->addr_[10] = client->addr_[11] = 0xff;
+    client->addr_[12] = 127;
+    client->addr_[15] = 1;
+    client->has_addr_ = 1;
+    cl_assert_equal_i(http_server_perform_client(client, requests, strlen(requests)), HTTP_SERVER_OK);
+    // Burst of two requests is let through
+    cl_assert_equal_i(rate_calls, 2);
+    cl_assert_equal_i(count_responses("HTTP/1.1 200 OK\r\n"), 2);
+    cl_assert_equal_i(count_responses("HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\n"), 1);
+    cl_assert_equal_i(server.rate_table_.len, 1);
+    // Bucket refills one token per second
+    age_rate_table(1000);
+    cl_assert_equal_i(http_server_perform_client(client, requests, strlen(requests)), HTTP_SERVER_OK);
+    cl_assert_equal_i(rate_calls, 3);
+    cl_assert_equal_i(count_responses("HTTP/1.1 429 Too Many Requests\r\n"), 3);
+    // Full bucket is evicted by the next sweep and starts over
+    age_rate_table(60000);
+    client->addr_[15] = 2;
+    cl_assert_equal_i(http_server_perform_client(client, "GET / HTTP/1.1\r\n\r\n", 18), HTTP_SERVER_OK);
+    cl_assert_equal_i(rate_calls, 4);
+    cl_assert_equal_i(server.rate_table_.len, 1);
+}
+
+void test_test_response__stats(void)
+{
+    const char * request = "GET / HTTP/1.1\r\n\r\n";
+    rate_calls = 0;
+    handler.on_message_complete = &rate_message_complete;
+    SLIST_INSERT_HEAD(&server.clients, client, next);
+    cl_assert_equal_i(http_server_perform_client(client, request, strlen(request)), HTTP_SERVER_OK);
+    http_server_stats stats;
+    cl_assert_equal_i(http_server_get_stats(&server, &stats), HTTP_SERVER_OK);
+    cl_assert_equal_i(stats.requests, 1);
+    cl_assert_equal_i(stats.inflight, 1);
+    cl_assert_equal_i(stats.output_queued, client->buffer_size_);
+    cl_assert(stats.output_queued > 0);
+    cl_assert_equal_i(stats.first_byte.count, 1);
+    cl_assert_equal_i(stats.response.count, 0);
+    cl_assert_equal_i(http_server_socket_action(&server, client->sock, HTTP_SERVER_POLL_OUT), HTTP_SERVER_OK);
+    cl_assert_equal_i(http_server_get_stats(&server, &stats), HTTP_SERVER_OK);
+    cl_assert_equal_i(stats.responses, 1);
+    cl_assert_equal_i(stats.inflight, 0);
+    cl_assert_equal_i(stats.output_queued, 0);
+    cl_assert(stats.bytes_out > 0);
+    cl_assert_equal_i(stats.response.count, 1);
+    cl_assert(stats.response.max >= stats.first_byte.max);
+    cl_assert(http_server_histogram_quantile(&stats.response, 0.99) <= stats.response.max);
+    char data[256];
+    cl_assert(read(client_fds[1], data, sizeof(data)) > 0);
+    // Prometheus text
+    http_server_response * res = http_server_response_acquire(client);
+    cl_assert_equal_i(http_server_response_send_stats(res), HTTP_SERVER_OK);
+    SLIST_REMOVE(&server.clients, client, http_server_client, next);
+    char text[8192];
+    int size = 0;
+    struct http_server_buf * buf;
+    TAILQ_FOREACH(buf, &client->buffer, bufs)
+    {
+        cl_assert(size + buf->size < (int)sizeof(text));
+        memcpy(text + size, buf->data, buf->size);
+        size += buf->size;
+    }
+    text[size] = '\0';
+    cl_assert(strstr(text, "Content-Type: text/plain; version=0.0.4\r\n"));
+    cl_assert(strstr(text, "# TYPE http_server_requests_total counter\nhttp_server_requests_total 1\n"));
+    cl_assert(strstr(text, "http_server_responses_total 1\n"));
+    cl_assert(strstr(text, "http_server_response_seconds_bucket{le=\"+Inf\"} 1\n"));
+    cl_assert(strstr(text, "http_server_response_seconds_count 1\n"));
+}
+
+static http_server_request_trace traces[2];
+static int trace_calls;
+
+static int on_request_trace(http_server_client * client, void * data, const http_server_request_trace * trace)
+{
+    cl_assert(trace_calls < 2);
+    traces[trace_calls++] = *trace;
+    return HTTP_SERVER_OK;
+}
+
+void test_test_response__request_trace(void)
+{
+    const char * request = "GET /1 HTTP/1.1\r\n\r\nGET /2 HTTP/1.1\r\n\r\n";
+    rate_calls = 0;
+    trace_calls = 0;
+    handler.on_message_complete = &rate_message_complete;
+    handler.on_request_trace = &on_request_trace;
+    // Connection is timed from the start
+    http_server_client_free(client);
+    client = http_server_new_client(&server, client_fds[0], &handler);
+    cl_assert(client->trace_.accepted > 0);
+    SLIST_INSERT_HEAD(&server.clients, client, next);
+    cl_assert_equal_i(http_server_perform_client(client, request, strlen(request)), HTTP_SERVER_OK);
+    cl_assert_equal_i(rate_calls, 2);
+    cl_assert_equal_i(trace_calls, 0);
+    cl_assert_equal_i(http_server_socket_action(&server, client->sock, HTTP_SERVER_POLL_OUT), HTTP_SERVER_OK);
+    SLIST_REMOVE(&server.clients, client, http_server_client, next);
+    cl_assert_equal_i(trace_calls, 2);
+    int i;
+    for (i = 0; i < 2; ++i)
+    {
+        const http_server_request_trace * trace = &traces[i];
+        cl_assert(trace->accepted > 0);
+        cl_assert(trace->first_byte_read >= trace->accepted);
+        cl_assert(trace->headers_complete >= trace->first_byte_read);
+        cl_assert(trace->message_complete >= trace->headers_complete);
+        cl_assert(trace->response_begin >= trace->message_complete);
+        cl_assert(trace->first_byte_written >= trace->response_begin);
+        cl_assert(trace->last_byte_written >= trace->first_byte_written);
+    }
+    cl_assert(traces[0].accepted == traces[1].accepted);
+    cl_assert(traces[1].first_byte_read >= traces[0].message_complete);
+    // Both responses went out in a single write
+    cl_assert(traces[1].first_byte_written == traces[0].last_byte_written);
+}
+
+static int http10_message_complete(http_server_client * client, void * data)
+{
+    http_server_response * res = http_server_response_acquire(client);
+    cl_assert_equal_i(http_server_response_write_head(res, 200), HTTP_SERVER_OK);
+    if (data)
+    {
+        cl_assert_equal_i(http_server_response_set_header(res, "Content-Length", 14, "5", 1), HTTP_SERVER_OK);
+    }
+    cl_assert_equal_i(http_server_response_write(res, "Hello", 5), HTTP_SERVER_OK);
+    return http_server_response_end(res);
+}
+
+void test_test_response__http10_keep_alive(void)
+{
+    const char * request = "GET / HTTP/1.0\r\nConnection: keep-alive\r\n\r\n";
+    char data[4096];
+    handler.on_message_complete = &http10_message_complete;
+    // Body of unbuffered response is delimited by closing the connection
+    cl_assert_equal_i(http_server_perform_client(client, request, strlen(request)), HTTP_SERVER_OK);
+    output_string(data, sizeof(data));
+    cl_assert_equal_s(data, "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nHello");
+    cl_assert_equal_i(client->close_after_, 1);
+    cl_assert_equal_i(client->is_closing_, 1);
+    http_server_client_free(client);
+    // Response with Content-Length keeps the connection
+    client = http_server_new_client(&server, client_fds[0], &handler);
+    handler.on_message_complete_data = &handler;
+    cl_assert_equal_i(http_server_perform_client(client, request, strlen(request)), HTTP_SERVER_OK);
+    output_string(data, sizeof(data));
+    cl_assert_equal_s(data, "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nConnection: keep-alive\r\n\r\nHello");
+    cl_assert_equal_i(client->close_after_, 0);
+    cl_assert_equal_i(client->is_closing_, 0);
+}